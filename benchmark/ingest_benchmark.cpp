@@ -0,0 +1,518 @@
+// معيار أداء مسار الاستقبال من طرف إلى طرف دون تيليجرام ولا SQL Server:
+// عملاء HTTP -> WebhookServer -> BotManager (الفحص، الطوابير، الدفعات، الدمج، فهرس المعروفين) -> IUserStore.
+// جدول Users مخزن في الذاكرة مع تأخير تثبيت اختياري، وBot API خادم وهمي محلي يجيب getMe وsetWebhook.
+//
+//   ./storage_bot_benchmark --bots 100 --users 10000 --events 1000000 --clients 64 --commit-latency-us 2000
+//
+// يطبع أحداث/ثانية المستدامة (حتى تثبيت آخر حدث)، وp50/p99/p999 من الوصول حتى التثبيت،
+// وعدد التخصيصات لكل حدث في العملية كلها (الخادم والعملاء والمعالجات).
+
+#define STORAGE_BOT_NO_MAIN
+#include "../storage_bot_optimized.cpp"
+#include <iomanip>
+
+// =============== عدّاد التخصيصات ===============
+
+// تهيئة ثابتة (بلا مُنشئ)، فيصلح قبل أي تخصيص في العملية
+static StripedCounter allocationCount;
+
+void* operator new(size_t size) {
+    allocationCount.add();
+    if (void* memory = malloc(size ? size : 1)) return memory;
+    throw bad_alloc();
+}
+
+void* operator new(size_t size, align_val_t alignment) {
+    allocationCount.add();
+    auto align = static_cast<size_t>(alignment);
+    if (void* memory = aligned_alloc(align, (max<size_t>(size, 1) + align - 1) / align * align)) return memory;
+    throw bad_alloc();
+}
+
+void operator delete(void* memory) noexcept { free(memory); }
+void operator delete(void* memory, size_t) noexcept { free(memory); }
+void operator delete(void* memory, align_val_t) noexcept { free(memory); }
+void operator delete(void* memory, size_t, align_val_t) noexcept { free(memory); }
+
+// =============== بدائل الخدمات الخارجية ===============
+
+// جدول Users في الذاكرة. commitLatency يحاكي رحلة MERGE واحدة لكل جزء من الدفعة
+class InMemoryUserStore : public IUserStore {
+public:
+    explicit InMemoryUserStore(chrono::microseconds commitLatency) : commitLatency_(commitLatency) {}
+
+    unique_ptr<Writer> openWriter() override {
+        return make_unique<MemoryWriter>(*this);
+    }
+
+    size_t forEachUser(int64_t telegramBotId,
+                       const function<void(int64_t userId, const string& username, uint32_t ageSeconds)>& visit) override {
+        size_t stored = 0;
+        for (auto& partition : partitions_) {
+            lock_guard<mutex> lock(partition.rowsMutex);
+            for (const auto& [key, username] : partition.rows) {
+                if (key.first != telegramBotId) continue;
+                visit(key.second, username, 0);
+                ++stored;
+            }
+        }
+        return stored;
+    }
+
+    vector<pair<int64_t, size_t>> countUsersByBot() override {
+        map<int64_t, size_t> counts;
+        for (auto& partition : partitions_) {
+            lock_guard<mutex> lock(partition.rowsMutex);
+            for (const auto& entry : partition.rows) {
+                counts[entry.first.first]++;
+            }
+        }
+        return {counts.begin(), counts.end()};
+    }
+
+    // ميكروثانية من وصول الحدث حتى تثبيت صفه، موزونة بعدد الأحداث المدمجة
+    const StripedHistogram& commitLatencies() const { return *commitLatencies_; }
+    size_t rows() const { return rows_.load(); }
+
+private:
+    using Key = pair<int64_t, int64_t>;   // (BotID, UserID)
+
+    struct KeyHash {
+        size_t operator()(const Key& key) const {
+            return hash<int64_t>{}(key.second) * 0x9e3779b97f4a7c15ULL ^ hash<int64_t>{}(key.first);
+        }
+    };
+
+    struct alignas(64) Partition {
+        mutex rowsMutex;
+        unordered_map<Key, string, KeyHash> rows;
+    };
+
+    class MemoryWriter : public Writer {
+    public:
+        explicit MemoryWriter(InMemoryUserStore& store) : store_(store) {}
+
+        void upsert(const vector<MessageData>& batch, const BotRegistry& registry,
+                    vector<uint8_t>& inserted) override {
+            if (store_.commitLatency_.count() > 0) {
+                size_t chunks = (batch.size() + EnvironmentConfig::UPSERT_CHUNK_ROWS - 1) / EnvironmentConfig::UPSERT_CHUNK_ROWS;
+                this_thread::sleep_for(store_.commitLatency_ * chunks);
+            }
+
+            inserted.assign(batch.size(), 0);
+            for (size_t i = 0; i < batch.size(); ++i) {
+                const auto& msg = batch[i];
+                Key key{registry.slot(msg.botId).telegramId, msg.userId};
+                Partition& partition = store_.partitions_[KeyHash{}(key) % PARTITIONS];
+                lock_guard<mutex> lock(partition.rowsMutex);
+                auto [it, added] = partition.rows.try_emplace(key, msg.username);
+                if (added) {
+                    inserted[i] = 1;
+                    store_.rows_.add();
+                } else {
+                    it->second = msg.username;
+                }
+            }
+
+            auto now = chrono::steady_clock::now();
+            for (const auto& msg : batch) {
+                store_.commitLatencies_->record(static_cast<uint64_t>(
+                    chrono::duration_cast<chrono::microseconds>(now - msg.enqueuedAt).count()), msg.hitCount);
+            }
+        }
+
+        void release() override {}
+
+    private:
+        InMemoryUserStore& store_;
+    };
+
+    static constexpr size_t PARTITIONS = 64;
+
+    const chrono::microseconds commitLatency_;
+    array<Partition, PARTITIONS> partitions_;
+    StripedCounter rows_;
+    unique_ptr<StripedHistogram> commitLatencies_{make_unique<StripedHistogram>()};
+};
+
+// جدول Bots غير مُحاكى: حفظ البوت يفشل بتحذير كما لو كانت قاعدة البيانات غير متاحة
+class NullDatabaseManager : public IDatabaseManager {
+public:
+    explicit NullDatabaseManager(size_t poolSize) : poolSize_(poolSize) {}
+
+    unique_ptr<connection> getConnection() override { throw unavailable(); }
+    void releaseConnection(unique_ptr<connection>) override {}
+    void executeTransaction(const function<void(connection&)>&) override { throw unavailable(); }
+    void executeTransaction(connection&, const function<void(connection&)>&) override { throw unavailable(); }
+    statement& getPreparedStatement(connection&, const string&, const string&) override { throw unavailable(); }
+    size_t getPoolSize() const override { return poolSize_; }
+    size_t getActiveConnections() const override { return 0; }
+
+    void configure(const map<string, string>&) override {}
+    map<string, string> getConfiguration() const override { return {}; }
+    void collectMetrics(MetricSink&) const override {}
+    bool isHealthy() const override { return true; }
+    string getStatus() const override { return "in_memory"; }
+    void shutdown() override {}
+    bool isShutdown() const override { return false; }
+
+private:
+    static runtime_error unavailable() {
+        return runtime_error("لا توجد قاعدة بيانات في معيار الأداء");
+    }
+
+    size_t poolSize_;
+};
+
+// التوكنات وهمية فلا حاجة لتشفيرها
+class PlainTokenService : public IEncryptionService {
+public:
+    string encrypt(const string& data) override { return data; }
+    string decrypt(const string& encryptedData) override { return encryptedData; }
+    bool isKeyValid() const override { return true; }
+
+    void configure(const map<string, string>&) override {}
+    map<string, string> getConfiguration() const override { return {}; }
+    void collectMetrics(MetricSink&) const override {}
+    bool isHealthy() const override { return true; }
+    string getStatus() const override { return "plain"; }
+};
+
+// خادم Bot API وهمي على 127.0.0.1: getMe يعيد المعرّف من التوكن، وأي طريقة أخرى تنجح
+class FakeBotApi {
+public:
+    FakeBotApi() {
+        listenFd_ = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t length = sizeof(address);
+        if (listenFd_ < 0 || ::bind(listenFd_, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0 ||
+            ::listen(listenFd_, SOMAXCONN) < 0 ||
+            ::getsockname(listenFd_, reinterpret_cast<sockaddr*>(&address), &length) < 0) {
+            throw runtime_error("فشل في تشغيل خادم Bot API الوهمي");
+        }
+        url_ = "http://127.0.0.1:" + to_string(ntohs(address.sin_port));
+        acceptor_ = thread([this] { acceptLoop(); });
+    }
+
+    // اتصالات العميل المشترك تبقى مفتوحة حتى نهاية العملية، فخيوطها منفصلة
+    ~FakeBotApi() {
+        ::shutdown(listenFd_, SHUT_RDWR);
+        ::close(listenFd_);
+        acceptor_.join();
+    }
+
+    const string& url() const { return url_; }
+
+private:
+    void acceptLoop() {
+        for (;;) {
+            int fd = ::accept4(listenFd_, nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd < 0) return;
+            thread([fd] { serve(fd); }).detach();
+        }
+    }
+
+    // طلبات keep-alive متتالية على الاتصال حتى يغلقه العميل
+    static void serve(int fd) {
+        string input;
+        char buffer[4096];
+        for (;;) {
+            size_t headerEnd;
+            while ((headerEnd = input.find("\r\n\r\n")) == string::npos) {
+                ssize_t received = ::recv(fd, buffer, sizeof(buffer), 0);
+                if (received <= 0) {
+                    ::close(fd);
+                    return;
+                }
+                input.append(buffer, static_cast<size_t>(received));
+            }
+
+            string headers = input.substr(0, headerEnd);
+            size_t bodyLength = 0;
+            for (string_view name : {"Content-Length: ", "content-length: "}) {
+                if (size_t at = headers.find(name); at != string::npos) {
+                    bodyLength = stoul(headers.substr(at + name.size()));
+                }
+            }
+            if (headers.find("100-continue") != string::npos) {
+                sendAll(fd, "HTTP/1.1 100 Continue\r\n\r\n");
+            }
+            while (input.size() < headerEnd + 4 + bodyLength) {
+                ssize_t received = ::recv(fd, buffer, sizeof(buffer), 0);
+                if (received <= 0) {
+                    ::close(fd);
+                    return;
+                }
+                input.append(buffer, static_cast<size_t>(received));
+            }
+
+            // "GET /bot<id>:<secret>/getMe HTTP/1.1"
+            size_t pathStart = headers.find(' ') + 1;
+            string path = headers.substr(pathStart, headers.find(' ', pathStart) - pathStart);
+            string body = R"({"ok":true,"result":true})";
+            if (path.ends_with("/getMe")) {
+                string id = path.substr(4, path.find(':') - 4);
+                body = R"({"ok":true,"result":{"id":)" + id +
+                       R"(,"is_bot":true,"first_name":"Bench )" + id + R"(","username":"bench_)" + id + R"(_bot"}})";
+            }
+            sendAll(fd, "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nContent-Length: " +
+                        to_string(body.size()) + "\r\n\r\n" + body);
+            input.erase(0, headerEnd + 4 + bodyLength);
+        }
+    }
+
+    static void sendAll(int fd, const string& data) {
+        size_t sent = 0;
+        while (sent < data.size()) {
+            ssize_t written = ::send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+            if (written <= 0) return;
+            sent += static_cast<size_t>(written);
+        }
+    }
+
+    int listenFd_{-1};
+    string url_;
+    thread acceptor_;
+};
+
+// =============== مولّد الحمل ===============
+
+struct BenchmarkOptions {
+    size_t bots{100};
+    size_t usersPerBot{10000};
+    size_t events{1000000};
+    size_t clients{64};
+    size_t batchWorkers{4};
+    size_t webhookWorkers{EnvironmentConfig::WEBHOOK_WORKERS};
+    uint16_t webhookPort{18443};
+    chrono::microseconds commitLatency{0};
+};
+
+// يقرأ فقط القيم التي يراقبها المعيار، فلا يخصص أثناء الانتظار
+class SelectedMetricSink : public MetricSink {
+public:
+    void gauge(string_view name, double value) override {
+        if (name == "committed_events") committedEvents = value;
+    }
+
+    double committedEvents{0};
+};
+
+struct ClientTotals {
+    atomic<size_t> sent{0};
+    atomic<size_t> rejected{0};   // 503: الطابور ممتلئ، يُعاد الإرسال كما يفعل تيليجرام
+    atomic<size_t> failed{0};
+};
+
+// اتصال keep-alive واحد يرسل أحداثه بالتتابع؛ المستخدم والبوت عشوائيان بتوزيع منتظم
+void runClient(const BenchmarkOptions& options, const vector<string>& paths, size_t events, uint64_t seed,
+               StripedHistogram& ackLatencies, ClientTotals& totals) {
+    int fd = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(options.webhookPort);
+    int enable = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+    if (::connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0) {
+        ::close(fd);
+        totals.failed += events;
+        return;
+    }
+
+    char body[512];
+    char request[1024];
+    char response[512];
+    uint64_t state = seed | 1;
+    auto next = [&state] {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return state;
+    };
+
+    for (size_t i = 0; i < events; ++i) {
+        const string& path = paths[next() % paths.size()];
+        auto userId = static_cast<long long>(1000000000 + next() % options.usersPerBot);
+        int bodyLength = snprintf(body, sizeof(body),
+            R"({"update_id":%zu,"message":{"message_id":%zu,"from":{"id":%lld,"is_bot":false,)"
+            R"("first_name":"Bench","username":"bench_user_%lld"},"chat":{"id":%lld,"type":"private"},)"
+            R"("date":1700000000,"text":"hi"}})", i, i, userId, userId, userId);
+        int requestLength = snprintf(request, sizeof(request),
+            "POST %s HTTP/1.1\r\nHost: 127.0.0.1\r\nContent-Type: application/json\r\n"
+            "Content-Length: %d\r\n\r\n%s", path.c_str(), bodyLength, body);
+
+        for (;;) {
+            auto started = chrono::steady_clock::now();
+            if (::send(fd, request, static_cast<size_t>(requestLength), MSG_NOSIGNAL) != requestLength) {
+                totals.failed += events - i;
+                ::close(fd);
+                return;
+            }
+
+            // الردود بلا جسم (Content-Length: 0)، فالرد ينتهي بنهاية الترويسات
+            size_t received = 0;
+            while (received < 4 || memcmp(response + received - 4, "\r\n\r\n", 4) != 0) {
+                ssize_t count = ::recv(fd, response + received, sizeof(response) - received, 0);
+                if (count <= 0 || received + static_cast<size_t>(count) >= sizeof(response)) {
+                    totals.failed += events - i;
+                    ::close(fd);
+                    return;
+                }
+                received += static_cast<size_t>(count);
+            }
+            ackLatencies.record(static_cast<uint64_t>(
+                chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - started).count()));
+
+            int status = atoi(response + 9);   // "HTTP/1.1 200"
+            if (status == 200) {
+                totals.sent++;
+                break;
+            }
+            if (status != 503) {
+                totals.failed++;
+                break;
+            }
+            totals.rejected++;
+            this_thread::sleep_for(chrono::milliseconds(1));
+        }
+    }
+    ::close(fd);
+}
+
+optional<BenchmarkOptions> parseOptions(int argc, char* argv[]) {
+    BenchmarkOptions options;
+    for (int i = 1; i < argc; ++i) {
+        string_view flag = argv[i];
+        if (i + 1 >= argc) return nullopt;
+        size_t value = stoul(argv[++i]);
+        if (flag == "--bots") options.bots = max<size_t>(1, value);
+        else if (flag == "--users") options.usersPerBot = max<size_t>(1, value);
+        else if (flag == "--events") options.events = value;
+        else if (flag == "--clients") options.clients = max<size_t>(1, value);
+        else if (flag == "--batch-workers") options.batchWorkers = max<size_t>(1, value);
+        else if (flag == "--webhook-workers") options.webhookWorkers = max<size_t>(1, value);
+        else if (flag == "--webhook-port") options.webhookPort = static_cast<uint16_t>(value);
+        else if (flag == "--commit-latency-us") options.commitLatency = chrono::microseconds(value);
+        else return nullopt;
+    }
+    return options;
+}
+
+double percentileMs(const Histogram& histogram, double percentile) {
+    return histogram.percentile(percentile) / 1000.0;
+}
+
+int main(int argc, char* argv[]) {
+    optional<BenchmarkOptions> parsed;
+    try {
+        parsed = parseOptions(argc, argv);
+    } catch (const exception&) {
+    }
+    if (!parsed) {
+        cerr << "الاستخدام: " << argv[0] << " [--bots N] [--users M] [--events E] [--clients C]"
+             << " [--batch-workers W] [--webhook-workers W] [--webhook-port P] [--commit-latency-us L]" << endl;
+        return 2;
+    }
+    const BenchmarkOptions& options = *parsed;
+
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+
+    // telegramApiUrl() يقرأ المتغير مرة واحدة، فيُضبط قبل إنشاء أي بوت
+    FakeBotApi fakeApi;
+    setenv("TELEGRAM_API_URL", fakeApi.url().c_str(), 1);
+
+    auto userStore = make_shared<InMemoryUserStore>(options.commitLatency);
+    auto webhookServer = make_shared<WebhookServer>(options.webhookPort, options.webhookWorkers);
+    auto botManager = make_shared<BotManager>(make_shared<NullDatabaseManager>(options.batchWorkers + EnvironmentConfig::DB_POOL_RESERVE),
+        make_shared<PlainTokenService>(), webhookServer, options.batchWorkers, nullptr, nullptr, userStore);
+    // نفس متغيرات البيئة التي تضبط الخدمة (BATCH_MAX_DELAY_MS، ADMISSION_TIMEOUT_MS...)
+    botManager->configure(SystemInitializer::loadBotManagerConfig());
+
+    // حفظ كل بوت في جدول Bots يفشل بتحذير متوقع؛ يُكتم أثناء التشغيل فقط
+    auto* errors = cerr.rdbuf(nullptr);
+    size_t started = 0;
+    for (size_t i = 0; i < options.bots; ++i) {
+        BotConfig config;
+        config.encryptedToken = to_string(7000000000 + i) + ":BENCHMARK";
+        started += botManager->startBot(config);
+    }
+    cerr.rdbuf(errors);
+    if (started != options.bots) {
+        cerr << "❌ بدأ " << started << "/" << options.bots << " بوت فقط" << endl;
+        return 1;
+    }
+
+    vector<string> paths;
+    for (const auto& bot : *botManager->getActiveBots()) {
+        paths.push_back(bot->webhookPath);
+    }
+
+    cout << "⏱️ " << options.events << " حدث من " << options.bots << " بوت × " << options.usersPerBot
+         << " مستخدم، " << options.clients << " عميل، " << options.batchWorkers << " معالج دفعات، تأخير التثبيت "
+         << options.commitLatency.count() << " µs" << endl;
+
+    auto ackLatencies = make_unique<StripedHistogram>();
+    ClientTotals totals;
+    size_t allocationsBefore = allocationCount.load();
+    auto loadStarted = chrono::steady_clock::now();
+
+    vector<thread> clients;
+    for (size_t i = 0; i < options.clients; ++i) {
+        size_t share = options.events / options.clients + (i < options.events % options.clients ? 1 : 0);
+        clients.emplace_back(runClient, cref(options), cref(paths), share, 0x9e3779b97f4a7c15ULL * (i + 1),
+                             ref(*ackLatencies), ref(totals));
+    }
+    for (auto& client : clients) {
+        client.join();
+    }
+    auto acked = chrono::steady_clock::now();
+
+    // الحدث "مُثبّت" عندما تُثبّت دفعته، سواء كُتب صفه أو تخطاه فهرس المعروفين
+    SelectedMetricSink progress;
+    auto deadline = acked + chrono::seconds(60);
+    while (progress.committedEvents < totals.sent && chrono::steady_clock::now() < deadline) {
+        this_thread::sleep_for(chrono::milliseconds(1));
+        botManager->collectMetrics(progress);
+    }
+    auto committed = chrono::steady_clock::now();
+    size_t allocations = allocationCount.load() - allocationsBefore;
+
+    double loadSeconds = chrono::duration<double>(committed - loadStarted).count();
+    double ackSeconds = chrono::duration<double>(acked - loadStarted).count();
+    auto commitHistogram = make_unique<Histogram>();
+    userStore->commitLatencies().mergeInto(*commitHistogram);
+    auto ackHistogram = make_unique<Histogram>();
+    ackLatencies->mergeInto(*ackHistogram);
+
+    MapMetricSink metrics;
+    botManager->collectMetrics(metrics);
+
+    cout << fixed << setprecision(2);
+    cout << "📊 النتائج:" << endl;
+    cout << "  - أحداث مثبّتة: " << static_cast<size_t>(progress.committedEvents) << "/" << totals.sent
+         << " (رفض 503: " << totals.rejected << "، فشل: " << totals.failed << ")" << endl;
+    cout << "  - المعدل المستدام: " << totals.sent / loadSeconds << " حدث/ث (الإقرار: "
+         << totals.sent / ackSeconds << " حدث/ث)" << endl;
+    cout << "  - الوصول حتى التثبيت (ms): p50 " << percentileMs(*commitHistogram, 50)
+         << "، p99 " << percentileMs(*commitHistogram, 99)
+         << "، p999 " << percentileMs(*commitHistogram, 99.9)
+         << "، max " << commitHistogram->maxValue() / 1000.0
+         << " (" << commitHistogram->count() << " حدث كُتب صفه)" << endl;
+    cout << "  - زمن الإقرار عند العميل (ms): p50 " << percentileMs(*ackHistogram, 50)
+         << "، p99 " << percentileMs(*ackHistogram, 99) << "، p999 " << percentileMs(*ackHistogram, 99.9) << endl;
+    cout << "  - تخصيصات لكل حدث: " << static_cast<double>(allocations) / max<size_t>(1, totals.sent) << endl;
+    cout << "  - صفوف Users: " << userStore->rows()
+         << "، مدمجة: " << static_cast<size_t>(metrics.values["coalesced_events"])
+         << "، متخطاة: " << static_cast<size_t>(metrics.values["skipped_upserts"])
+         << "، حجم الدفعة p50/p99: " << metrics.values["batch_size_p50"] << "/" << metrics.values["batch_size_p99"]
+         << endl;
+
+    webhookServer->shutdown();
+    botManager->shutdown();
+
+    bool complete = totals.failed == 0 && progress.committedEvents >= totals.sent;
+    return complete ? 0 : 1;
+}
@@ -1,19 +1,31 @@
 #include <iostream>
 #include <string>
 #include <map>
+#include <unordered_map>
+#include <set>
+#include <string_view>
 #include <thread>
 #include <atomic>
 #include <memory>
 #include <queue>
+#include <deque>
+#include <list>
 #include <condition_variable>
 #include <mutex>
 #include <chrono>
+#include <array>
+#include <bit>
 #include <stdexcept>
+#include <limits>
 #include <tgbot/tgbot.h>
+#include <curl/curl.h>
 #include <nanodbc/nanodbc.h>
 #include <crypto++/aes.h>
 #include <crypto++/gcm.h>
 #include <crypto++/base64.h>
+#include <crypto++/sha.h>
+#include <crypto++/hex.h>
+#include <crypto++/filters.h>
 #include <cstdlib>
 #include <vector>
 #include <functional>
@@ -29,6 +41,24 @@
 #include <filesystem>
 #include <fstream>
 #include <sstream>
+#include <cstring>
+#include <cstdio>
+#include <cmath>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <boost/crc.hpp>
+#include <charconv>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 using namespace std;
 using namespace TgBot;
@@ -39,18 +69,79 @@ using namespace CryptoPP;
 
 namespace EnvironmentConfig {
     // حدود الموارد
-    static constexpr size_t MAX_ACTIVE_BOTS = 50;
-    static constexpr size_t MAX_CONCURRENT_TASKS = 100;
-    static constexpr size_t BATCH_SIZE = 100;
+    static constexpr size_t MAX_ACTIVE_BOTS = 5000;
+    static constexpr size_t MAX_BOT_IDS = 16384;             // بوتات مختلفة منذ بدء العملية (لا يُعاد استخدام المعرّف)
+    static constexpr size_t BOT_RESTORE_PARALLELISM = 16;    // بوتات تُستعاد معاً عند الإقلاع (getMe + setWebhook لكل منها)
+    static constexpr size_t MAX_CONCURRENT_TASKS = 2048;    // أحداث مقبولة لم تُثبّت بعد في قاعدة البيانات
+    static constexpr int ADMISSION_TIMEOUT_MS = 200;
+    static constexpr size_t SPILL_BUFFER_CAPACITY = 100000;  // مخزن الفائض في الذاكرة عند تعطيل السجل
+    
+    // سجل الكتابة المسبقة
+    static constexpr uint64_t SPILL_SEGMENT_BYTES = 16 * 1024 * 1024;
+    static constexpr size_t SPILL_FLUSH_BYTES = 256 * 1024;
+    static constexpr int SPILL_SYNC_INTERVAL_MS = 2;
+    static constexpr uint32_t SPILL_MAX_RECORD_BYTES = 4096;
+    static constexpr int SPILL_REPLAY_INTERVAL_SECONDS = 5;
+    
+    // فهرس المستخدمين المعروفين
+    static constexpr size_t SEEN_INDEX_MEMORY_PERCENT = 50;   // نصيب كل الفهارس معاً من MAX_MEMORY_USAGE_MB
+    static constexpr int LAST_SEEN_GRANULARITY_SECONDS = 900;
+    static constexpr int STATS_RECONCILE_INTERVAL_SECONDS = 300;   // مطابقة عدادات البوتات مع COUNT في الخلفية
+    static constexpr size_t INGEST_QUEUE_CAPACITY = 4096;   // يُقرّب إلى قوة 2
+    static constexpr size_t BATCH_SIZE = 100;               // الحد الابتدائي للدفعة التكيفية
+    static constexpr size_t MIN_BATCH_SIZE = 16;
+    static constexpr size_t MAX_BATCH_SIZE = 2048;
+    static constexpr int BATCH_TARGET_LATENCY_MS = 50;       // زمن التثبيت المستهدف لكل دفعة
+    static constexpr int BATCH_MAX_DELAY_MS = 500;           // أقصى بقاء لحدث في نافذة الدفعة
+    static constexpr size_t UPSERT_SMALL_CHUNK_ROWS = 16;
+    static constexpr size_t UPSERT_CHUNK_ROWS = 256;   // 3 معاملات لكل صف، أقل من حد SQL Server (2100)
     static constexpr size_t DB_POOL_SIZE = 10;
+    static constexpr size_t DB_POOL_MIN_SIZE = 5;            // تُفتح عند البدء ولا يُطرد ما دونها
+    static constexpr size_t DB_POOL_RESERVE = 2;             // اتصالات لا تحجزها معالجات الدفعات (الإحصائيات، الإذاعة، الإزاحات)
+    static constexpr int DB_VALIDATION_IDLE_SECONDS = 30;    // SELECT 1 فقط للاتصال الخامل أطول من هذا
+    static constexpr int DB_IDLE_TIMEOUT_SECONDS = 300;      // طرد الاتصالات الزائدة عن الحد الأدنى
+    static constexpr int DB_HEALTH_CHECK_INTERVAL_SECONDS = 15;
     static constexpr size_t MAX_MEMORY_USAGE_MB = 512;
     static constexpr size_t MAX_CPU_USAGE_PERCENT = 80;
     
     // إعدادات الشبكة
-    static constexpr int WEBHOOK_TIMEOUT_SECONDS = 30;
+    static constexpr uint16_t WEBHOOK_PORT = 8443;
+    static constexpr uint16_t METRICS_PORT = 9090;         // /metrics و/health و/status (0 = معطل)
+    static constexpr size_t WEBHOOK_WORKERS = 16;          // كل عامل ينتظر حفظ الحدث على القرص قبل الرد
+    static constexpr size_t WEBHOOK_QUEUE_CAPACITY = 4096;
+    static constexpr size_t WEBHOOK_MAX_REQUEST_BYTES = 1024 * 1024;
+    static constexpr int WEBHOOK_TIMEOUT_SECONDS = 30;     // إغلاق الاتصالات الخاملة
+    
+    // وضع السحب الطويل (INGESTION_MODE=polling)
+    static constexpr size_t POLLING_WORKERS = 4;           // كل عامل يسحب لعدة بوتات معاً
+    static constexpr int POLLING_TIMEOUT_SECONDS = 25;     // مهلة getUpdates عند تيليجرام
+    static constexpr size_t POLLING_LIMIT = 100;           // أقصى ما يقبله getUpdates
+    static constexpr int POLLING_MAX_BACKOFF_SECONDS = 60;
+    static constexpr size_t POLLING_MAX_RESPONSE_BYTES = 16 * 1024 * 1024;
+    static constexpr int POLLING_OFFSET_FLUSH_SECONDS = 5;
+    
+    // عميل Bot API المشترك (getMe، setWebhook، sendMessage...)
+    static constexpr size_t BOT_API_MAX_CONCURRENCY = 64;  // طلبات صادرة متزامنة لكل العملية
+    static constexpr long BOT_API_TIMEOUT_SECONDS = 30;
     static constexpr int DB_CONNECTION_TIMEOUT_SECONDS = 5;
     static constexpr int RETRY_ATTEMPTS = 3;
     
+    // الإذاعة (حدود تيليجرام: ~30 رسالة/ثانية لكل بوت، ورسالة/ثانية لكل محادثة)
+    static constexpr double BROADCAST_RATE_PER_SECOND = 30;
+    static constexpr size_t BROADCAST_BURST = 30;
+    static constexpr size_t BROADCAST_SENDERS = 16;        // طلبات sendMessage متزامنة لكل إذاعة
+    static constexpr size_t BROADCAST_PAGE_SIZE = 1000;    // مستلمون في الذاكرة ونقطة حفظ بعد كل صفحة
+    static constexpr int BROADCAST_CHAT_INTERVAL_MS = 1000;
+    static constexpr int BROADCAST_MAX_ATTEMPTS = 5;
+    
+    // تصدير المستخدمين (الذاكرة ≈ (EXPORT_QUEUE_PAGES + 2) صفحة مهما بلغ عدد الصفوف)
+    static constexpr size_t EXPORT_PAGE_ROWS = 8192;
+    static constexpr size_t EXPORT_QUEUE_PAGES = 4;
+    static constexpr uint64_t EXPORT_MAX_UPLOAD_BYTES = 50 * 1024 * 1024;   // حد رفع الملفات في Bot API
+    
+    // إعدادات التشفير
+    static constexpr size_t TOKEN_CACHE_CAPACITY = MAX_ACTIVE_BOTS;   // توكنات مفكوكة في الذاكرة
+    
     // إعدادات النظام
     static constexpr bool ENABLE_LOGGING = true;
     static constexpr bool ENABLE_METRICS = true;
@@ -67,13 +158,41 @@ public:
     virtual ~IConfigurable() = default;
 };
 
+// مستقبل المقاييس: المكوّنات تكتب قيمها مباشرة فلا يُبنى map عند كل طلب
+class MetricSink {
+public:
+    virtual void gauge(string_view name, double value) = 0;
+    // قيمة خاصة ببوت واحد؛ المستقبلات التي لا تدعم التسميات تتجاهلها
+    virtual void botGauge(string_view name, int64_t botId, string_view username, double value) {
+        (void)name; (void)botId; (void)username; (void)value;
+    }
+    virtual ~MetricSink() = default;
+};
+
+class MapMetricSink : public MetricSink {
+public:
+    void gauge(string_view name, double value) override {
+        values[string(name)] = value;
+    }
+
+    map<string, double> values;
+};
+
 // واجهة أساسية للكائنات القابلة للمراقبة
 class IMonitorable {
 public:
-    virtual map<string, double> getMetrics() const = 0;
+    // لا يأخذ أقفال مسار الرسائل ولا يخصص ذاكرة؛ يستدعيه خادم المقاييس عند كل طلب
+    virtual void collectMetrics(MetricSink& sink) const = 0;
     virtual bool isHealthy() const = 0;
     virtual string getStatus() const = 0;
     virtual ~IMonitorable() = default;
+
+    // نسخة بالاسم للوحة التحكم والسجلات؛ تبني map في كل استدعاء
+    map<string, double> getMetrics() const {
+        MapMetricSink sink;
+        collectMetrics(sink);
+        return move(sink.values);
+    }
 };
 
 // واجهة أساسية للكائنات القابلة للإغلاق الآمن
@@ -86,25 +205,70 @@ public:
 
 // =============== هيكل تكوين البوت المحسن ===============
 
+// معرّف كثيف للبوت داخل العملية: فهرس مباشر في جدول البوتات بدلاً من التوكن المشفر
+using BotId = uint32_t;
+static constexpr BotId INVALID_BOT_ID = numeric_limits<BotId>::max();
+
+// معرّف البوت في تيليجرام هو الجزء الرقمي قبل ':' في التوكن، وهو ثابت بخلاف التوكن المشفر
+inline int64_t telegramBotIdFromToken(const string& token) {
+    size_t colon = token.find(':');
+    if (colon == 0 || colon == string::npos || colon > 19 ||
+        !all_of(token.begin(), token.begin() + colon, [](unsigned char c) { return isdigit(c); })) {
+        throw invalid_argument("صيغة توكن البوت غير صالحة");
+    }
+    return stoll(token.substr(0, colon));
+}
+
+// TELEGRAM_API_URL يوجّه كل البوتات إلى خادم Bot API آخر (خادم محلي، أو خادم وهمي في الاختبارات)
+inline const string& telegramApiUrl() {
+    static const string url = [] {
+        const char* value = getenv("TELEGRAM_API_URL");
+        return string(value && *value ? value : "https://api.telegram.org");
+    }();
+    return url;
+}
+
 struct BotConfig : public IConfigurable {
     string token;
     string name;
     string username;
     string encryptedToken;
-    atomic<long> storedUsers{0};
-    atomic<long> totalUsers{0};
+    int64_t telegramId{0};            // مفتاح البوت في جدول Users
+    BotId botId{INVALID_BOT_ID};      // يُسند عند startBot
     atomic<bool> isActive{true};
     atomic<bool> isRunning{false};
     atomic<bool> isInitialized{false};
-    future<void> botThread;
-    promise<void> shutdownPromise;
-    shared_ptr<barrier<>> initBarrier;
+    string webhookPath;               // مسار البوت في خادم Webhook المشترك
+    int64_t updateOffset{0};          // إزاحة getUpdates المحفوظة في وضع السحب
     
     // إعدادات الأداء
     size_t maxConcurrentUsers{1000};
     size_t messageQueueSize{1000};
     chrono::milliseconds processingTimeout{5000};
-    
+
+    BotConfig() = default;
+    BotConfig(const BotConfig& other) { *this = other; }
+
+    // الأعضاء الذرية لا تُنسخ تلقائياً؛ تُنقل قيمها الحالية
+    BotConfig& operator=(const BotConfig& other) {
+        if (this == &other) return *this;
+        token = other.token;
+        name = other.name;
+        username = other.username;
+        encryptedToken = other.encryptedToken;
+        telegramId = other.telegramId;
+        botId = other.botId;
+        isActive = other.isActive.load();
+        isRunning = other.isRunning.load();
+        isInitialized = other.isInitialized.load();
+        webhookPath = other.webhookPath;
+        updateOffset = other.updateOffset;
+        maxConcurrentUsers = other.maxConcurrentUsers;
+        messageQueueSize = other.messageQueueSize;
+        processingTimeout = other.processingTimeout;
+        return *this;
+    }
+
     void configure(const map<string, string>& config) override {
         if (config.count("max_concurrent_users")) {
             maxConcurrentUsers = stoul(config.at("max_concurrent_users"));
@@ -126,516 +290,866 @@ struct BotConfig : public IConfigurable {
     }
 };
 
-// =============== واجهات الخدمات المحسنة ===============
-
-class IDatabaseManager : public IConfigurable, public IMonitorable, public IShutdownable {
-public:
-    virtual unique_ptr<connection> getConnection() = 0;
-    virtual void releaseConnection(unique_ptr<connection> conn) = 0;
-    virtual void executeTransaction(const function<void(connection&)>& func) = 0;
-    virtual size_t getPoolSize() const = 0;
-    virtual size_t getActiveConnections() const = 0;
-    virtual ~IDatabaseManager() = default;
-};
+// لقطة غير قابلة للتعديل من البوتات النشطة، تُنشر من جديد عند كل تغيير.
+// القراء (الإحصائيات، /status) يحملون مؤشراً ذرياً ولا يلمسون botsMutex_
+using BotTable = vector<shared_ptr<BotConfig>>;
 
-class IEncryptionService : public IConfigurable, public IMonitorable {
-public:
-    virtual string encrypt(const string& data) = 0;
-    virtual string decrypt(const string& encryptedData) = 0;
-    virtual bool isKeyValid() const = 0;
-    virtual ~IEncryptionService() = default;
-};
+// =============== بيانات الرسائل ===============
 
-class IBotManager : public IConfigurable, public IMonitorable, public IShutdownable {
-public:
-    virtual bool startBot(const BotConfig& config) = 0;
-    virtual bool stopBot(const string& encryptedToken) = 0;
-    virtual bool pauseBot(const string& encryptedToken) = 0;
-    virtual bool resumeBot(const string& encryptedToken) = 0;
-    virtual map<string, BotConfig> getActiveBots() = 0;
-    virtual size_t getTotalBots() const = 0;
-    virtual size_t getActiveBotsCount() const = 0;
-    virtual ~IBotManager() = default;
+struct MessageData {
+    BotId botId;
+    int64_t userId;
+    string username;
+    uint32_t hitCount{1};   // عدد الأحداث المدمجة في هذا السجل
+    chrono::steady_clock::time_point enqueuedAt{};   // وقت أقدم حدث مدمج
+    uint64_t spillSegment{0};   // مقطع سجل الفائض الذي يحمل الحدث (0 = غير مسجل)
 };
 
-// =============== مدير قاعدة البيانات المحسن ===============
+// =============== هياكل بيانات متزامنة ===============
 
-class DatabaseManager : public IDatabaseManager {
+// طابور حلقي محدود بدون أقفال: منتجون متعددون ومستهلك واحد.
+// كل خانة تحمل رقم تسلسل يحدد ما إذا كانت جاهزة للكتابة أو للقراءة.
+template <typename T>
+class MpscRingBuffer {
 public:
-    explicit DatabaseManager(const string& connStr, size_t poolSize = EnvironmentConfig::DB_POOL_SIZE) 
-        : connectionString_(connStr), maxPoolSize_(poolSize) {
-        initializePool();
+    explicit MpscRingBuffer(size_t capacity)
+        : capacity_(roundUpToPowerOfTwo(capacity)), mask_(capacity_ - 1),
+          slots_(make_unique<Slot[]>(capacity_)) {
+        for (size_t i = 0; i < capacity_; ++i) {
+            slots_[i].sequence.store(i, memory_order_relaxed);
+        }
     }
 
-    ~DatabaseManager() override {
-        shutdown();
-    }
+    MpscRingBuffer(const MpscRingBuffer&) = delete;
+    MpscRingBuffer& operator=(const MpscRingBuffer&) = delete;
 
-    unique_ptr<connection> getConnection() override {
-        unique_lock<mutex> lock(poolMutex_);
-        
-        for (int attempts = 0; attempts < EnvironmentConfig::RETRY_ATTEMPTS; ++attempts) {
-            if (availableConnections_.empty()) {
-                if (totalConnections_ < maxPoolSize_) {
-                    auto conn = createNewConnection();
-                    if (conn) return conn;
-                }
-                
-                if (!connectionCV_.wait_for(lock, 
-                    chrono::seconds(EnvironmentConfig::DB_CONNECTION_TIMEOUT_SECONDS),
-                    [this] { return !availableConnections_.empty() || shutdownFlag_; })) {
-                    continue;
-                }
-            }
+    // آمن من عدة خيوط؛ يعيد false إذا كان الطابور ممتلئاً
+    bool tryPush(T&& value) {
+        size_t pos = tail_.load(memory_order_relaxed);
+        for (;;) {
+            Slot& slot = slots_[pos & mask_];
+            size_t seq = slot.sequence.load(memory_order_acquire);
+            auto diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
             
-            if (!availableConnections_.empty()) {
-                auto conn = move(availableConnections_.front());
-                availableConnections_.pop();
-                
-                if (isConnectionValid(*conn)) {
-                    return conn;
-                } else {
-                    totalConnections_--;
+            if (diff == 0) {
+                if (tail_.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) {
+                    slot.value = move(value);
+                    slot.sequence.store(pos + 1, memory_order_release);
+                    return true;
                 }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = tail_.load(memory_order_relaxed);
             }
         }
-        
-        throw runtime_error("فشل في الحصول على اتصال قاعدة البيانات");
     }
 
-    void releaseConnection(unique_ptr<connection> conn) override {
-        if (!conn) return;
+    // للمستهلك الوحيد فقط: ينقل حتى maxItems عنصراً دفعة واحدة
+    size_t drain(vector<T>& out, size_t maxItems) {
+        size_t pos = head_.load(memory_order_relaxed);
+        size_t count = 0;
         
-        lock_guard<mutex> lock(poolMutex_);
-        if (!shutdownFlag_ && isConnectionValid(*conn)) {
-            availableConnections_.push(move(conn));
-            connectionCV_.notify_one();
-        } else {
-            totalConnections_--;
-        }
-    }
-
-    void executeTransaction(const function<void(connection&)>& func) override {
-        auto conn = getConnection();
-        try {
-            conn->begin();
-            func(*conn);
-            conn->commit();
-        } catch (...) {
-            conn->rollback();
-            throw;
+        while (count < maxItems) {
+            Slot& slot = slots_[pos & mask_];
+            if (slot.sequence.load(memory_order_acquire) != pos + 1) break;
+            
+            out.push_back(move(slot.value));
+            slot.sequence.store(pos + capacity_, memory_order_release);
+            ++pos;
+            ++count;
         }
-        releaseConnection(move(conn));
+        
+        head_.store(pos, memory_order_relaxed);
+        return count;
     }
 
-    void configure(const map<string, string>& config) override {
-        lock_guard<mutex> lock(poolMutex_);
-        if (config.count("pool_size")) {
-            size_t newSize = stoul(config.at("pool_size"));
-            if (newSize > maxPoolSize_) {
-                maxPoolSize_ = newSize;
-            }
-        }
+    // للمستهلك الوحيد فقط
+    bool empty() const {
+        size_t pos = head_.load(memory_order_relaxed);
+        return slots_[pos & mask_].sequence.load(memory_order_acquire) != pos + 1;
     }
 
-    map<string, string> getConfiguration() const override {
-        return {
-            {"pool_size", to_string(maxPoolSize_)},
-            {"connection_string", connectionString_}
-        };
+    // قيمة تقريبية صالحة للإحصائيات من أي خيط
+    size_t sizeApprox() const {
+        size_t tail = tail_.load(memory_order_relaxed);
+        size_t head = head_.load(memory_order_relaxed);
+        return tail > head ? tail - head : 0;
     }
 
-    map<string, double> getMetrics() const override {
-        lock_guard<mutex> lock(poolMutex_);
-        return {
-            {"total_connections", static_cast<double>(totalConnections_)},
-            {"available_connections", static_cast<double>(availableConnections_.size())},
-            {"pool_utilization", static_cast<double>(totalConnections_) / maxPoolSize_}
-        };
-    }
+    size_t capacity() const { return capacity_; }
 
-    bool isHealthy() const override {
-        lock_guard<mutex> lock(poolMutex_);
-        return !shutdownFlag_ && totalConnections_ > 0;
-    }
+private:
+    struct Slot {
+        atomic<size_t> sequence{0};
+        T value{};
+    };
 
-    string getStatus() const override {
-        lock_guard<mutex> lock(poolMutex_);
-        if (shutdownFlag_) return "shutdown";
-        if (totalConnections_ == 0) return "no_connections";
-        return "healthy";
+    static size_t roundUpToPowerOfTwo(size_t value) {
+        size_t result = 2;
+        while (result < value) result <<= 1;
+        return result;
     }
 
-    void shutdown() override {
-        lock_guard<mutex> lock(poolMutex_);
-        shutdownFlag_ = true;
-        connectionCV_.notify_all();
-        
-        while (!availableConnections_.empty()) {
-            availableConnections_.pop();
-        }
-    }
+    const size_t capacity_;
+    const size_t mask_;
+    unique_ptr<Slot[]> slots_;
+    alignas(64) atomic<size_t> tail_{0};
+    alignas(64) atomic<size_t> head_{0};
+};
 
-    bool isShutdown() const override {
-        return shutdownFlag_;
-    }
+// ذاكرة كل فهارس المستخدمين المعروفين معاً. الفهرس يحجز من هنا قبل أن يتضاعف، وعند نفاد الحد
+// لا يُفهرس مستخدمون جدد (تُكتب أحداثهم دائماً) حتى يفرغ خيط الصيانة فهارس البوتات الباردة
+class SeenIndexBudget {
+public:
+    explicit SeenIndexBudget(size_t limitBytes = EnvironmentConfig::MAX_MEMORY_USAGE_MB * 1024 * 1024 *
+                                                 EnvironmentConfig::SEEN_INDEX_MEMORY_PERCENT / 100)
+        : limitBytes_(limitBytes) {}
 
-    size_t getPoolSize() const override {
-        return maxPoolSize_;
+    bool tryReserve(size_t bytes) {
+        size_t used = usedBytes_.load(memory_order_relaxed);
+        do {
+            if (used + bytes > limitBytes_) {
+                exhausted_.store(true, memory_order_relaxed);
+                return false;
+            }
+        } while (!usedBytes_.compare_exchange_weak(used, used + bytes, memory_order_relaxed));
+        return true;
     }
 
-    size_t getActiveConnections() const override {
-        lock_guard<mutex> lock(poolMutex_);
-        return totalConnections_ - availableConnections_.size();
+    // الجدول الابتدائي لكل فهرس يُحتسب دون رفض
+    void reserve(size_t bytes) {
+        usedBytes_.fetch_add(bytes, memory_order_relaxed);
     }
 
-private:
-    void initializePool() {
-        lock_guard<mutex> lock(poolMutex_);
-        for (size_t i = 0; i < min(size_t(5), maxPoolSize_); ++i) {
-            auto conn = createNewConnection();
-            if (conn) {
-                availableConnections_.push(move(conn));
-            }
-        }
+    void release(size_t bytes) {
+        usedBytes_.fetch_sub(bytes, memory_order_relaxed);
     }
 
-    unique_ptr<connection> createNewConnection() {
-        try {
-            auto conn = make_unique<connection>(connectionString_);
-            if (isConnectionValid(*conn)) {
-                totalConnections_++;
-                return conn;
-            }
-        } catch (const exception& e) {
-            cerr << "خطأ في إنشاء اتصال قاعدة البيانات: " << e.what() << endl;
-        }
-        return nullptr;
+    // هل رُفض نمو فهرس منذ آخر استدعاء؟
+    bool takeExhausted() {
+        return exhausted_.exchange(false, memory_order_relaxed);
     }
 
-    bool isConnectionValid(connection& conn) {
-        try {
-            statement stmt(conn, "SELECT 1");
-            stmt.execute();
-            return true;
-        } catch (...) {
-            return false;
-        }
-    }
+    size_t usedBytes() const { return usedBytes_.load(memory_order_relaxed); }
+    size_t limitBytes() const { return limitBytes_; }
 
-    const string connectionString_;
-    size_t maxPoolSize_;
-    atomic<size_t> totalConnections_{0};
-    atomic<bool> shutdownFlag_{false};
-    mutable mutex poolMutex_;
-    condition_variable connectionCV_;
-    queue<unique_ptr<connection>> availableConnections_;
+private:
+    const size_t limitBytes_;
+    atomic<size_t> usedBytes_{0};
+    atomic<bool> exhausted_{false};
 };
 
-// =============== خدمة التشفير المحسنة ===============
-
-class EncryptionService : public IEncryptionService {
+// فهرس مضغوط للمستخدمين المعروفين لبوت واحد: userId → (بصمة اسم المستخدم، آخر تحديث لـ LastSeen).
+// جدول بعنونة مفتوحة (16 بايت لكل خانة) بدلاً من عقدة مخصصة لكل مستخدم، ينمو ضمن SeenIndexBudget.
+class SeenUserIndex {
 public:
-    EncryptionService() {
-        loadEncryptionKey();
+    explicit SeenUserIndex(SeenIndexBudget& budget) : budget_(budget) {
+        slots_.resize(INITIAL_SLOTS);
+        budget_.reserve(slots_.size() * sizeof(Slot));
+        publishedCapacity_.store(slots_.size(), memory_order_relaxed);
     }
 
-    string encrypt(const string& data) override {
-        if (data.empty()) return "";
-        
-        try {
-            string ciphertext;
-            SecByteBlock iv(EnvironmentConfig::IV_LENGTH);
-            prng_.GenerateBlock(iv, iv.size());
+    ~SeenUserIndex() {
+        budget_.release(slots_.size() * sizeof(Slot));
+    }
 
-            GCM<AES>::Encryption encryptor;
-            encryptor.SetKeyWithIV(key_, key_.size(), iv, iv.size());
+    SeenUserIndex(const SeenUserIndex&) = delete;
+    SeenUserIndex& operator=(const SeenUserIndex&) = delete;
 
-            StringSource ss(data, true,
-                new AuthenticatedEncryptionFilter(encryptor,
-                    new StringSink(ciphertext)
-                )
-            );
+    // هل يجب كتابة الحدث؟ لا، إذا كان المستخدم معروفاً باسمه نفسه وحُدّث LastSeen مؤخراً
+    bool needsWrite(int64_t userId, uint32_t usernameHash, uint32_t now, uint32_t granularitySeconds) const {
+        if (!ready_.load(memory_order_acquire)) return true;
+        
+        lock_guard<mutex> lock(mutex_);
+        const Slot* slot = find(userId);
+        return !slot || slot->usernameHash != usernameHash || now - slot->lastFlushed >= granularitySeconds;
+    }
 
-            string result = base64Encode(string(reinterpret_cast<const char*>(iv.data()), iv.size()) + ciphertext);
-            encryptionCount_++;
-            return result;
-        } catch (const exception& e) {
-            cerr << "خطأ في التشفير: " << e.what() << endl;
-            throw runtime_error("فشل في تشفير البيانات");
-        }
+    void markFlushed(int64_t userId, uint32_t usernameHash, uint32_t flushedAt) {
+        lock_guard<mutex> lock(mutex_);
+        insertOrAssign(userId, usernameHash, flushedAt);
     }
 
-    string decrypt(const string& encryptedData) override {
-        if (encryptedData.empty()) return "";
-        
-        try {
-            string decoded = base64Decode(encryptedData);
-            if (decoded.size() < EnvironmentConfig::IV_LENGTH) {
-                throw runtime_error("بيانات مشفرة غير صالحة");
-            }
+    void markReady() {
+        ready_.store(true, memory_order_release);
+    }
 
-            SecByteBlock iv(reinterpret_cast<const byte*>(decoded.data()), EnvironmentConfig::IV_LENGTH);
-            string ciphertext = decoded.substr(EnvironmentConfig::IV_LENGTH);
+    // يفرغ الفهرس ويعيد ذاكرته إلى الميزانية؛ يبقى جاهزاً ويُبنى ثانية من الأحداث المكتوبة،
+    // فلا يعود إليه إلا المستخدمون النشطون
+    size_t clear() {
+        lock_guard<mutex> lock(mutex_);
+        size_t freed = (slots_.size() - INITIAL_SLOTS) * sizeof(Slot);
+        vector<Slot>(INITIAL_SLOTS).swap(slots_);
+        budget_.release(freed);
+        count_ = 0;
+        publishedCount_.store(0, memory_order_relaxed);
+        publishedCapacity_.store(slots_.size(), memory_order_relaxed);
+        return freed;
+    }
 
-            GCM<AES>::Decryption decryptor;
-            decryptor.SetKeyWithIV(key_, key_.size(), iv, iv.size());
+    bool isReady() const {
+        return ready_.load(memory_order_acquire);
+    }
 
-            string plaintext;
-            StringSource ss(ciphertext, true,
-                new AuthenticatedDecryptionFilter(decryptor,
-                    new StringSink(plaintext)
-                )
-            );
+    // للمقاييس: تُقرأ دون قفل الفهرس الذي يمسكه معالج الشريحة
+    size_t size() const {
+        return publishedCount_.load(memory_order_relaxed);
+    }
 
-            decryptionCount_++;
-            return plaintext;
-        } catch (const exception& e) {
-            cerr << "خطأ في فك التشفير: " << e.what() << endl;
-            throw runtime_error("فشل في فك تشفير البيانات");
-        }
+    size_t memoryBytes() const {
+        return publishedCapacity_.load(memory_order_relaxed) * sizeof(Slot);
     }
 
-    void configure(const map<string, string>& config) override {
-        if (config.count("encryption_key")) {
-            loadEncryptionKeyFromString(config.at("encryption_key"));
+    static uint32_t hashUsername(string_view username) {
+        uint32_t hash = 2166136261u;   // FNV-1a
+        for (char c : username) {
+            hash = (hash ^ static_cast<uint8_t>(c)) * 16777619u;
         }
+        return hash;
     }
 
-    map<string, string> getConfiguration() const override {
-        return {
-            {"key_length", to_string(EnvironmentConfig::KEY_LENGTH)},
-            {"iv_length", to_string(EnvironmentConfig::IV_LENGTH)}
-        };
+    // ثوانٍ منذ 1970 في 32 بت تكفي حتى 2106
+    static uint32_t nowSeconds() {
+        return static_cast<uint32_t>(chrono::duration_cast<chrono::seconds>(
+            chrono::system_clock::now().time_since_epoch()).count());
     }
 
-    map<string, double> getMetrics() const override {
-        return {
-            {"encryption_count", static_cast<double>(encryptionCount_)},
-            {"decryption_count", static_cast<double>(decryptionCount_)},
-            {"total_operations", static_cast<double>(encryptionCount_ + decryptionCount_)}
-        };
-    }
+private:
+    struct Slot {
+        int64_t userId{0};          // 0 = خانة فارغة (معرفات تيليجرام موجبة)
+        uint32_t usernameHash{0};
+        uint32_t lastFlushed{0};
+    };
 
-    bool isHealthy() const override {
-        return isKeyValid();
+    static constexpr size_t INITIAL_SLOTS = 1024;
+
+    size_t probeStart(int64_t userId) const {
+        return static_cast<size_t>(static_cast<uint64_t>(userId) * 0x9e3779b97f4a7c15ULL) & (slots_.size() - 1);
     }
 
-    string getStatus() const override {
-        return isKeyValid() ? "healthy" : "invalid_key";
+    const Slot* find(int64_t userId) const {
+        for (size_t i = probeStart(userId);; i = (i + 1) & (slots_.size() - 1)) {
+            const Slot& slot = slots_[i];
+            if (slot.userId == userId) return &slot;
+            if (slot.userId == 0) return nullptr;
+        }
     }
 
-    bool isKeyValid() const override {
-        return key_.size() == EnvironmentConfig::KEY_LENGTH;
+    Slot* find(int64_t userId) {
+        return const_cast<Slot*>(as_const(*this).find(userId));
     }
 
-private:
-    void loadEncryptionKey() {
-        const char* envKey = getenv("ENCRYPTION_KEY");
-        if (envKey && strlen(envKey) > 0) {
-            loadEncryptionKeyFromString(envKey);
-        } else {
-            generateNewKey();
+    void insertOrAssign(int64_t userId, uint32_t usernameHash, uint32_t flushedAt) {
+        if (userId == 0) return;
+        
+        if (Slot* slot = find(userId)) {
+            slot->usernameHash = usernameHash;
+            slot->lastFlushed = flushedAt;
+            return;
         }
+        
+        // نسبة الامتلاء لا تتجاوز 70%؛ إذا رفضت الميزانية النمو يُكتب المستخدم الجديد دائماً
+        if ((count_ + 1) * 10 > slots_.size() * 7 && !grow()) return;
+        
+        size_t i = probeStart(userId);
+        while (slots_[i].userId != 0) i = (i + 1) & (slots_.size() - 1);
+        slots_[i] = {userId, usernameHash, flushedAt};
+        publishedCount_.store(++count_, memory_order_relaxed);
     }
 
-    void loadEncryptionKeyFromString(const string& keyStr) {
-        try {
-            string decoded = base64Decode(keyStr);
-            if (decoded.size() == EnvironmentConfig::KEY_LENGTH) {
-                key_.Assign(reinterpret_cast<const byte*>(decoded.data()), decoded.size());
-            } else {
-                generateNewKey();
-            }
-        } catch (...) {
-            generateNewKey();
+    bool grow() {
+        if (!budget_.tryReserve(slots_.size() * sizeof(Slot))) return false;
+        
+        vector<Slot> old(slots_.size() * 2);
+        old.swap(slots_);
+        for (const Slot& slot : old) {
+            if (slot.userId == 0) continue;
+            size_t i = probeStart(slot.userId);
+            while (slots_[i].userId != 0) i = (i + 1) & (slots_.size() - 1);
+            slots_[i] = slot;
         }
+        publishedCapacity_.store(slots_.size(), memory_order_relaxed);
+        return true;
     }
 
-    void generateNewKey() {
-        key_.Resize(EnvironmentConfig::KEY_LENGTH);
-        prng_.GenerateBlock(key_, key_.size());
-        cerr << "تحذير: تم إنشاء مفتاح تشفير جديد. يرجى تعيين ENCRYPTION_KEY" << endl;
+    SeenIndexBudget& budget_;
+    mutable mutex mutex_;   // غير متنازع عليه عملياً: البوت مملوك لشريحة واحدة
+    vector<Slot> slots_;
+    size_t count_{0};
+    atomic<size_t> publishedCount_{0};
+    atomic<size_t> publishedCapacity_{0};
+    atomic<bool> ready_{false};
+};
+
+// إيقاظ المستهلك دون استدعاء نظام عند كل إضافة:
+// المنتج لا يلمس القفل إلا إذا كان المستهلك نائماً فعلاً
+class WakeupSignal {
+public:
+    void notify() {
+        atomic_thread_fence(memory_order_seq_cst);
+        if (sleeping_.load(memory_order_relaxed)) {
+            lock_guard<mutex> lock(mutex_);
+            cv_.notify_one();
+        }
     }
 
-    string base64Encode(const string& data) {
-        string encoded;
-        StringSource ss(data, true,
-            new Base64Encoder(
-                new StringSink(encoded),
-                false
-            )
-        );
-        return encoded;
+    void notifyAll() {
+        lock_guard<mutex> lock(mutex_);
+        cv_.notify_all();
     }
 
-    string base64Decode(const string& encoded) {
-        string decoded;
-        StringSource ss(encoded, true,
-            new Base64Decoder(
-                new StringSink(decoded)
-            )
-        );
-        return decoded;
+    template <typename Rep, typename Period, typename Predicate>
+    void waitFor(const chrono::duration<Rep, Period>& timeout, Predicate ready) {
+        unique_lock<mutex> lock(mutex_);
+        sleeping_.store(true, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+        cv_.wait_for(lock, timeout, ready);
+        sleeping_.store(false, memory_order_relaxed);
     }
 
-    static constexpr size_t KEY_LENGTH = 32;  // AES-256
-    static constexpr size_t IV_LENGTH = 12;   // GCM recommended IV size
-    
-    SecByteBlock key_;
-    AutoSeededRandomPool prng_;
-    atomic<size_t> encryptionCount_{0};
-    atomic<size_t> decryptionCount_{0};
+private:
+    atomic<bool> sleeping_{false};
+    mutex mutex_;
+    condition_variable cv_;
 };
 
-// =============== مدير البوتات المحسن ===============
+// عداد يكتبه خيط واحد فقط: لا حاجة لتعليمة ذرية مقفلة، والقراء يرون قيمة متسقة
+inline void addSingleWriter(atomic<size_t>& counter, size_t delta) {
+    counter.store(counter.load(memory_order_relaxed) + delta, memory_order_relaxed);
+}
 
-class BotManager : public IBotManager {
+// خلية ثابتة لكل خيط في الهياكل المقسمة؛ الخيوط الزائدة عن STRIPES تتشارك الخلايا
+static constexpr size_t STRIPES = 16;
+
+inline size_t threadStripe() {
+    static atomic<size_t> nextStripe{0};
+    thread_local size_t stripe = nextStripe.fetch_add(1, memory_order_relaxed) % STRIPES;
+    return stripe;
+}
+
+// عداد يكتبه عدة خيوط (عمال Webhook): كل خيط يكتب في خلية على سطر ذاكرة مستقل،
+// والقارئ يجمع الخلايا دون قفل
+class StripedCounter {
 public:
-    BotManager(shared_ptr<IDatabaseManager> db, shared_ptr<IEncryptionService> encryptor)
-        : dbManager_(db), encryptor_(encryptor), 
-          taskSemaphore_(EnvironmentConfig::MAX_CONCURRENT_TASKS),
-          batchProcessor_(async(launch::async, [this]() { batchProcessorLoop(); })) {}
 
-    ~BotManager() override {
-        shutdown();
+    void add(size_t delta = 1) {
+        cells_[threadStripe()].value.fetch_add(delta, memory_order_relaxed);
     }
 
-    bool startBot(const BotConfig& config) override {
-        unique_lock<shared_mutex> lock(botsMutex_);
-        
-        if (activeBots_.size() >= EnvironmentConfig::MAX_ACTIVE_BOTS) {
-            cerr << "تم الوصول للحد الأقصى من البوتات النشطة" << endl;
-            return false;
+    size_t load() const {
+        size_t total = 0;
+        for (const auto& cell : cells_) {
+            total += cell.value.load(memory_order_relaxed);
         }
+        return total;
+    }
 
-        string token;
-        try {
-            token = encryptor_->decrypt(config.encryptedToken);
-        } catch (const exception& e) {
-            cerr << "خطأ في فك تشفير التوكن: " << e.what() << endl;
-            return false;
-        }
+private:
+    struct alignas(64) Cell {
+        atomic<size_t> value{0};
+    };
 
-        // التحقق من صحة التوكن
-        try {
-            Bot testBot(token);
-            auto me = testBot.getApi().getMe();
-            if (!me) {
-                cerr << "توكن البوت غير صالح" << endl;
-                return false;
-            }
-        } catch (const exception& e) {
-            cerr << "خطأ في التحقق من التوكن: " << e.what() << endl;
-            return false;
-        }
+    array<Cell, STRIPES> cells_{};
+};
 
-        BotConfig botConfig = config;
-        botConfig.initBarrier = make_shared<barrier<>>(2);
-        
-        auto future = async(launch::async, [this, botConfig]() {
-            runBotInstance(botConfig);
-        });
+// =============== جدول البوتات ===============
+
+// دورة حياة البوت. الحالات الوسيطة تغطي الاستدعاءات الشبكية (getMe، setWebhook، deleteWebhook)
+// فلا تُؤخذ أقفال عامة أثناءها؛ Stopped -> Validating تمنع تشغيل نفس البوت مرتين
+enum class BotState : uint8_t { Stopped, Validating, Starting, Running, Stopping };
+
+// بيانات البوت التي يلمسها مسار الرسائل. الخانة لا تنتقل ولا تُحذف طوال عمر العملية،
+// فالوصول إليها بالمعرّف لا يحتاج إلى قفل؛ الحقول غير الذرية تُكتب مرة واحدة قبل نشر المعرّف.
+// البوتات المتجاورة تُكتب من شرائح مختلفة، فلكل خانة سطر ذاكرة مستقل.
+struct alignas(64) BotSlot {
+    int64_t telegramId{0};
+    atomic<bool> active{true};             // يُوقف مؤقتاً عبر pauseBot دون إزالة مساره
+    atomic<BotState> state{BotState::Stopped};
+    unique_ptr<SeenUserIndex> seenUsers;   // يُحمّل من جدول Users عند بدء البوت ويبقى بين إعادات التشغيل
+    atomic<long> storedUsers{0};           // صفوف البوت في Users
+    atomic<long> totalUsers{0};            // مستخدمون جدد أُدرجوا منذ بدء العملية
+    atomic<size_t> events{0};              // أحداث دخلت دفعات البوت؛ يكتبه معالج شريحته فقط
+    atomic<double> eventRate{0.0};         // أحداث/ثانية، يحسبه خيط الصيانة
+    size_t lastEvents{0};                  // لخيط الصيانة فقط
+
+    bool transition(BotState from, BotState to) {
+        return state.compare_exchange_strong(from, to, memory_order_acq_rel);
+    }
+};
+
+// يحوّل معرّف تيليجرام إلى معرّف كثيف مرة واحدة عند بدء البوت (أو عند إعادة أحداثه من السجل)
+class BotRegistry {
+public:
+    explicit BotRegistry(size_t capacity = EnvironmentConfig::MAX_BOT_IDS)
+        : slots_(make_unique<BotSlot[]>(capacity)), capacity_(capacity) {}
+
+    // نفس البوت يحصل دائماً على نفس المعرّف؛ INVALID_BOT_ID إذا امتلأ الجدول
+    BotId intern(int64_t telegramId) {
+        lock_guard<mutex> lock(mutex_);
+        auto it = ids_.find(telegramId);
+        if (it != ids_.end()) return it->second;
         
-        botConfig.botThread = move(future);
-        activeBots_[config.encryptedToken] = botConfig;
+        size_t next = size_.load(memory_order_relaxed);
+        if (next >= capacity_) return INVALID_BOT_ID;
         
-        // انتظار تهيئة البوت
-        botConfig.initBarrier->arrive_and_wait();
+        BotSlot& slot = slots_[next];
+        slot.telegramId = telegramId;
+        slot.seenUsers = make_unique<SeenUserIndex>(seenBudget_);
         
-        return true;
+        auto id = static_cast<BotId>(next);
+        ids_.emplace(telegramId, id);
+        size_.store(next + 1, memory_order_release);
+        return id;
     }
 
-    bool stopBot(const string& encryptedToken) override {
-        unique_lock<shared_mutex> lock(botsMutex_);
+    BotId find(int64_t telegramId) const {
+        lock_guard<mutex> lock(mutex_);
+        auto it = ids_.find(telegramId);
+        return it != ids_.end() ? it->second : INVALID_BOT_ID;
+    }
+
+    BotSlot& slot(BotId id) { return slots_[id]; }
+    const BotSlot& slot(BotId id) const { return slots_[id]; }
+
+    size_t size() const { return size_.load(memory_order_acquire); }
+    size_t capacity() const { return capacity_; }
+
+    SeenIndexBudget& seenBudget() { return seenBudget_; }
+    const SeenIndexBudget& seenBudget() const { return seenBudget_; }
+
+private:
+    SeenIndexBudget seenBudget_;   // قبل slots_ فتُهدم الفهارس قبله
+    unique_ptr<BotSlot[]> slots_;
+    const size_t capacity_;
+    atomic<size_t> size_{0};
+    mutable mutex mutex_;
+    unordered_map<int64_t, BotId> ids_;
+};
+
+// =============== المدرجات التكرارية ===============
+
+// مدرج تكراري بأسلوب HDR: دلاء لوغاريتمية مقسمة خطياً داخل كل قوة 2 (دقة نسبية ~3%).
+// التسجيل عداد ذري واحد، والقراءة لا تحتاج قفلاً.
+class alignas(64) Histogram {
+public:
+    static constexpr int SUB_BUCKET_BITS = 5;
+    static constexpr uint64_t SUB_BUCKETS = uint64_t(1) << SUB_BUCKET_BITS;
+    static constexpr size_t BUCKET_COUNT = (64 - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+
+    void record(uint64_t value, uint64_t count = 1) {
+        counts_[bucketIndex(value)].fetch_add(count, memory_order_relaxed);
+        total_.fetch_add(count, memory_order_relaxed);
+        sum_.fetch_add(value * count, memory_order_relaxed);
         
-        auto it = activeBots_.find(encryptedToken);
-        if (it == activeBots_.end()) {
-            return false;
+        uint64_t currentMax = max_.load(memory_order_relaxed);
+        while (value > currentMax && !max_.compare_exchange_weak(currentMax, value, memory_order_relaxed)) {}
+    }
+
+    // لمدرج يملكه خيط واحد (معالج شريحة): بلا تعليمات ذرية مقفلة، بضع نانوثوانٍ للتسجيل
+    void recordLocal(uint64_t value, uint64_t count = 1) {
+        auto add = [](atomic<uint64_t>& counter, uint64_t delta) {
+            counter.store(counter.load(memory_order_relaxed) + delta, memory_order_relaxed);
+        };
+        add(counts_[bucketIndex(value)], count);
+        add(total_, count);
+        add(sum_, value * count);
+        if (value > max_.load(memory_order_relaxed)) {
+            max_.store(value, memory_order_relaxed);
+        }
+    }
+
+    // لمدرجات القراءة المؤقتة التي يُعاد استخدامها بين الطلبات
+    void clear() {
+        for (auto& count : counts_) {
+            count.store(0, memory_order_relaxed);
+        }
+        total_.store(0, memory_order_relaxed);
+        sum_.store(0, memory_order_relaxed);
+        max_.store(0, memory_order_relaxed);
+    }
+
+    // دمج مدرج آخر في هذا المدرج (لقطات القراءة فقط)
+    void merge(const Histogram& other) {
+        for (size_t i = 0; i < BUCKET_COUNT; ++i) {
+            uint64_t count = other.counts_[i].load(memory_order_relaxed);
+            if (count) counts_[i].fetch_add(count, memory_order_relaxed);
+        }
+        total_.fetch_add(other.total_.load(memory_order_relaxed), memory_order_relaxed);
+        sum_.fetch_add(other.sum_.load(memory_order_relaxed), memory_order_relaxed);
+        uint64_t otherMax = other.max_.load(memory_order_relaxed);
+        if (otherMax > max_.load(memory_order_relaxed)) {
+            max_.store(otherMax, memory_order_relaxed);
         }
+    }
+
+    uint64_t count() const { return total_.load(memory_order_relaxed); }
+    uint64_t maxValue() const { return max_.load(memory_order_relaxed); }
+
+    double mean() const {
+        uint64_t n = count();
+        return n ? static_cast<double>(sum_.load(memory_order_relaxed)) / n : 0.0;
+    }
 
-        it->second.shutdownPromise.set_value();
+    // percentile بين 0 و 100؛ تعيد الحد الأعلى للدلو المطابق
+    uint64_t percentile(double percentile) const {
+        uint64_t n = count();
+        if (n == 0) return 0;
         
-        if (it->second.botThread.valid()) {
-            auto status = it->second.botThread.wait_for(chrono::seconds(10));
-            if (status == future_status::timeout) {
-                cerr << "تحذير: انتهت مهلة إيقاف البوت" << endl;
+        auto target = static_cast<uint64_t>(percentile / 100.0 * n + 0.5);
+        target = clamp<uint64_t>(target, 1, n);
+        
+        uint64_t seen = 0;
+        for (size_t i = 0; i < BUCKET_COUNT; ++i) {
+            seen += counts_[i].load(memory_order_relaxed);
+            if (seen >= target) {
+                return min(bucketUpperBound(i), maxValue());
             }
         }
+        return maxValue();
+    }
 
-        activeBots_.erase(it);
-        return true;
+private:
+    static size_t bucketIndex(uint64_t value) {
+        if (value < SUB_BUCKETS) return static_cast<size_t>(value);
+        int exponent = bit_width(value) - 1;
+        int shift = exponent - SUB_BUCKET_BITS;
+        uint64_t sub = (value >> shift) - SUB_BUCKETS;
+        return static_cast<size_t>((shift + 1) * SUB_BUCKETS + sub);
     }
 
-    bool pauseBot(const string& encryptedToken) override {
-        shared_lock<shared_mutex> lock(botsMutex_);
+    static uint64_t bucketUpperBound(size_t index) {
+        if (index < SUB_BUCKETS) return index;
+        uint64_t shift = index / SUB_BUCKETS - 1;
+        uint64_t sub = index % SUB_BUCKETS + SUB_BUCKETS;
+        return ((sub + 1) << shift) - 1;
+    }
+
+    array<atomic<uint64_t>, BUCKET_COUNT> counts_{};
+    atomic<uint64_t> total_{0};
+    atomic<uint64_t> sum_{0};
+    atomic<uint64_t> max_{0};
+};
+
+// مدرج لعدة كتّاب (عمال Webhook): كل خيط يسجل في نسخته فلا تتنازع الخيوط على أسطر الذاكرة،
+// والقارئ يدمج النسخ عند الطلب
+class StripedHistogram {
+public:
+    void record(uint64_t value, uint64_t count = 1) {
+        stripes_[threadStripe()].record(value, count);
+    }
+
+    void mergeInto(Histogram& merged) const {
+        for (const auto& stripe : stripes_) {
+            merged.merge(stripe);
+        }
+    }
+
+private:
+    array<Histogram, STRIPES> stripes_;
+};
+
+// =============== واجهات الخدمات المحسنة ===============
+
+class IDatabaseManager : public IConfigurable, public IMonitorable, public IShutdownable {
+public:
+    virtual unique_ptr<connection> getConnection() = 0;
+    virtual void releaseConnection(unique_ptr<connection> conn) = 0;
+    virtual void executeTransaction(const function<void(connection&)>& func) = 0;
+    // تنفيذ معاملة على اتصال يملكه المستدعي (لا يُعاد إلى الـ pool)
+    virtual void executeTransaction(connection& conn, const function<void(connection&)>& func) = 0;
+    // عبارة مُحضّرة مرة واحدة لكل اتصال في الـ pool ويُعاد استخدامها بين الدفعات
+    virtual statement& getPreparedStatement(connection& conn, const string& queryId, const string& query) = 0;
+    virtual size_t getPoolSize() const = 0;
+    virtual size_t getActiveConnections() const = 0;
+    virtual ~IDatabaseManager() = default;
+};
+
+// جدول Users كما يراه مسار الرسائل في BotManager. SqlUserStore يكتب في SQL Server،
+// ومعيار الأداء (benchmark/) يستبدله بمخزن في الذاكرة
+class IUserStore {
+public:
+    // كاتب لكل معالج دفعات يحتفظ بمورده (اتصال الـ pool) بين الدفعات المتتالية
+    class Writer {
+    public:
+        // الدفعة كلها في معاملة واحدة؛ inserted[i] = 1 إذا أُدرج صف جديد للسجل i
+        virtual void upsert(const vector<MessageData>& batch, const BotRegistry& registry,
+                            vector<uint8_t>& inserted) = 0;
+        // يُعيد المورد عند خمول المعالج أو بعد فشل الدفعة
+        virtual void release() = 0;
+        virtual ~Writer() = default;
+    };
+
+    virtual unique_ptr<Writer> openWriter() = 0;
+    // يمر على مستخدمي البوت مع عمر LastSeen بالثواني، ويعيد عددهم
+    virtual size_t forEachUser(int64_t telegramBotId,
+                               const function<void(int64_t userId, const string& username, uint32_t ageSeconds)>& visit) = 0;
+    // (BotID, عدد الصفوف)؛ البوت بلا صفوف لا يظهر
+    virtual vector<pair<int64_t, size_t>> countUsersByBot() = 0;
+    virtual ~IUserStore() = default;
+};
+
+class IEncryptionService : public IConfigurable, public IMonitorable {
+public:
+    virtual string encrypt(const string& data) = 0;
+    virtual string decrypt(const string& encryptedData) = 0;
+    virtual bool isKeyValid() const = 0;
+    virtual ~IEncryptionService() = default;
+};
+
+// لقطة عدادات بوت واحد؛ تُقرأ من الذاكرة دون استعلام جدول Users
+struct BotStats {
+    string name;
+    string username;
+    long storedUsers{0};   // صفوف البوت في Users (تزايدي ويُطابق دورياً مع COUNT)
+    long newUsers{0};      // مستخدمون أُدرجوا لأول مرة منذ بدء العملية
+    double eventRate{0.0}; // أحداث/ثانية خلال آخر ثانية
+    bool isActive{false};
+};
+
+// نتيجة تشغيل بوت؛ error يصلح لعرضه على المستخدم
+struct BotLaunchResult {
+    bool started{false};
+    string name;
+    string error;
+};
+
+class IBotManager : public IConfigurable, public IMonitorable, public IShutdownable {
+public:
+    virtual bool startBot(const BotConfig& config) = 0;
+    // يتحقق من التوكن ويشغل البوت في الخلفية؛ onDone يُستدعى من خيط دورة الحياة
+    virtual void startBotAsync(const BotConfig& config, function<void(const BotLaunchResult&)> onDone) = 0;
+    virtual bool stopBot(const string& encryptedToken) = 0;
+    virtual bool pauseBot(const string& encryptedToken) = 0;
+    virtual bool resumeBot(const string& encryptedToken) = 0;
+    virtual shared_ptr<const BotTable> getActiveBots() const = 0;
+    virtual size_t getTotalBots() const = 0;
+    virtual size_t getActiveBotsCount() const = 0;
+    virtual vector<BotStats> getBotStats() const = 0;
+    virtual ~IBotManager() = default;
+};
+
+// =============== مدير قاعدة البيانات المحسن ===============
+
+// تجمع اتصالات بحجم بين minSize و maxSize. الاتصال يُفحص بـ SELECT 1 فقط إذا بقي خاملاً
+// أكثر من DB_VALIDATION_IDLE_SECONDS؛ خيط الصيانة يفحص الخاملين ويطرد الزائدين ويعيد الحد الأدنى.
+// الاتصال بالخادم وفحصه يجريان خارج poolMutex_، والاتصالات قيد الإنشاء محجوزة في totalConnections_.
+class DatabaseManager : public IDatabaseManager {
+public:
+    explicit DatabaseManager(const string& connStr, size_t poolSize = EnvironmentConfig::DB_POOL_SIZE,
+                             size_t minPoolSize = EnvironmentConfig::DB_POOL_MIN_SIZE)
+        : connectionString_(connStr), maxPoolSize_(max<size_t>(1, poolSize)),
+          minPoolSize_(min(minPoolSize, max<size_t>(1, poolSize))) {
+        warmUp();
+        maintenance_ = async(launch::async, [this] { maintenanceLoop(); });
+    }
+
+    ~DatabaseManager() override {
+        shutdown();
+    }
+
+    unique_ptr<connection> getConnection() override {
+        auto started = chrono::steady_clock::now();
+        auto deadline = started + chrono::seconds(
+            EnvironmentConfig::DB_CONNECTION_TIMEOUT_SECONDS * EnvironmentConfig::RETRY_ATTEMPTS);
+        int failedDials = 0;
         
-        auto it = activeBots_.find(encryptedToken);
-        if (it != activeBots_.end()) {
-            it->second.isActive = false;
-            return true;
+        unique_lock<mutex> lock(poolMutex_);
+        while (!shutdownFlag_) {
+            if (!idleConnections_.empty()) {
+                // الأحدث استخداماً أولاً: الاتصالات القديمة تبقى في المقدمة ليطردها خيط الصيانة
+                IdleConnection idle = move(idleConnections_.back());
+                idleConnections_.pop_back();
+                availableCount_ = idleConnections_.size();
+                lock.unlock();
+                
+                bool stale = chrono::steady_clock::now() - idle.lastChecked() >= validationIdle();
+                if (!stale || validate(*idle.conn)) {
+                    recordCheckout(started);
+                    return move(idle.conn);
+                }
+                discardConnection(move(idle.conn));
+                lock.lock();
+                continue;
+            }
+            
+            if (totalConnections_ < maxPoolSize_) {
+                totalConnections_++;   // حجز قبل ترك القفل حتى لا يتجاوز المتسابقون الحد
+                lock.unlock();
+                
+                if (auto conn = openConnection()) {
+                    recordCheckout(started);
+                    return conn;
+                }
+                
+                lock.lock();
+                totalConnections_--;
+                connectionCV_.notify_one();
+                if (++failedDials >= EnvironmentConfig::RETRY_ATTEMPTS) break;
+                continue;
+            }
+            
+            if (!connectionCV_.wait_until(lock, deadline, [this] {
+                    return !idleConnections_.empty() || totalConnections_ < maxPoolSize_ || shutdownFlag_; })) {
+                break;
+            }
         }
-        return false;
+        
+        checkoutTimeouts_++;
+        throw runtime_error("فشل في الحصول على اتصال قاعدة البيانات");
     }
 
-    bool resumeBot(const string& encryptedToken) override {
-        shared_lock<shared_mutex> lock(botsMutex_);
+    // لا فحص عند الإرجاع: connected() محلي، والاتصال المعطوب يُكتشف عند فحصه بعد الخمول
+    void releaseConnection(unique_ptr<connection> conn) override {
+        if (!conn) return;
         
-        auto it = activeBots_.find(encryptedToken);
-        if (it != activeBots_.end()) {
-            it->second.isActive = true;
-            return true;
+        if (!shutdownFlag_ && conn->connected()) {
+            lock_guard<mutex> lock(poolMutex_);
+            if (!shutdownFlag_) {
+                idleConnections_.push_back({move(conn), chrono::steady_clock::now()});
+                availableCount_ = idleConnections_.size();
+                connectionCV_.notify_one();
+                return;
+            }
         }
-        return false;
+        discardConnection(move(conn));
+    }
+
+    void executeTransaction(const function<void(connection&)>& func) override {
+        auto conn = getConnection();
+        try {
+            executeTransaction(*conn, func);
+        } catch (...) {
+            releaseConnection(move(conn));
+            throw;
+        }
+        releaseConnection(move(conn));
     }
 
-    map<string, BotConfig> getActiveBots() override {
-        shared_lock<shared_mutex> lock(botsMutex_);
-        return activeBots_;
+    void executeTransaction(connection& conn, const function<void(connection&)>& func) override {
+        try {
+            conn.begin();
+            func(conn);
+            conn.commit();
+        } catch (...) {
+            try {
+                conn.rollback();
+            } catch (...) {}
+            throw;
+        }
     }
 
-    void configure(const map<string, string>& config) override {
-        lock_guard<mutex> lock(configMutex_);
-        configuration_ = config;
+    statement& getPreparedStatement(connection& conn, const string& queryId, const string& query) override {
+        {
+            // المسار الشائع قراءة فقط: كل عمال الدفعات يبحثون معاً دون تسلسل
+            shared_lock<shared_mutex> lock(statementsMutex_);
+            auto cache = preparedStatements_.find(&conn);
+            if (cache != preparedStatements_.end()) {
+                auto it = cache->second.find(queryId);
+                if (it != cache->second.end()) {
+                    statementCacheHits_.add();
+                    return *it->second;
+                }
+            }
+        }
+        
+        // التحضير خارج القفل: الاتصال مملوك لخيط واحد في كل مرة
+        auto stmt = make_unique<statement>(conn);
+        stmt->prepare(query);
+        statementCacheMisses_++;
+        
+        unique_lock<shared_mutex> lock(statementsMutex_);
+        auto& slot = preparedStatements_[&conn][queryId];
+        if (!slot) cachedStatements_++;
+        slot = move(stmt);
+        return *slot;
     }
 
-    map<string, string> getConfiguration() const override {
-        lock_guard<mutex> lock(configMutex_);
-        return configuration_;
+    void configure(const map<string, string>& config) override {
+        lock_guard<mutex> lock(poolMutex_);
+        if (config.count("pool_size")) {
+            size_t newSize = stoul(config.at("pool_size"));
+            if (newSize > maxPoolSize_) {
+                maxPoolSize_ = newSize;
+                connectionCV_.notify_all();
+            }
+        }
+        if (config.count("pool_min_size")) {
+            minPoolSize_ = min<size_t>(stoul(config.at("pool_min_size")), maxPoolSize_);
+        }
+        if (config.count("validation_idle_s")) {
+            validationIdleSeconds_ = stoi(config.at("validation_idle_s"));
+        }
+        if (config.count("idle_timeout_s")) {
+            idleTimeoutSeconds_ = stoi(config.at("idle_timeout_s"));
+        }
     }
 
-    map<string, double> getMetrics() const override {
-        shared_lock<shared_mutex> lock(botsMutex_);
+    map<string, string> getConfiguration() const override {
         return {
-            {"active_bots", static_cast<double>(activeBots_.size())},
-            {"total_bots", static_cast<double>(totalBots_)},
-            {"queue_size", static_cast<double>(messageQueue_.size())},
-            {"processing_rate", processingRate_}
+            {"pool_size", to_string(maxPoolSize_)},
+            {"pool_min_size", to_string(minPoolSize_)},
+            {"validation_idle_s", to_string(validationIdleSeconds_)},
+            {"idle_timeout_s", to_string(idleTimeoutSeconds_)},
+            {"connection_string", connectionString_}
         };
     }
 
+    void collectMetrics(MetricSink& sink) const override {
+        sink.gauge("total_connections", static_cast<double>(totalConnections_));
+        sink.gauge("available_connections", static_cast<double>(availableCount_));
+        sink.gauge("pool_utilization", static_cast<double>(totalConnections_) / maxPoolSize_);
+        sink.gauge("pool_min_size", static_cast<double>(minPoolSize_));
+        sink.gauge("pool_max_size", static_cast<double>(maxPoolSize_));
+        sink.gauge("pool_checkouts", static_cast<double>(checkouts_.load()));
+        sink.gauge("pool_checkout_timeouts", static_cast<double>(checkoutTimeouts_));
+        sink.gauge("pool_connections_opened", static_cast<double>(connectionsOpened_));
+        sink.gauge("pool_connect_failures", static_cast<double>(connectFailures_));
+        sink.gauge("pool_validations", static_cast<double>(validations_));
+        sink.gauge("pool_validation_failures", static_cast<double>(validationFailures_));
+        sink.gauge("pool_idle_evictions", static_cast<double>(idleEvictions_));
+        sink.gauge("statement_cache_hits", static_cast<double>(statementCacheHits_.load()));
+        sink.gauge("statement_cache_misses", static_cast<double>(statementCacheMisses_));
+        sink.gauge("prepared_statements", static_cast<double>(cachedStatements_));
+        
+        lock_guard<mutex> lock(scrapeMutex_);
+        scrapeWaits_->clear();
+        checkoutWaits_.mergeInto(*scrapeWaits_);
+        sink.gauge("pool_wait_ms_p50", scrapeWaits_->percentile(50) / 1000.0);
+        sink.gauge("pool_wait_ms_p99", scrapeWaits_->percentile(99) / 1000.0);
+        sink.gauge("pool_wait_ms_max", scrapeWaits_->maxValue() / 1000.0);
+    }
+
     bool isHealthy() const override {
-        return !shutdownFlag_ && activeBots_.size() <= EnvironmentConfig::MAX_ACTIVE_BOTS;
+        return !shutdownFlag_ && totalConnections_ > 0;
     }
 
     string getStatus() const override {
         if (shutdownFlag_) return "shutdown";
-        if (activeBots_.size() >= EnvironmentConfig::MAX_ACTIVE_BOTS) return "at_capacity";
+        if (totalConnections_ == 0) return "no_connections";
         return "healthy";
     }
 
     void shutdown() override {
-        shutdownFlag_ = true;
-        messageQueueCV_.notify_all();
-        
-        if (batchProcessor_.valid()) {
-            batchProcessor_.wait();
+        {
+            lock_guard<mutex> lock(poolMutex_);
+            if (shutdownFlag_) return;
+            shutdownFlag_ = true;
+            connectionCV_.notify_all();
+            maintenanceCV_.notify_all();
+        }
+        if (maintenance_.valid()) {
+            maintenance_.wait();
         }
         
-        // إيقاف جميع البوتات
-        shared_lock<shared_mutex> lock(botsMutex_);
-        for (auto& [token, config] : activeBots_) {
-            config.shutdownPromise.set_value();
+        deque<IdleConnection> idle;
+        {
+            lock_guard<mutex> lock(poolMutex_);
+            idle.swap(idleConnections_);
+            availableCount_ = 0;
+        }
+        for (auto& entry : idle) {
+            discardConnection(move(entry.conn));
         }
     }
 
@@ -643,174 +1157,5336 @@ public:
         return shutdownFlag_;
     }
 
-    size_t getTotalBots() const override {
-        return totalBots_;
-    }
+    size_t getPoolSize() const override {
+        return maxPoolSize_;
+    }
+
+    size_t getActiveConnections() const override {
+        size_t total = totalConnections_;
+        size_t available = availableCount_;
+        return total > available ? total - available : 0;
+    }
+
+private:
+    // since يبقى وقت الإرجاع إلى التجمع فيحكم الطرد؛ الفحص لا يجدده
+    struct IdleConnection {
+        unique_ptr<connection> conn;
+        chrono::steady_clock::time_point since;
+        chrono::steady_clock::time_point lastValidated{};
+        
+        chrono::steady_clock::time_point lastChecked() const {
+            return max(since, lastValidated);
+        }
+    };
+
+    // اتصالات الحد الأدنى تُفتح معاً عند البدء بدلاً من أول الدفعات
+    void warmUp() {
+        vector<future<unique_ptr<connection>>> dials;
+        for (size_t i = 0; i < minPoolSize_; ++i) {
+            totalConnections_++;
+            dials.push_back(async(launch::async, [this] { return openConnection(); }));
+        }
+        
+        lock_guard<mutex> lock(poolMutex_);
+        for (auto& dial : dials) {
+            if (auto conn = dial.get()) {
+                idleConnections_.push_back({move(conn), chrono::steady_clock::now()});
+            } else {
+                totalConnections_--;
+            }
+        }
+        availableCount_ = idleConnections_.size();
+    }
+
+    void maintenanceLoop() {
+        unique_lock<mutex> lock(poolMutex_);
+        while (!shutdownFlag_) {
+            maintenanceCV_.wait_for(lock, chrono::seconds(EnvironmentConfig::DB_HEALTH_CHECK_INTERVAL_SECONDS),
+                [this] { return shutdownFlag_.load(); });
+            if (shutdownFlag_) return;
+            
+            lock.unlock();
+            evictIdleConnections();
+            validateIdleConnections();
+            refillToMinimum();
+            lock.lock();
+        }
+    }
+
+    // الأقدم خمولاً في المقدمة؛ لا يُنزل الحجم تحت الحد الأدنى
+    void evictIdleConnections() {
+        vector<unique_ptr<connection>> evicted;
+        {
+            lock_guard<mutex> lock(poolMutex_);
+            auto cutoff = chrono::steady_clock::now() - chrono::seconds(idleTimeoutSeconds_.load());
+            while (!idleConnections_.empty() && idleConnections_.front().since < cutoff &&
+                   totalConnections_ - evicted.size() > minPoolSize_) {
+                evicted.push_back(move(idleConnections_.front().conn));
+                idleConnections_.pop_front();
+            }
+            availableCount_ = idleConnections_.size();
+        }
+        
+        idleEvictions_ += evicted.size();
+        for (auto& conn : evicted) {
+            discardConnection(move(conn));
+        }
+    }
+
+    // الاتصالات الخاملة طويلاً تُسحب وتُفحص خارج القفل، فتجدها الطلبات التالية جاهزة
+    void validateIdleConnections() {
+        vector<IdleConnection> checked;
+        {
+            lock_guard<mutex> lock(poolMutex_);
+            auto cutoff = chrono::steady_clock::now() - validationIdle();
+            // stable_partition يحفظ ترتيب الخمول في الجزأين
+            auto stale = stable_partition(idleConnections_.begin(), idleConnections_.end(),
+                [cutoff](const IdleConnection& idle) { return idle.lastChecked() >= cutoff; });
+            move(stale, idleConnections_.end(), back_inserter(checked));
+            idleConnections_.erase(stale, idleConnections_.end());
+            availableCount_ = idleConnections_.size();
+        }
+        
+        vector<IdleConnection> healthy;
+        for (auto& idle : checked) {
+            if (validate(*idle.conn)) {
+                idle.lastValidated = chrono::steady_clock::now();
+                healthy.push_back(move(idle));
+            } else {
+                discardConnection(move(idle.conn));
+            }
+        }
+        
+        lock_guard<mutex> lock(poolMutex_);
+        // تعود المفحوصة إلى موضعها حسب since فيبقى الأقدم خمولاً في المقدمة ليطرده evictIdleConnections
+        deque<IdleConnection> merged;
+        merge(make_move_iterator(idleConnections_.begin()), make_move_iterator(idleConnections_.end()),
+              make_move_iterator(healthy.begin()), make_move_iterator(healthy.end()), back_inserter(merged),
+              [](const IdleConnection& a, const IdleConnection& b) { return a.since < b.since; });
+        idleConnections_.swap(merged);
+        availableCount_ = idleConnections_.size();
+        connectionCV_.notify_all();
+    }
+
+    void refillToMinimum() {
+        while (!shutdownFlag_) {
+            {
+                lock_guard<mutex> lock(poolMutex_);
+                if (totalConnections_ >= minPoolSize_) return;
+                totalConnections_++;
+            }
+            
+            auto conn = openConnection();
+            
+            lock_guard<mutex> lock(poolMutex_);
+            if (!conn) {
+                totalConnections_--;
+                return;   // الخادم غير متاح؛ المحاولة في الدورة التالية
+            }
+            idleConnections_.push_back({move(conn), chrono::steady_clock::now()});
+            availableCount_ = idleConnections_.size();
+            connectionCV_.notify_one();
+        }
+    }
+
+    // الحجز في totalConnections_ مسؤولية المستدعي
+    unique_ptr<connection> openConnection() {
+        try {
+            auto conn = make_unique<connection>(connectionString_, EnvironmentConfig::DB_CONNECTION_TIMEOUT_SECONDS);
+            connectionsOpened_++;
+            return conn;
+        } catch (const exception& e) {
+            connectFailures_++;
+            cerr << "خطأ في إنشاء اتصال قاعدة البيانات: " << e.what() << endl;
+        }
+        return nullptr;
+    }
+
+    bool validate(connection& conn) {
+        validations_++;
+        try {
+            statement stmt(conn, "SELECT 1");
+            stmt.execute();
+            return true;
+        } catch (...) {
+            validationFailures_++;
+            return false;
+        }
+    }
+
+    chrono::seconds validationIdle() const {
+        return chrono::seconds(validationIdleSeconds_.load());
+    }
+
+    void recordCheckout(chrono::steady_clock::time_point started) {
+        checkouts_.add();
+        auto waited = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - started);
+        checkoutWaits_.record(static_cast<uint64_t>(waited.count()));
+    }
+
+    // يجب حذف العبارات المُحضّرة قبل إغلاق الاتصال المرتبطة به؛ الإغلاق نفسه خارج poolMutex_،
+    // فلا يُستدعى والقفل محجوز
+    void discardConnection(unique_ptr<connection> conn) {
+        if (!conn) return;
+        {
+            unique_lock<shared_mutex> lock(statementsMutex_);
+            auto cache = preparedStatements_.find(conn.get());
+            if (cache != preparedStatements_.end()) {
+                cachedStatements_ -= cache->second.size();
+                preparedStatements_.erase(cache);
+            }
+        }
+        conn.reset();
+        
+        // النقص تحت القفل حتى لا يفوت الإشعار منتظراً فحص الشرط للتو
+        {
+            lock_guard<mutex> lock(poolMutex_);
+            totalConnections_--;
+        }
+        connectionCV_.notify_one();
+    }
+
+    const string connectionString_;
+    atomic<size_t> maxPoolSize_;
+    atomic<size_t> minPoolSize_;
+    atomic<int> validationIdleSeconds_{EnvironmentConfig::DB_VALIDATION_IDLE_SECONDS};
+    atomic<int> idleTimeoutSeconds_{EnvironmentConfig::DB_IDLE_TIMEOUT_SECONDS};
+    atomic<size_t> totalConnections_{0};   // مفتوحة أو قيد الفتح أو مستعارة
+    atomic<size_t> availableCount_{0};     // نسخة من idleConnections_.size() تُقرأ دون القفل
+    atomic<bool> shutdownFlag_{false};
+    mutable mutex poolMutex_;
+    condition_variable connectionCV_;
+    condition_variable maintenanceCV_;
+    deque<IdleConnection> idleConnections_;   // الأقدم خمولاً في المقدمة
+    future<void> maintenance_;
+    
+    // الإحصائيات
+    StripedCounter checkouts_;
+    StripedHistogram checkoutWaits_;   // ميكروثانية حتى الحصول على اتصال
+    atomic<size_t> checkoutTimeouts_{0};
+    atomic<size_t> connectionsOpened_{0};
+    atomic<size_t> connectFailures_{0};
+    atomic<size_t> validations_{0};
+    atomic<size_t> validationFailures_{0};
+    atomic<size_t> idleEvictions_{0};
+    mutable mutex scrapeMutex_;
+    unique_ptr<Histogram> scrapeWaits_{make_unique<Histogram>()};
+    
+    // العبارات المُحضّرة لكل اتصال، مفتاحها معرّف الاستعلام؛ تُحذف مع الاتصال عند طرده
+    shared_mutex statementsMutex_;
+    map<const connection*, map<string, unique_ptr<statement>>> preparedStatements_;
+    StripedCounter statementCacheHits_;
+    atomic<size_t> statementCacheMisses_{0};
+    atomic<size_t> cachedStatements_{0};
+};
+
+// =============== مخزن المستخدمين ===============
+
+class SqlUserStore : public IUserStore {
+public:
+    explicit SqlUserStore(shared_ptr<IDatabaseManager> db) : dbManager_(move(db)) {}
+
+    unique_ptr<Writer> openWriter() override {
+        return make_unique<SqlWriter>(*dbManager_);
+    }
+
+    size_t forEachUser(int64_t telegramBotId,
+                       const function<void(int64_t userId, const string& username, uint32_t ageSeconds)>& visit) override {
+        size_t stored = 0;
+        auto conn = dbManager_->getConnection();
+        try {
+            // عمر LastSeen يُحسب في الخادم حتى لا يتأثر بفرق المنطقة الزمنية
+            statement& stmt = dbManager_->getPreparedStatement(*conn, "load_seen_users",
+                "SELECT UserID, Username, DATEDIFF(SECOND, LastSeen, GETDATE()) "
+                "FROM Users WHERE BotID = ?");
+            stmt.bind(0, &telegramBotId);
+            
+            result rows = stmt.execute();
+            while (rows.next()) {
+                visit(rows.get<int64_t>(0), rows.get<string>(1), static_cast<uint32_t>(max(0, rows.get<int>(2, 0))));
+                ++stored;
+            }
+        } catch (...) {
+            dbManager_->releaseConnection(move(conn));
+            throw;
+        }
+        dbManager_->releaseConnection(move(conn));
+        return stored;
+    }
+
+    vector<pair<int64_t, size_t>> countUsersByBot() override {
+        vector<pair<int64_t, size_t>> counts;
+        auto conn = dbManager_->getConnection();
+        try {
+            statement& stmt = dbManager_->getPreparedStatement(*conn, "count_users_by_bot",
+                "SELECT BotID, COUNT_BIG(*) FROM Users GROUP BY BotID");
+            result rows = stmt.execute();
+            while (rows.next()) {
+                counts.emplace_back(rows.get<int64_t>(0), static_cast<size_t>(rows.get<long long>(1)));
+            }
+        } catch (...) {
+            dbManager_->releaseConnection(move(conn));
+            throw;
+        }
+        dbManager_->releaseConnection(move(conn));
+        return counts;
+    }
+
+private:
+    // الاتصال يبقى مع المعالج ما دام لديه عمل، فلا يمر كل دفعة عبر الـ pool
+    class SqlWriter : public Writer {
+    public:
+        explicit SqlWriter(IDatabaseManager& db) : db_(db) {}
+
+        ~SqlWriter() override {
+            release();
+        }
+
+        void upsert(const vector<MessageData>& batch, const BotRegistry& registry,
+                    vector<uint8_t>& inserted) override {
+            if (!conn_) {
+                conn_ = db_.getConnection();
+            }
+            
+            db_.executeTransaction(*conn_, [&](connection& conn) {
+                inserted.assign(batch.size(), 0);
+                // دفعة كاملة في أجزاء ثابتة الحجم: عبارة MERGE واحدة ورحلة واحدة لكل جزء
+                for (size_t offset = 0; offset < batch.size(); offset += EnvironmentConfig::UPSERT_CHUNK_ROWS) {
+                    size_t count = min(EnvironmentConfig::UPSERT_CHUNK_ROWS, batch.size() - offset);
+                    upsertChunk(conn, batch, registry, offset, count, inserted);
+                }
+            });
+        }
+
+        // قد يكون الاتصال معطوباً بعد فشل؛ الـ pool يتحقق منه عند الإعادة
+        void release() override {
+            if (conn_) {
+                db_.releaseConnection(move(conn_));
+            }
+        }
+
+    private:
+        void upsertChunk(connection& conn, const vector<MessageData>& batch, const BotRegistry& registry,
+                         size_t offset, size_t count, vector<uint8_t>& inserted) {
+            // حجمان فقط للعبارة حتى تبقى مُحضّرة لكل اتصال بدلاً من نص جديد لكل حجم دفعة
+            size_t rows = count <= EnvironmentConfig::UPSERT_SMALL_CHUNK_ROWS
+                ? EnvironmentConfig::UPSERT_SMALL_CHUNK_ROWS
+                : EnvironmentConfig::UPSERT_CHUNK_ROWS;
+            
+            // نص MERGE طويل؛ يُبنى مرة واحدة للعملية بدلاً من كل جزء
+            static const string smallQueryId = "upsert_users_" + to_string(EnvironmentConfig::UPSERT_SMALL_CHUNK_ROWS);
+            static const string smallQuery = buildUpsertQuery(EnvironmentConfig::UPSERT_SMALL_CHUNK_ROWS);
+            static const string fullQueryId = "upsert_users_" + to_string(EnvironmentConfig::UPSERT_CHUNK_ROWS);
+            static const string fullQuery = buildUpsertQuery(EnvironmentConfig::UPSERT_CHUNK_ROWS);
+            bool small = rows == EnvironmentConfig::UPSERT_SMALL_CHUNK_ROWS;
+            
+            statement& stmt = db_.getPreparedStatement(conn,
+                small ? smallQueryId : fullQueryId, small ? smallQuery : fullQuery);
+            
+            // الصفوف الزائدة تكرر آخر رسالة؛ ROW_NUMBER يزيل التكرار قبل MERGE
+            for (size_t row = 0; row < rows; ++row) {
+                const auto& msg = batch[offset + min(row, count - 1)];
+                short param = static_cast<short>(row * 3);
+                stmt.bind(param, &registry.slot(msg.botId).telegramId);
+                stmt.bind(param + 1, &msg.userId);
+                stmt.bind(param + 2, msg.username.c_str());
+            }
+            
+            // OUTPUT يعيد صفاً لكل سجل مدمج؛ Seq الصف المكرر للحشو يعود لآخر رسالة فعلية
+            result output = stmt.execute();
+            while (output.next()) {
+                if (output.get<string>(0) != "INSERT") continue;
+                auto seq = static_cast<size_t>(output.get<int>(1));
+                inserted[offset + min(seq, count - 1)] = 1;
+            }
+        }
+
+        IDatabaseManager& db_;
+        unique_ptr<connection> conn_;
+    };
+
+    static string buildUpsertQuery(size_t rows) {
+        string values;
+        values.reserve(rows * 16);
+        for (size_t row = 0; row < rows; ++row) {
+            if (row > 0) values += ",";
+            values += "(" + to_string(row) + ",?,?,?)";
+        }
+        
+        return "MERGE INTO Users AS target "
+               "USING (SELECT Seq, BotID, UserID, Username FROM ("
+               "  SELECT v.Seq, v.BotID, v.UserID, v.Username, "
+               "         ROW_NUMBER() OVER (PARTITION BY v.BotID, v.UserID ORDER BY v.Seq DESC) AS Latest "
+               "  FROM (VALUES " + values + ") AS v(Seq, BotID, UserID, Username)"
+               ") AS deduped WHERE Latest = 1) AS source "
+               "ON target.BotID = source.BotID AND target.UserID = source.UserID "
+               "WHEN MATCHED THEN "
+               "  UPDATE SET Username = source.Username, LastSeen = GETDATE() "
+               "WHEN NOT MATCHED THEN "
+               "  INSERT (BotID, UserID, Username, FirstSeen, LastSeen) "
+               "  VALUES (source.BotID, source.UserID, source.Username, GETDATE(), GETDATE()) "
+               "OUTPUT $action, source.Seq;";
+    }
+
+    shared_ptr<IDatabaseManager> dbManager_;
+};
+
+// =============== خدمة التشفير المحسنة ===============
+
+// الصيغة: base64(IV[12] || ciphertext || tag[16]) كما ينتجها AuthenticatedEncryptionFilter
+class EncryptionService : public IEncryptionService {
+public:
+    EncryptionService() {
+        loadEncryptionKey();
+    }
+
+    string encrypt(const string& data) override {
+        if (data.empty()) return "";
+        
+        try {
+            CipherContext& context = cipherContext();
+            
+            // IV || ciphertext || tag في مخزن واحد محجوز مسبقاً
+            string sealed(IV_LENGTH + data.size() + TAG_LENGTH, '\0');
+            auto* out = reinterpret_cast<CryptoPP::byte*>(sealed.data());
+            context.prng.GenerateBlock(out, IV_LENGTH);
+            context.encryption.EncryptAndAuthenticate(
+                out + IV_LENGTH, out + IV_LENGTH + data.size(), TAG_LENGTH,
+                out, IV_LENGTH, nullptr, 0,
+                reinterpret_cast<const CryptoPP::byte*>(data.data()), data.size());
+            
+            string result = base64Encode(sealed);
+            cacheToken(result, data);
+            encryptionCount_.add();
+            return result;
+        } catch (const exception& e) {
+            cerr << "خطأ في التشفير: " << e.what() << endl;
+            throw runtime_error("فشل في تشفير البيانات");
+        }
+    }
+
+    string decrypt(const string& encryptedData) override {
+        if (encryptedData.empty()) return "";
+        
+        if (auto cached = cachedToken(encryptedData)) {
+            return move(*cached);
+        }
+        
+        try {
+            string decoded = base64Decode(encryptedData);
+            if (decoded.size() < IV_LENGTH + TAG_LENGTH) {
+                throw runtime_error("بيانات مشفرة غير صالحة");
+            }
+            
+            size_t length = decoded.size() - IV_LENGTH - TAG_LENGTH;
+            const auto* in = reinterpret_cast<const CryptoPP::byte*>(decoded.data());
+            string plaintext(length, '\0');
+            
+            CipherContext& context = cipherContext();
+            bool valid = context.decryption.DecryptAndVerify(
+                reinterpret_cast<CryptoPP::byte*>(plaintext.data()),
+                in + IV_LENGTH + length, TAG_LENGTH,
+                in, IV_LENGTH, nullptr, 0,
+                in + IV_LENGTH, length);
+            if (!valid) {
+                throw runtime_error("فشل التحقق من سلامة البيانات المشفرة");
+            }
+            
+            cacheToken(encryptedData, plaintext);
+            decryptionCount_.add();
+            return plaintext;
+        } catch (const exception& e) {
+            cerr << "خطأ في فك التشفير: " << e.what() << endl;
+            throw runtime_error("فشل في فك تشفير البيانات");
+        }
+    }
+
+    void configure(const map<string, string>& config) override {
+        if (config.count("encryption_key")) {
+            loadEncryptionKeyFromString(config.at("encryption_key"));
+        }
+    }
+
+    map<string, string> getConfiguration() const override {
+        return {
+            {"key_length", to_string(KEY_LENGTH)},
+            {"iv_length", to_string(IV_LENGTH)},
+            {"token_cache_capacity", to_string(EnvironmentConfig::TOKEN_CACHE_CAPACITY)}
+        };
+    }
+
+    // لا يأخذ cacheMutex_: فك التشفير عند بدء البوتات بالتوازي لا يتنافس مع طلب المقاييس
+    void collectMetrics(MetricSink& sink) const override {
+        size_t encryptions = encryptionCount_.load();
+        size_t decryptions = decryptionCount_.load();
+        sink.gauge("encryption_count", static_cast<double>(encryptions));
+        sink.gauge("decryption_count", static_cast<double>(decryptions));
+        sink.gauge("total_operations", static_cast<double>(encryptions + decryptions));
+        sink.gauge("token_cache_size", static_cast<double>(cachedTokens_.load(memory_order_relaxed)));
+        sink.gauge("token_cache_hits", static_cast<double>(cacheHits_.load()));
+        sink.gauge("cipher_rekeys", static_cast<double>(rekeyCount_.load()));
+    }
+
+    bool isHealthy() const override {
+        return isKeyValid();
+    }
+
+    string getStatus() const override {
+        return isKeyValid() ? "healthy" : "invalid_key";
+    }
+
+    bool isKeyValid() const override {
+        shared_lock<shared_mutex> lock(keyMutex_);
+        return key_.size() == KEY_LENGTH;
+    }
+
+private:
+    // سياق GCM مُهيأ بالمفتاح لكل خيط: جدولة مفتاح AES مرة واحدة، ثم IV جديد لكل رسالة.
+    // المالك يُعرف بمعرّف النسخة لا بعنوانها: نسخة جديدة قد تُنشأ في عنوان نسخة محذوفة
+    struct CipherContext {
+        uint64_t instanceId{0};   // 0 = لم يُهيأ
+        uint64_t keyGeneration{0};
+        GCM<AES>::Encryption encryption;
+        GCM<AES>::Decryption decryption;
+        AutoSeededRandomPool prng;   // غير آمن للاستخدام المتزامن، فلكل خيط مولّده
+    };
+
+    CipherContext& cipherContext() {
+        thread_local CipherContext context;
+        
+        uint64_t generation = keyGeneration_.load(memory_order_acquire);
+        if (context.instanceId != instanceId_ || context.keyGeneration != generation) {
+            shared_lock<shared_mutex> lock(keyMutex_);
+            context.encryption.SetKey(key_, key_.size());
+            context.decryption.SetKey(key_, key_.size());
+            context.instanceId = instanceId_;
+            context.keyGeneration = keyGeneration_.load(memory_order_relaxed);
+            rekeyCount_.add();
+        }
+        return context;
+    }
+
+    optional<string> cachedToken(const string& encryptedData) {
+        lock_guard<mutex> lock(cacheMutex_);
+        auto it = tokenCache_.find(encryptedData);
+        if (it == tokenCache_.end()) return nullopt;
+        
+        cacheOrder_.splice(cacheOrder_.begin(), cacheOrder_, it->second.order);
+        cacheHits_.add();
+        const SecByteBlock& plaintext = it->second.plaintext;
+        return string(reinterpret_cast<const char*>(plaintext.data()), plaintext.size());
+    }
+
+    // النص الواضح في SecByteBlock يُمسح من الذاكرة عند الإخراج من الذاكرة المؤقتة
+    void cacheToken(const string& encryptedData, const string& plaintext) {
+        lock_guard<mutex> lock(cacheMutex_);
+        if (tokenCache_.count(encryptedData)) return;
+        
+        if (tokenCache_.size() >= EnvironmentConfig::TOKEN_CACHE_CAPACITY) {
+            tokenCache_.erase(cacheOrder_.back());
+            cacheOrder_.pop_back();
+        }
+        
+        cacheOrder_.push_front(encryptedData);
+        tokenCache_.emplace(encryptedData, CachedToken{
+            SecByteBlock(reinterpret_cast<const CryptoPP::byte*>(plaintext.data()), plaintext.size()),
+            cacheOrder_.begin()});
+        cachedTokens_.store(tokenCache_.size(), memory_order_relaxed);
+    }
+
+    void loadEncryptionKey() {
+        const char* envKey = getenv("ENCRYPTION_KEY");
+        if (envKey && strlen(envKey) > 0) {
+            loadEncryptionKeyFromString(envKey);
+        } else {
+            generateNewKey();
+        }
+    }
+
+    void loadEncryptionKeyFromString(const string& keyStr) {
+        try {
+            string decoded = base64Decode(keyStr);
+            if (decoded.size() == KEY_LENGTH) {
+                setKey(SecByteBlock(reinterpret_cast<const CryptoPP::byte*>(decoded.data()), decoded.size()));
+            } else {
+                generateNewKey();
+            }
+        } catch (...) {
+            generateNewKey();
+        }
+    }
+
+    void generateNewKey() {
+        SecByteBlock key(KEY_LENGTH);
+        AutoSeededRandomPool prng;
+        prng.GenerateBlock(key, key.size());
+        setKey(move(key));
+        cerr << "تحذير: تم إنشاء مفتاح تشفير جديد. يرجى تعيين ENCRYPTION_KEY" << endl;
+    }
+
+    // السياقات والذاكرة المؤقتة مرتبطة بالمفتاح السابق
+    void setKey(SecByteBlock key) {
+        {
+            unique_lock<shared_mutex> lock(keyMutex_);
+            key_ = move(key);
+            keyGeneration_.fetch_add(1, memory_order_release);
+        }
+        
+        lock_guard<mutex> lock(cacheMutex_);
+        tokenCache_.clear();
+        cacheOrder_.clear();
+        cachedTokens_.store(0, memory_order_relaxed);
+    }
+
+    static string base64Encode(const string& data) {
+        static constexpr char alphabet[] =
+            "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+        
+        string encoded((data.size() + 2) / 3 * 4, '=');
+        const auto* in = reinterpret_cast<const unsigned char*>(data.data());
+        size_t out = 0;
+        size_t i = 0;
+        for (; i + 3 <= data.size(); i += 3) {
+            uint32_t triple = (in[i] << 16) | (in[i + 1] << 8) | in[i + 2];
+            encoded[out++] = alphabet[(triple >> 18) & 0x3f];
+            encoded[out++] = alphabet[(triple >> 12) & 0x3f];
+            encoded[out++] = alphabet[(triple >> 6) & 0x3f];
+            encoded[out++] = alphabet[triple & 0x3f];
+        }
+        if (i < data.size()) {
+            uint32_t triple = in[i] << 16;
+            if (i + 1 < data.size()) triple |= in[i + 1] << 8;
+            encoded[out++] = alphabet[(triple >> 18) & 0x3f];
+            encoded[out++] = alphabet[(triple >> 12) & 0x3f];
+            if (i + 1 < data.size()) encoded[out] = alphabet[(triple >> 6) & 0x3f];
+        }
+        return encoded;
+    }
+
+    // مثل Base64Decoder: المحارف خارج الأبجدية (أسطر جديدة ومسافات) تُتجاهل، و'=' تنهي البيانات
+    static string base64Decode(const string& encoded) {
+        static const array<int8_t, 256> values = [] {
+            array<int8_t, 256> table;
+            table.fill(-1);
+            const char* alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+            for (int i = 0; i < 64; ++i) {
+                table[static_cast<unsigned char>(alphabet[i])] = static_cast<int8_t>(i);
+            }
+            return table;
+        }();
+        
+        string decoded(encoded.size() / 4 * 3 + 3, '\0');
+        size_t out = 0;
+        uint32_t buffer = 0;
+        int bits = 0;
+        for (char c : encoded) {
+            if (c == '=') break;
+            int8_t value = values[static_cast<unsigned char>(c)];
+            if (value < 0) continue;
+            
+            buffer = (buffer << 6) | static_cast<uint32_t>(value);
+            bits += 6;
+            if (bits >= 8) {
+                bits -= 8;
+                decoded[out++] = static_cast<char>((buffer >> bits) & 0xff);
+            }
+        }
+        decoded.resize(out);
+        return decoded;
+    }
+
+    struct CachedToken {
+        SecByteBlock plaintext;
+        list<string>::iterator order;
+    };
+
+    static constexpr size_t KEY_LENGTH = 32;  // AES-256
+    static constexpr size_t IV_LENGTH = 12;   // GCM recommended IV size
+    static constexpr size_t TAG_LENGTH = 16;  // الافتراضي في AuthenticatedEncryptionFilter
+    
+    static inline atomic<uint64_t> nextInstanceId_{1};
+    const uint64_t instanceId_{nextInstanceId_.fetch_add(1, memory_order_relaxed)};
+    SecByteBlock key_;
+    mutable shared_mutex keyMutex_;
+    atomic<uint64_t> keyGeneration_{0};
+    
+    // فك تشفير التوكنات المتكرر (إعادة تشغيل البوتات) يُخدم من الذاكرة
+    mutable mutex cacheMutex_;
+    unordered_map<string, CachedToken> tokenCache_;
+    list<string> cacheOrder_;   // الأحدث استخداماً أولاً
+    atomic<size_t> cachedTokens_{0};   // نسخة من tokenCache_.size() تُقرأ دون القفل
+    
+    StripedCounter encryptionCount_;
+    StripedCounter decryptionCount_;
+    StripedCounter cacheHits_;
+    StripedCounter rekeyCount_;
+};
+
+// =============== التحكم في القبول ===============
+
+enum class OverloadPolicy {
+    Block,  // انتظار تصريح حتى المهلة ثم الرفض
+    Drop,   // الرفض فوراً عند امتلاء التصاريح
+    Spill   // قبول الحدث في مخزن الفائض بدون تصريح
+};
+
+enum class AdmissionResult {
+    Admitted,
+    Spilled,
+    Rejected
+};
+
+// يحد عدد الأحداث المقبولة التي لم تُثبّت بعد؛ التصاريح تُعاد بعد تثبيت الدفعة
+class AdmissionController : public IConfigurable, public IMonitorable {
+public:
+    explicit AdmissionController(size_t permits = EnvironmentConfig::MAX_CONCURRENT_TASKS)
+        : maxPermits_(permits), permits_(static_cast<ptrdiff_t>(permits)) {}
+
+    AdmissionResult admit() {
+        if (permits_.try_acquire()) {
+            return admitted();
+        }
+        
+        // التصاريح عند معالجات تنتظر اكتمال دفعاتها: تُثبّت ما لديها الآن بدلاً من انتظار المهلة
+        if (onSaturated_) {
+            onSaturated_();
+        }
+        
+        switch (policy_.load()) {
+            case OverloadPolicy::Block: {
+                waiting_++;
+                bool acquired = permits_.try_acquire_for(chrono::milliseconds(timeoutMs_.load()));
+                waiting_--;
+                if (acquired) {
+                    delayedEvents_++;
+                    return admitted();
+                }
+                break;
+            }
+            case OverloadPolicy::Spill:
+                spilledEvents_++;
+                return AdmissionResult::Spilled;
+            case OverloadPolicy::Drop:
+                break;
+        }
+        
+        rejectedEvents_++;
+        return AdmissionResult::Rejected;
+    }
+
+    // لمصفوفة تحديثات كاملة (getUpdates): يحجز حتى count تصريحاً وينتظر مرة واحدة على الأكثر،
+    // فلا تتراكم مهلة لكل تحديث. لا فائض هنا: ما لم يُقبل يبقى عند تيليجرام ويُطلب ثانية
+    size_t admitMany(size_t count) {
+        size_t granted = 0;
+        while (granted < count && permits_.try_acquire()) {
+            granted++;
+        }
+        
+        if (granted == 0 && count > 0 && policy_.load() == OverloadPolicy::Block) {
+            if (onSaturated_) {
+                onSaturated_();
+            }
+            waiting_++;
+            bool acquired = permits_.try_acquire_for(chrono::milliseconds(timeoutMs_.load()));
+            waiting_--;
+            if (acquired) {
+                delayedEvents_++;
+                granted++;
+                while (granted < count && permits_.try_acquire()) {
+                    granted++;
+                }
+            }
+        }
+        
+        inFlight_ += granted;
+        admittedEvents_ += granted;
+        return granted;
+    }
+
+    void release(size_t count) {
+        if (count == 0) return;
+        inFlight_ -= count;
+        permits_.release(static_cast<ptrdiff_t>(count));
+    }
+
+    // يُضبط قبل أول admit()؛ يُستدعى من خيوط الاستقبال عند نفاد التصاريح
+    void setSaturationHandler(function<void()> handler) {
+        onSaturated_ = move(handler);
+    }
+
+    // منتج ينتظر تصريحاً أو كل التصاريح محجوزة
+    bool saturated() const {
+        return waiting_.load(memory_order_relaxed) > 0 || inFlight_.load(memory_order_relaxed) >= maxPermits_;
+    }
+
+    size_t capacity() const {
+        return maxPermits_;
+    }
+
+    OverloadPolicy getPolicy() const {
+        return policy_;
+    }
+
+    void configure(const map<string, string>& config) override {
+        if (config.count("overload_policy")) {
+            const string& policy = config.at("overload_policy");
+            if (policy == "block") policy_ = OverloadPolicy::Block;
+            else if (policy == "drop") policy_ = OverloadPolicy::Drop;
+            else if (policy == "spill") policy_ = OverloadPolicy::Spill;
+            else cerr << "تحذير: سياسة حمل زائد غير معروفة: " << policy << endl;
+        }
+        if (config.count("admission_timeout_ms")) {
+            timeoutMs_ = stoi(config.at("admission_timeout_ms"));
+        }
+    }
+
+    map<string, string> getConfiguration() const override {
+        static const char* names[] = {"block", "drop", "spill"};
+        return {
+            {"overload_policy", names[static_cast<int>(policy_.load())]},
+            {"admission_timeout_ms", to_string(timeoutMs_)},
+            {"max_pending_events", to_string(maxPermits_)}
+        };
+    }
+
+    void collectMetrics(MetricSink& sink) const override {
+        sink.gauge("admitted_events", static_cast<double>(admittedEvents_));
+        sink.gauge("delayed_events", static_cast<double>(delayedEvents_));
+        sink.gauge("rejected_events", static_cast<double>(rejectedEvents_));
+        sink.gauge("spilled_events", static_cast<double>(spilledEvents_));
+        sink.gauge("pending_events", static_cast<double>(inFlight_));
+    }
+
+    bool isHealthy() const override {
+        return inFlight_ < maxPermits_;
+    }
+
+    string getStatus() const override {
+        return isHealthy() ? "healthy" : "saturated";
+    }
+
+private:
+    AdmissionResult admitted() {
+        inFlight_++;
+        admittedEvents_++;
+        return AdmissionResult::Admitted;
+    }
+
+    const size_t maxPermits_;
+    counting_semaphore<> permits_;
+    atomic<OverloadPolicy> policy_{OverloadPolicy::Block};
+    atomic<int> timeoutMs_{EnvironmentConfig::ADMISSION_TIMEOUT_MS};
+    function<void()> onSaturated_;
+    
+    atomic<size_t> waiting_{0};
+    atomic<size_t> inFlight_{0};
+    atomic<size_t> admittedEvents_{0};
+    atomic<size_t> delayedEvents_{0};
+    atomic<size_t> rejectedEvents_{0};
+    atomic<size_t> spilledEvents_{0};
+};
+
+// =============== سجل الكتابة المسبقة ===============
+
+// موضع حدث في السجل: يُستخدم لانتظار الحفظ على القرص
+struct SpillTicket {
+    uint64_t segmentId{0};
+    uint64_t sequence{0};
+};
+
+// سجل إلحاقي مقسم إلى مقاطع على القرص. كل حدث يُكتب قبل إقراره لتيليجرام،
+// والمزامنة مع القرص جماعية (fdatasync واحد لكل دفعة كتابات).
+// يُحذف المقطع المغلق عندما تُثبّت جميع أحداثه، وتُعاد المقاطع التي فشلت
+// أو استقبلت أحداث فائض إلى قاعدة البيانات دفعة واحدة.
+class SpillLog : public IMonitorable, public IShutdownable {
+public:
+    struct Segment {
+        uint64_t id{0};
+        string path;
+        int fd{-1};
+        uint64_t bytes{0};
+        uint64_t durableBytes{0};        // طول الملف بعد آخر مزامنة ناجحة؛ يكتبه المُفرّغ فقط
+        bool torn{false};                // تعذر قص سجل مبتور؛ لا يُكتب بعده شيء (المُفرّغ فقط)
+        bool sealed{false};
+        atomic<size_t> pending{0};       // أحداث لم تُثبّت بعد
+        atomic<bool> needsReplay{false};  // فشل تثبيت أو أحداث فائض أو بقايا تشغيل سابق
+    };
+
+    explicit SpillLog(const string& directory,
+                      uint64_t segmentBytes = EnvironmentConfig::SPILL_SEGMENT_BYTES)
+        : directory_(directory), segmentBytes_(segmentBytes) {
+        filesystem::create_directories(directory_);
+        recoverSegments();
+        openSegment();
+        flusher_ = async(launch::async, [this]() { flusherLoop(); });
+    }
+
+    ~SpillLog() override {
+        shutdown();
+    }
+
+    // يضيف الحدث إلى المخزن المؤقت؛ spilled تعني أنه لن يمر عبر الطابور
+    // الحدث يُسجّل بمعرّف تيليجرام لأن المعرّف الكثيف لا يبقى بعد إعادة التشغيل
+    SpillTicket append(const MessageData& message, int64_t telegramBotId, bool spilled) {
+        lock_guard<mutex> lock(mutex_);
+        
+        if (active_->bytes >= segmentBytes_) {
+            rotateSegment();
+        }
+        
+        size_t before = pendingWrites_.empty() || pendingWrites_.back().segment != active_
+            ? 0 : pendingWrites_.back().bytes.size();
+        if (before == 0) {
+            pendingWrites_.push_back({active_, {}});
+        }
+        encodeRecord(pendingWrites_.back().bytes, message, telegramBotId);
+        active_->bytes += pendingWrites_.back().bytes.size() - before;
+        active_->pending++;
+        if (spilled) {
+            active_->needsReplay = true;
+        }
+        
+        bufferedBytes_ += pendingWrites_.back().bytes.size() - before;
+        if (bufferedBytes_ >= EnvironmentConfig::SPILL_FLUSH_BYTES) {
+            flushCV_.notify_one();
+        }
+        
+        appendedEvents_++;
+        return {active_->id, ++appendedSequence_};
+    }
+
+    // انتظار المزامنة الجماعية التالية التي تشمل هذا الحدث؛ false إذا فشلت كتابتها أو مزامنتها
+    bool waitDurable(const SpillTicket& ticket) {
+        return waitDurable(ticket, ticket);
+    }
+
+    // الأحداث من first إلى last كلها محفوظة: مزامنة ناجحة لاحقة لا تغطي دفعة فشلت قبلها
+    bool waitDurable(const SpillTicket& first, const SpillTicket& last) {
+        if (durableSequence_ >= last.sequence && failedFlushes_ == 0) return true;
+        
+        unique_lock<mutex> lock(mutex_);
+        flushCV_.notify_one();
+        durableCV_.wait(lock, [this, &last] {
+            return flushedSequence_ >= last.sequence || shutdownFlag_;
+        });
+        if (flushedSequence_ < last.sequence) return false;
+        return none_of(failedRanges_.begin(), failedRanges_.end(), [&](const pair<uint64_t, uint64_t>& range) {
+            return range.first <= last.sequence && first.sequence <= range.second;
+        });
+    }
+
+    // إقرار تثبيت أحداث في قاعدة البيانات؛ المقطع المغلق المكتمل يُحذف
+    void acknowledge(uint64_t segmentId, size_t count) {
+        lock_guard<mutex> lock(mutex_);
+        auto it = segments_.find(segmentId);
+        if (it == segments_.end()) return;   // أُعيد تشغيله وحُذف مسبقاً
+        
+        auto& segment = it->second;
+        segment->pending -= min(count, segment->pending.load());
+        removeIfComplete(segment);
+    }
+
+    void markNeedsReplay(uint64_t segmentId) {
+        lock_guard<mutex> lock(mutex_);
+        auto it = segments_.find(segmentId);
+        if (it != segments_.end()) {
+            it->second->needsReplay = true;
+        }
+    }
+
+    // المقاطع التي يجب إعادتها إلى قاعدة البيانات؛ المقطع النشط يُغلق أولاً إذا احتاج ذلك
+    vector<shared_ptr<Segment>> takeReplayableSegments() {
+        {
+            lock_guard<mutex> lock(mutex_);
+            if (active_->needsReplay && active_->bytes > 0) {
+                rotateSegment();
+            }
+        }
+        
+        // المقطع المغلق قابل للقراءة بعد كتابة آخر بايت منه ومزامنته
+        waitDurable({0, appendedSequence_.load()});
+        
+        lock_guard<mutex> lock(mutex_);
+        vector<shared_ptr<Segment>> result;
+        for (const auto& [id, segment] : segments_) {
+            if (segment->sealed && segment->fd < 0 && segment->needsReplay) {
+                result.push_back(segment);
+            }
+        }
+        return result;
+    }
+
+    struct ReadResult {
+        size_t records{0};
+        bool intact{false};   // انتهت القراءة عند نهاية الملف ولا شيء بعد آخر سجل مقروء
+    };
+
+    // يقرأ أحداث المقطع بالترتيب ويتوقف عند أول سجل ناقص أو تالف. سجل ناقص في آخر الملف
+    // (انقطاع أثناء الكتابة، لم يُقر لتيليجرام) لا يفسد المقطع؛ أما سجل تالف تليه بيانات فيعني
+    // أن ما بعده لا يُقرأ، فـ intact = false
+    ReadResult readSegment(const Segment& segment, const function<void(int64_t, MessageData&&)>& consumer) const {
+        ifstream in(segment.path, ios::binary);
+        ReadResult result;
+        if (!in) return result;
+        string payload;
+        
+        for (;;) {
+            uint32_t header[2];
+            if (!in.read(reinterpret_cast<char*>(header), sizeof(header))) {
+                result.intact = in.eof();
+                break;
+            }
+            if (header[0] > EnvironmentConfig::SPILL_MAX_RECORD_BYTES) break;
+            
+            payload.resize(header[0]);
+            if (!in.read(payload.data(), payload.size())) {
+                result.intact = in.eof();
+                break;
+            }
+            
+            MessageData message;
+            int64_t telegramBotId = 0;
+            if (checksum(payload.data(), payload.size()) != header[1] ||
+                !decodeRecord(payload, message, telegramBotId)) {
+                result.intact = in.peek() == char_traits<char>::eof();
+                break;
+            }
+            consumer(telegramBotId, move(message));
+            ++result.records;
+        }
+        
+        return result;
+    }
+
+    // مقطع تالف لا يُحذف: يُعاد تسميته (.torn) فلا يُعاد في التشغيل التالي ويبقى للفحص اليدوي
+    void quarantineSegment(uint64_t segmentId) {
+        lock_guard<mutex> lock(mutex_);
+        auto it = segments_.find(segmentId);
+        if (it == segments_.end() || !it->second->sealed) return;
+        
+        filesystem::path path = it->second->path;
+        filesystem::path quarantined = path;
+        quarantined.replace_extension(".torn");
+        error_code ec;
+        filesystem::rename(path, quarantined, ec);
+        cerr << "❌ مقطع سجل فائض تالف: " << (ec ? path : quarantined).string()
+             << "؛ الأحداث بعد موضع التلف لم تُعد" << endl;
+        segments_.erase(it);
+        quarantinedSegments_++;
+    }
+
+    // بعد إعادة أحداث المقطع بنجاح
+    void removeSegment(uint64_t segmentId) {
+        lock_guard<mutex> lock(mutex_);
+        auto it = segments_.find(segmentId);
+        if (it == segments_.end() || !it->second->sealed) return;
+        
+        error_code ec;
+        filesystem::remove(it->second->path, ec);
+        segments_.erase(it);
+        removedSegments_++;
+    }
+
+    void recordReplayed(size_t events) {
+        replayedEvents_ += events;
+    }
+
+    // أحجام المقاطع يلخصها المُفرّغ في كل دورة، فلا يُؤخذ قفل الإضافة هنا
+    void collectMetrics(MetricSink& sink) const override {
+        sink.gauge("spill_log_segments", static_cast<double>(segmentCount_));
+        sink.gauge("spill_log_bytes", static_cast<double>(segmentBytesTotal_));
+        sink.gauge("spill_log_pending_events", static_cast<double>(pendingEvents_));
+        sink.gauge("spill_log_replayable_segments", static_cast<double>(replayableSegments_));
+        sink.gauge("spill_log_appended_events", static_cast<double>(appendedEvents_));
+        sink.gauge("spill_log_replayed_events", static_cast<double>(replayedEvents_));
+        sink.gauge("spill_log_removed_segments", static_cast<double>(removedSegments_));
+        sink.gauge("spill_log_fsyncs", static_cast<double>(syncCount_));
+        sink.gauge("spill_log_failed_flushes", static_cast<double>(failedFlushes_));
+        sink.gauge("spill_log_quarantined_segments", static_cast<double>(quarantinedSegments_));
+    }
+
+    bool isHealthy() const override {
+        return !shutdownFlag_ && !writeFailed_;
+    }
+
+    string getStatus() const override {
+        if (shutdownFlag_) return "shutdown";
+        return writeFailed_ ? "write_failed" : "healthy";
+    }
+
+    void shutdown() override {
+        {
+            lock_guard<mutex> lock(mutex_);
+            if (shutdownFlag_) return;
+            shutdownFlag_ = true;
+            flushCV_.notify_all();
+        }
+        
+        // المُفرّغ يكتب ما تبقى قبل الخروج
+        if (flusher_.valid()) {
+            flusher_.wait();
+        }
+        
+        lock_guard<mutex> lock(mutex_);
+        durableCV_.notify_all();
+        for (auto& [id, segment] : segments_) {
+            closeSegmentFile(*segment);
+        }
+        
+        // المقطع النشط الذي ثُبّتت جميع أحداثه لا حاجة لإعادته في التشغيل التالي
+        if (active_) {
+            active_->sealed = true;
+            removeIfComplete(active_);
+        }
+    }
+
+    bool isShutdown() const override {
+        return shutdownFlag_;
+    }
+
+private:
+    struct PendingWrite {
+        shared_ptr<Segment> segment;
+        string bytes;
+    };
+
+    // كتابات مقطع واحد في دفعة المُفرّغ
+    struct SegmentFlush {
+        shared_ptr<Segment> segment;
+        uint64_t bytes{0};
+        int error{0};        // errno عند أول write أو fdatasync فاشل
+    };
+
+    // لا يُكتب سجل بعد سجل مبتور أبداً: الملف يُقص إلى آخر طول مزامَن، فتُلحق الكتابات التالية
+    // (O_APPEND) بعده مباشرة. إن فشل القص يُغلق المقطع ويُفتح غيره
+    static void discardTornWrites(SegmentFlush& flush) {
+        Segment& segment = *flush.segment;
+        if (::ftruncate(segment.fd, static_cast<off_t>(segment.durableBytes)) != 0 ||
+            ::fdatasync(segment.fd) != 0) {
+            segment.torn = true;
+        }
+    }
+
+    void flusherLoop() {
+        vector<PendingWrite> writes;
+        
+        for (;;) {
+            uint64_t sequence;
+            vector<shared_ptr<Segment>> sealed;
+            {
+                unique_lock<mutex> lock(mutex_);
+                flushCV_.wait_for(lock, chrono::milliseconds(EnvironmentConfig::SPILL_SYNC_INTERVAL_MS),
+                    [this] { return bufferedBytes_ >= EnvironmentConfig::SPILL_FLUSH_BYTES || shutdownFlag_; });
+                
+                // المقاطع المغلقة قبل هذه اللحظة لن تستقبل كتابات جديدة بعد هذه الدفعة
+                uint64_t bytes = 0;
+                size_t pending = 0;
+                size_t replayable = 0;
+                for (const auto& [id, segment] : segments_) {
+                    if (segment->sealed && segment->fd >= 0) sealed.push_back(segment);
+                    bytes += segment->bytes;
+                    pending += segment->pending;
+                    replayable += segment->needsReplay ? 1 : 0;
+                }
+                segmentCount_.store(segments_.size(), memory_order_relaxed);
+                segmentBytesTotal_.store(bytes, memory_order_relaxed);
+                pendingEvents_.store(pending, memory_order_relaxed);
+                replayableSegments_.store(replayable, memory_order_relaxed);
+                
+                if (pendingWrites_.empty() && sealed.empty()) {
+                    if (shutdownFlag_) return;
+                    continue;
+                }
+                
+                writes.swap(pendingWrites_);
+                bufferedBytes_ = 0;
+                sequence = appendedSequence_;
+            }
+            
+            // الكتابة والمزامنة خارج القفل حتى لا تتوقف خيوط الاستقبال
+            vector<SegmentFlush> touched;
+            for (auto& write : writes) {
+                auto it = find_if(touched.begin(), touched.end(),
+                    [&](const SegmentFlush& flush) { return flush.segment == write.segment; });
+                if (it == touched.end()) {
+                    it = touched.insert(touched.end(), {write.segment});
+                }
+                it->bytes += write.bytes.size();
+                if (write.segment->torn) {
+                    it->error = EIO;
+                } else if (it->error == 0 && !writeAll(write.segment->fd, write.bytes)) {
+                    it->error = errno;
+                }
+            }
+            bool ok = true;
+            for (auto& flush : touched) {
+                if (flush.error == 0 && ::fdatasync(flush.segment->fd) != 0) {
+                    flush.error = errno;
+                }
+                if (flush.error == 0) {
+                    flush.segment->durableBytes += flush.bytes;
+                } else {
+                    ok = false;
+                    if (!flush.segment->torn) discardTornWrites(flush);
+                }
+            }
+            if (!touched.empty()) {
+                syncCount_++;
+            }
+            writes.clear();
+            
+            // عند فشل الكتابة يُحرر المنتظرون بـ false (503 فيعيد تيليجرام الإرسال) ولا تتقدم
+            // durableSequence_؛ الحالة تظهر في isHealthy
+            lock_guard<mutex> lock(mutex_);
+            for (const auto& flush : touched) {
+                if (flush.error == 0) continue;
+                if (!writeFailed_) {
+                    cerr << "خطأ في الكتابة إلى سجل الفائض " << flush.segment->path << ": "
+                         << strerror(flush.error) << endl;
+                }
+                // ما لم يُكتب لا يُحتسب في حجم المقطع؛ والمقطع الذي تعذر قصه لا يستقبل كتابات بعد الآن
+                flush.segment->bytes -= flush.bytes;
+                if (flush.segment->torn && flush.segment == active_) {
+                    rotateSegment();
+                }
+            }
+            writeFailed_ = !ok;
+            for (auto& segment : sealed) {
+                closeSegmentFile(*segment);
+                removeIfComplete(segment);
+            }
+            if (ok) {
+                durableSequence_ = sequence;
+            } else if (sequence > flushedSequence_) {
+                recordFailedRange(flushedSequence_ + 1, sequence);
+            }
+            flushedSequence_ = max(flushedSequence_, sequence);
+            durableCV_.notify_all();
+        }
+    }
+
+    // الدفعات الفاشلة المتتالية تُدمج في مدى واحد؛ يُحفظ آخر MAX_FAILED_RANGES فقط لأن المنتظر
+    // يسأل عن حدث أضافه للتو
+    void recordFailedRange(uint64_t from, uint64_t to) {
+        failedFlushes_++;
+        if (!failedRanges_.empty() && failedRanges_.back().second + 1 == from) {
+            failedRanges_.back().second = to;
+            return;
+        }
+        failedRanges_.emplace_back(from, to);
+        if (failedRanges_.size() > MAX_FAILED_RANGES) {
+            failedRanges_.pop_front();
+        }
+    }
+
+    void recoverSegments() {
+        for (const auto& entry : filesystem::directory_iterator(directory_)) {
+            const string name = entry.path().filename().string();
+            if (name.rfind("segment-", 0) != 0 || entry.path().extension() != ".log") continue;
+            
+            auto segment = make_shared<Segment>();
+            segment->id = stoull(name.substr(8, name.size() - 12));
+            segment->path = entry.path().string();
+            segment->bytes = entry.file_size();
+            segment->durableBytes = segment->bytes;
+            segment->sealed = true;
+            segment->needsReplay = true;
+            segments_[segment->id] = segment;
+            nextSegmentId_ = max(nextSegmentId_, segment->id + 1);
+        }
+        
+        if (!segments_.empty()) {
+            cout << "📼 سجل الفائض: " << segments_.size() << " مقطع بانتظار الإعادة" << endl;
+        }
+    }
+
+    void openSegment() {
+        auto segment = make_shared<Segment>();
+        segment->id = nextSegmentId_++;
+        
+        char name[32];
+        snprintf(name, sizeof(name), "segment-%012llu.log", static_cast<unsigned long long>(segment->id));
+        segment->path = (filesystem::path(directory_) / name).string();
+        segment->fd = ::open(segment->path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0640);
+        if (segment->fd < 0) {
+            throw runtime_error("فشل في إنشاء مقطع سجل الفائض: " + segment->path);
+        }
+        syncDirectory();
+        
+        segments_[segment->id] = segment;
+        active_ = segment;
+    }
+
+    // يُستدعى والقفل ممسوك؛ الملف القديم يُغلق بعد أن يكتب المُفرّغ آخر بياناته
+    void rotateSegment() {
+        active_->sealed = true;
+        openSegment();
+    }
+
+    void removeIfComplete(const shared_ptr<Segment>& segment) {
+        if (segment->sealed && segment->fd < 0 && segment->pending == 0 && !segment->needsReplay) {
+            error_code ec;
+            filesystem::remove(segment->path, ec);
+            segments_.erase(segment->id);
+            removedSegments_++;
+        }
+    }
+
+    static void closeSegmentFile(Segment& segment) {
+        if (segment.fd >= 0) {
+            ::fdatasync(segment.fd);
+            ::close(segment.fd);
+            segment.fd = -1;
+        }
+    }
+
+    void syncDirectory() {
+        int dirFd = ::open(directory_.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dirFd >= 0) {
+            ::fsync(dirFd);
+            ::close(dirFd);
+        }
+    }
+
+    static bool writeAll(int fd, const string& bytes) {
+        const char* data = bytes.data();
+        size_t remaining = bytes.size();
+        while (remaining > 0) {
+            ssize_t written = ::write(fd, data, remaining);
+            if (written < 0) {
+                if (errno == EINTR) continue;
+                return false;
+            }
+            data += written;
+            remaining -= static_cast<size_t>(written);
+        }
+        return true;
+    }
+
+    // [طول الحمولة u32][CRC32 u32][الحمولة]
+    static void encodeRecord(string& out, const MessageData& message, int64_t telegramBotId) {
+        size_t headerPos = out.size();
+        out.append(8, '\0');
+        size_t payloadPos = out.size();
+        
+        appendValue(out, telegramBotId);
+        appendValue(out, message.userId);
+        appendString(out, message.username);
+        appendValue(out, message.hitCount);
+        
+        uint32_t header[2] = {
+            static_cast<uint32_t>(out.size() - payloadPos),
+            checksum(out.data() + payloadPos, out.size() - payloadPos)
+        };
+        memcpy(out.data() + headerPos, header, sizeof(header));
+    }
+
+    static bool decodeRecord(const string& payload, MessageData& message, int64_t& telegramBotId) {
+        size_t pos = 0;
+        return readValue(payload, pos, telegramBotId)
+            && readValue(payload, pos, message.userId)
+            && readString(payload, pos, message.username)
+            && readValue(payload, pos, message.hitCount)
+            && pos == payload.size();
+    }
+
+    template <typename T>
+    static void appendValue(string& out, const T& value) {
+        out.append(reinterpret_cast<const char*>(&value), sizeof(T));
+    }
+
+    static void appendString(string& out, const string& value) {
+        appendValue(out, static_cast<uint16_t>(value.size()));
+        out.append(value);
+    }
+
+    template <typename T>
+    static bool readValue(const string& in, size_t& pos, T& value) {
+        if (pos + sizeof(T) > in.size()) return false;
+        memcpy(&value, in.data() + pos, sizeof(T));
+        pos += sizeof(T);
+        return true;
+    }
+
+    static bool readString(const string& in, size_t& pos, string& value) {
+        uint16_t length;
+        if (!readValue(in, pos, length) || pos + length > in.size()) return false;
+        value.assign(in.data() + pos, length);
+        pos += length;
+        return true;
+    }
+
+    static uint32_t checksum(const char* data, size_t size) {
+        boost::crc_32_type crc;
+        crc.process_bytes(data, size);
+        return crc.checksum();
+    }
+
+    const string directory_;
+    const uint64_t segmentBytes_;
+    
+    mutable mutex mutex_;
+    condition_variable flushCV_;
+    condition_variable durableCV_;
+    map<uint64_t, shared_ptr<Segment>> segments_;
+    shared_ptr<Segment> active_;
+    uint64_t nextSegmentId_{1};
+    vector<PendingWrite> pendingWrites_;
+    size_t bufferedBytes_{0};
+    
+    static constexpr size_t MAX_FAILED_RANGES = 64;
+    
+    atomic<uint64_t> appendedSequence_{0};
+    atomic<uint64_t> durableSequence_{0};   // آخر حدث غطته مزامنة ناجحة
+    uint64_t flushedSequence_{0};           // آخر حدث حاول الخيط كتابته، نجح أم فشل
+    deque<pair<uint64_t, uint64_t>> failedRanges_;   // مديات تسلسل فشلت كتابتها
+    atomic<size_t> failedFlushes_{0};
+    atomic<bool> shutdownFlag_{false};
+    atomic<bool> writeFailed_{false};
+    future<void> flusher_;
+    
+    // الإحصائيات
+    atomic<size_t> appendedEvents_{0};
+    atomic<size_t> replayedEvents_{0};
+    atomic<size_t> removedSegments_{0};
+    atomic<size_t> quarantinedSegments_{0};
+    atomic<size_t> syncCount_{0};
+    atomic<size_t> segmentCount_{0};
+    atomic<uint64_t> segmentBytesTotal_{0};
+    atomic<size_t> pendingEvents_{0};
+    atomic<size_t> replayableSegments_{0};
+};
+
+// =============== خادم Webhook المشترك ===============
+
+// خادم HTTP واحد لكل البوتات: خيط epoll يقبل الاتصالات ويقرأ الطلبات ويكتب الردود،
+// ومجموعة ثابتة من العمال تنفذ معالجات المسارات. المسار يحدد البوت (/webhook/<key>)،
+// فعدد البوتات لا يؤثر على عدد الخيوط أو المقابس المستمعة.
+class WebhookServer : public IMonitorable, public IShutdownable {
+public:
+    // يعيد رمز حالة HTTP؛ أي رمز غير 200 يجعل تيليجرام يعيد إرسال التحديث لاحقاً
+    using Handler = function<int(const string& body)>;
+
+    explicit WebhookServer(uint16_t port = EnvironmentConfig::WEBHOOK_PORT,
+                           size_t workers = EnvironmentConfig::WEBHOOK_WORKERS)
+        : port_(port) {
+        listenFd_ = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (listenFd_ < 0) {
+            throw runtime_error("فشل في إنشاء مقبس خادم Webhook");
+        }
+        
+        int enable = 1;
+        setsockopt(listenFd_, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+        
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_ANY);
+        address.sin_port = htons(port_);
+        if (::bind(listenFd_, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0 ||
+            ::listen(listenFd_, SOMAXCONN) < 0) {
+            ::close(listenFd_);
+            throw runtime_error("فشل في الاستماع على منفذ Webhook " + to_string(port_));
+        }
+        
+        epollFd_ = ::epoll_create1(EPOLL_CLOEXEC);
+        wakeFd_ = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (epollFd_ < 0 || wakeFd_ < 0) {
+            closeDescriptors();
+            throw runtime_error("فشل في تهيئة epoll لخادم Webhook");
+        }
+        watch(listenFd_, EPOLLIN, EPOLL_CTL_ADD);
+        watch(wakeFd_, EPOLLIN, EPOLL_CTL_ADD);
+        
+        ioLoop_ = async(launch::async, [this] { ioLoop(); });
+        for (size_t i = 0; i < max<size_t>(1, workers); ++i) {
+            workers_.push_back(async(launch::async, [this] { workerLoop(); }));
+        }
+    }
+
+    ~WebhookServer() override {
+        shutdown();
+    }
+
+    WebhookServer(const WebhookServer&) = delete;
+    WebhookServer& operator=(const WebhookServer&) = delete;
+
+    void registerRoute(const string& path, Handler handler) {
+        unique_lock<shared_mutex> lock(routesMutex_);
+        routes_[path] = make_shared<Handler>(move(handler));
+        routeCount_ = routes_.size();
+    }
+
+    void unregisterRoute(const string& path) {
+        unique_lock<shared_mutex> lock(routesMutex_);
+        routes_.erase(path);
+        routeCount_ = routes_.size();
+    }
+
+    // "https://host/webhook" -> "/webhook"
+    static string urlPath(const string& url) {
+        size_t scheme = url.find("://");
+        size_t start = url.find('/', scheme == string::npos ? 0 : scheme + 3);
+        return start == string::npos ? "/" : url.substr(start);
+    }
+
+    // يعود عند إغلاق الخادم
+    void wait() {
+        if (ioLoop_.valid()) {
+            ioLoop_.wait();
+        }
+    }
+
+    void collectMetrics(MetricSink& sink) const override {
+        sink.gauge("webhook_routes", static_cast<double>(routeCount_));
+        sink.gauge("webhook_connections", static_cast<double>(openConnections_));
+        sink.gauge("webhook_requests", static_cast<double>(requests_));
+        sink.gauge("webhook_queued_requests", static_cast<double>(queuedJobs_));
+        sink.gauge("webhook_rejected_requests", static_cast<double>(rejected_));
+        sink.gauge("webhook_unknown_routes", static_cast<double>(unknownRoutes_));
+    }
+
+    bool isHealthy() const override {
+        return !shutdownFlag_;
+    }
+
+    string getStatus() const override {
+        return shutdownFlag_ ? "shutdown" : "listening:" + to_string(port_);
+    }
+
+    void shutdown() override {
+        if (shutdownFlag_.exchange(true)) return;
+        
+        wakeIoLoop();
+        {
+            lock_guard<mutex> lock(jobsMutex_);
+            jobsCV_.notify_all();
+        }
+        
+        for (auto& worker : workers_) {
+            if (worker.valid()) worker.wait();
+        }
+        if (ioLoop_.valid()) {
+            ioLoop_.wait();
+        }
+        closeDescriptors();
+    }
+
+    bool isShutdown() const override {
+        return shutdownFlag_;
+    }
+
+private:
+    // يملكها خيط epoll وحده؛ العمال يعرفون الاتصال بالرقم والجيل فقط
+    struct Connection {
+        int fd{-1};
+        uint64_t generation{0};
+        string input;
+        string output;
+        size_t outputPos{0};
+        bool busy{false};          // طلب عند العمال ولم يُكتب رده بعد
+        bool closeAfterWrite{false};
+        chrono::steady_clock::time_point lastActivity;
+    };
+
+    struct Job {
+        int fd;
+        uint64_t generation;
+        shared_ptr<Handler> handler;
+        string body;
+        bool keepAlive;
+    };
+
+    struct Completion {
+        int fd;
+        uint64_t generation;
+        int status;
+        bool keepAlive;
+    };
+
+    void ioLoop() {
+        array<epoll_event, 256> events;
+        auto nextSweep = chrono::steady_clock::now() + chrono::seconds(1);
+        
+        while (!shutdownFlag_) {
+            int ready = ::epoll_wait(epollFd_, events.data(), static_cast<int>(events.size()), 1000);
+            if (ready < 0 && errno != EINTR) {
+                cerr << "خطأ في epoll لخادم Webhook: " << strerror(errno) << endl;
+                break;
+            }
+            
+            for (int i = 0; i < ready; ++i) {
+                int fd = events[i].data.fd;
+                if (fd == listenFd_) {
+                    acceptConnections();
+                } else if (fd == wakeFd_) {
+                    uint64_t value;
+                    while (::read(wakeFd_, &value, sizeof(value)) > 0) {}
+                    writeCompletions();
+                } else {
+                    handleConnectionEvent(fd, events[i].events);
+                }
+            }
+            
+            auto now = chrono::steady_clock::now();
+            if (now >= nextSweep) {
+                closeIdleConnections(now);
+                nextSweep = now + chrono::seconds(1);
+            }
+        }
+        
+        for (auto& [fd, connection] : connections_) {
+            ::close(fd);
+        }
+        connections_.clear();
+        openConnections_ = 0;
+    }
+
+    void acceptConnections() {
+        for (;;) {
+            int fd = ::accept4(listenFd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) {
+                if (errno == EINTR) continue;
+                return;   // EAGAIN أو نفاد الواصفات؛ epoll يعيد المحاولة
+            }
+            
+            int enable = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+            
+            auto connection = make_unique<Connection>();
+            connection->fd = fd;
+            connection->generation = ++nextGeneration_;
+            connection->lastActivity = chrono::steady_clock::now();
+            connections_[fd] = move(connection);
+            openConnections_ = connections_.size();
+            watch(fd, EPOLLIN | EPOLLRDHUP, EPOLL_CTL_ADD);
+        }
+    }
+
+    void handleConnectionEvent(int fd, uint32_t events) {
+        auto it = connections_.find(fd);
+        if (it == connections_.end()) return;
+        Connection& connection = *it->second;
+        connection.lastActivity = chrono::steady_clock::now();
+        
+        if (events & (EPOLLERR | EPOLLHUP)) {
+            closeConnection(fd);
+            return;
+        }
+        if ((events & EPOLLOUT) && !flushOutput(connection)) {
+            return;
+        }
+        if (events & (EPOLLIN | EPOLLRDHUP)) {
+            readInput(connection);
+        }
+    }
+
+    void readInput(Connection& connection) {
+        char buffer[16384];
+        for (;;) {
+            ssize_t received = ::recv(connection.fd, buffer, sizeof(buffer), 0);
+            if (received > 0) {
+                connection.input.append(buffer, static_cast<size_t>(received));
+                if (connection.input.size() > EnvironmentConfig::WEBHOOK_MAX_REQUEST_BYTES + MAX_HEADER_BYTES) {
+                    respond(connection, 413, false);
+                    return;
+                }
+                continue;
+            }
+            if (received < 0 && errno == EINTR) continue;
+            if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+            
+            // أغلق الطرف الآخر الاتصال: الطلب الجاري عند العمال يُهمل رده
+            closeConnection(connection.fd);
+            return;
+        }
+        
+        processInput(connection);
+    }
+
+    // طلب واحد في كل مرة لكل اتصال؛ الطلب التالي يُحلل بعد كتابة رد الحالي
+    void processInput(Connection& connection) {
+        if (connection.busy || connection.outputPos < connection.output.size()) return;
+        
+        size_t headerEnd = connection.input.find("\r\n\r\n");
+        if (headerEnd == string::npos) {
+            if (connection.input.size() > MAX_HEADER_BYTES) respond(connection, 431, false);
+            return;
+        }
+        
+        string_view head(connection.input.data(), headerEnd);
+        size_t lineEnd = head.find("\r\n");
+        string_view requestLine = head.substr(0, lineEnd);
+        size_t methodEnd = requestLine.find(' ');
+        size_t pathEnd = methodEnd == string_view::npos ? string_view::npos : requestLine.find(' ', methodEnd + 1);
+        if (pathEnd == string_view::npos) {
+            respond(connection, 400, false);
+            return;
+        }
+        bool isPost = requestLine.substr(0, methodEnd) == "POST";
+        string path(requestLine.substr(methodEnd + 1, pathEnd - methodEnd - 1));
+        bool keepAlive = requestLine.substr(pathEnd + 1) != "HTTP/1.0";
+        
+        size_t contentLength = 0;
+        bool chunked = false;
+        string_view headers = lineEnd == string_view::npos ? string_view() : head.substr(lineEnd + 2);
+        while (!headers.empty()) {
+            size_t end = headers.find("\r\n");
+            string_view line = headers.substr(0, end);
+            headers = end == string_view::npos ? string_view() : headers.substr(end + 2);
+            
+            size_t colon = line.find(':');
+            if (colon == string_view::npos) continue;
+            string_view name = line.substr(0, colon);
+            string_view value = line.substr(colon + 1);
+            while (!value.empty() && value.front() == ' ') value.remove_prefix(1);
+            
+            if (equalsIgnoreCase(name, "Content-Length")) {
+                contentLength = strtoull(string(value).c_str(), nullptr, 10);
+            } else if (equalsIgnoreCase(name, "Transfer-Encoding")) {
+                chunked = true;
+            } else if (equalsIgnoreCase(name, "Connection")) {
+                if (equalsIgnoreCase(value, "close")) keepAlive = false;
+                if (equalsIgnoreCase(value, "keep-alive")) keepAlive = true;
+            }
+        }
+        
+        if (chunked) {
+            respond(connection, 411, false);
+            return;
+        }
+        if (contentLength > EnvironmentConfig::WEBHOOK_MAX_REQUEST_BYTES) {
+            respond(connection, 413, false);
+            return;
+        }
+        size_t requestBytes = headerEnd + 4 + contentLength;
+        if (connection.input.size() < requestBytes) return;
+        
+        // العروض أعلاه تشير إلى input فتُستخدم قبل حذف الطلب منه
+        string body = connection.input.substr(headerEnd + 4, contentLength);
+        connection.input.erase(0, requestBytes);
+        requests_++;
+        
+        if (!isPost) {
+            if (respond(connection, 405, keepAlive)) processInput(connection);
+            return;
+        }
+        
+        shared_ptr<Handler> handler;
+        {
+            shared_lock<shared_mutex> lock(routesMutex_);
+            auto it = routes_.find(path);
+            if (it != routes_.end()) handler = it->second;
+        }
+        if (!handler) {
+            unknownRoutes_++;
+            if (respond(connection, 404, keepAlive)) processInput(connection);
+            return;
+        }
+        
+        bool queued = false;
+        {
+            lock_guard<mutex> lock(jobsMutex_);
+            if (jobs_.size() < EnvironmentConfig::WEBHOOK_QUEUE_CAPACITY) {
+                jobs_.push_back({connection.fd, connection.generation, move(handler), move(body), keepAlive});
+                queuedJobs_ = jobs_.size();
+                queued = true;
+            }
+        }
+        if (!queued) {
+            rejected_++;
+            if (respond(connection, 503, keepAlive)) processInput(connection);
+            return;
+        }
+        jobsCV_.notify_one();
+        connection.busy = true;
+    }
+
+    void workerLoop() {
+        for (;;) {
+            Job job;
+            {
+                unique_lock<mutex> lock(jobsMutex_);
+                jobsCV_.wait(lock, [this] { return !jobs_.empty() || shutdownFlag_; });
+                if (jobs_.empty()) return;
+                job = move(jobs_.front());
+                jobs_.pop_front();
+                queuedJobs_ = jobs_.size();
+            }
+            
+            int status = 500;
+            try {
+                status = (*job.handler)(job.body);
+            } catch (const exception& e) {
+                cerr << "خطأ في معالج Webhook: " << e.what() << endl;
+            }
+            
+            {
+                lock_guard<mutex> lock(completionsMutex_);
+                completions_.push_back({job.fd, job.generation, status, job.keepAlive});
+            }
+            wakeIoLoop();
+        }
+    }
+
+    void writeCompletions() {
+        deque<Completion> completions;
+        {
+            lock_guard<mutex> lock(completionsMutex_);
+            completions.swap(completions_);
+        }
+        
+        for (const auto& completion : completions) {
+            auto it = connections_.find(completion.fd);
+            // الاتصال أُغلق وربما أُعيد استخدام رقمه لاتصال جديد
+            if (it == connections_.end() || it->second->generation != completion.generation) continue;
+            
+            Connection& connection = *it->second;
+            connection.busy = false;
+            if (!respond(connection, completion.status, completion.keepAlive)) continue;
+            // طلب تالٍ وصل أثناء المعالجة
+            processInput(connection);
+        }
+    }
+
+    // يعيد false إذا أُغلق الاتصال
+    bool respond(Connection& connection, int status, bool keepAlive) {
+        connection.output += "HTTP/1.1 " + to_string(status) + " " + reasonPhrase(status) + "\r\n"
+                             "Content-Length: 0\r\n"
+                             "Connection: " + (keepAlive ? "keep-alive" : "close") + "\r\n\r\n";
+        connection.closeAfterWrite = !keepAlive;
+        return flushOutput(connection);
+    }
+
+    bool flushOutput(Connection& connection) {
+        while (connection.outputPos < connection.output.size()) {
+            ssize_t sent = ::send(connection.fd, connection.output.data() + connection.outputPos,
+                                  connection.output.size() - connection.outputPos, MSG_NOSIGNAL);
+            if (sent < 0 && errno == EINTR) continue;
+            if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                watch(connection.fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP, EPOLL_CTL_MOD);
+                return true;
+            }
+            if (sent < 0) {
+                closeConnection(connection.fd);
+                return false;
+            }
+            connection.outputPos += static_cast<size_t>(sent);
+        }
+        
+        connection.output.clear();
+        connection.outputPos = 0;
+        if (connection.closeAfterWrite) {
+            closeConnection(connection.fd);
+            return false;
+        }
+        watch(connection.fd, EPOLLIN | EPOLLRDHUP, EPOLL_CTL_MOD);
+        return true;
+    }
+
+    void closeIdleConnections(chrono::steady_clock::time_point now) {
+        auto timeout = chrono::seconds(EnvironmentConfig::WEBHOOK_TIMEOUT_SECONDS);
+        vector<int> idle;
+        for (const auto& [fd, connection] : connections_) {
+            if (!connection->busy && now - connection->lastActivity > timeout) {
+                idle.push_back(fd);
+            }
+        }
+        for (int fd : idle) {
+            closeConnection(fd);
+        }
+    }
+
+    void closeConnection(int fd) {
+        ::epoll_ctl(epollFd_, EPOLL_CTL_DEL, fd, nullptr);
+        ::close(fd);
+        connections_.erase(fd);
+        openConnections_ = connections_.size();
+    }
+
+    void watch(int fd, uint32_t events, int operation) {
+        epoll_event event{};
+        event.events = events;
+        event.data.fd = fd;
+        ::epoll_ctl(epollFd_, operation, fd, &event);
+    }
+
+    void wakeIoLoop() {
+        uint64_t one = 1;
+        ssize_t ignored = ::write(wakeFd_, &one, sizeof(one));
+        (void)ignored;
+    }
+
+    void closeDescriptors() {
+        for (int* fd : {&listenFd_, &epollFd_, &wakeFd_}) {
+            if (*fd >= 0) {
+                ::close(*fd);
+                *fd = -1;
+            }
+        }
+    }
+
+    static bool equalsIgnoreCase(string_view a, string_view b) {
+        return a.size() == b.size() && equal(a.begin(), a.end(), b.begin(), [](char x, char y) {
+            return tolower(static_cast<unsigned char>(x)) == tolower(static_cast<unsigned char>(y));
+        });
+    }
+
+    static const char* reasonPhrase(int status) {
+        switch (status) {
+            case 200: return "OK";
+            case 400: return "Bad Request";
+            case 404: return "Not Found";
+            case 405: return "Method Not Allowed";
+            case 411: return "Length Required";
+            case 413: return "Payload Too Large";
+            case 429: return "Too Many Requests";
+            case 431: return "Request Header Fields Too Large";
+            case 503: return "Service Unavailable";
+            default: return "Internal Server Error";
+        }
+    }
+
+    static constexpr size_t MAX_HEADER_BYTES = 8192;
+
+    const uint16_t port_;
+    int listenFd_{-1};
+    int epollFd_{-1};
+    int wakeFd_{-1};
+    
+    // خاصة بخيط epoll
+    unordered_map<int, unique_ptr<Connection>> connections_;
+    uint64_t nextGeneration_{0};
+    
+    mutable shared_mutex routesMutex_;
+    unordered_map<string, shared_ptr<Handler>> routes_;
+    
+    mutable mutex jobsMutex_;
+    condition_variable jobsCV_;
+    deque<Job> jobs_;
+    mutex completionsMutex_;
+    deque<Completion> completions_;
+    
+    future<void> ioLoop_;
+    vector<future<void>> workers_;
+    atomic<bool> shutdownFlag_{false};
+    
+    // الإحصائيات
+    atomic<size_t> openConnections_{0};
+    atomic<size_t> routeCount_{0};
+    atomic<size_t> queuedJobs_{0};
+    atomic<size_t> requests_{0};
+    atomic<size_t> rejected_{0};
+    atomic<size_t> unknownRoutes_{0};
+};
+
+// =============== عميل Bot API المشترك ===============
+
+// عميل HTTP واحد لكل استدعاءات Bot API الصادرة (التحقق، Webhook، الإذاعة، بوت المدير).
+// CurlHttpClient في tgbot-cpp يرسل Connection: close، فكل getMe و sendMessage مصافحة TLS جديدة.
+// هنا تتشارك مقابض curl ذاكرة الاتصالات وجلسات TLS و DNS عبر CURLSH، فيُعاد استخدام الاتصال
+// المفتوح إلى الخادم، ويُطلب HTTP/2 عبر TLS حين يدعمه. الطلبات المتزامنة محدودة بـ maxConcurrency.
+class BotApiHttpClient : public HttpClient, public IConfigurable, public IMonitorable {
+public:
+    // كل كائنات Bot في العملية تستخدم هذه النسخة (انظر makeBot)
+    static BotApiHttpClient& shared() {
+        static BotApiHttpClient client;
+        return client;
+    }
+
+    explicit BotApiHttpClient(size_t maxConcurrency = EnvironmentConfig::BOT_API_MAX_CONCURRENCY)
+        : maxConcurrency_(max<size_t>(1, maxConcurrency)) {
+        share_ = curl_share_init();
+        if (!share_) {
+            throw runtime_error("فشل في تهيئة curl share");
+        }
+        curl_share_setopt(share_, CURLSHOPT_LOCKFUNC, &BotApiHttpClient::lockShare);
+        curl_share_setopt(share_, CURLSHOPT_UNLOCKFUNC, &BotApiHttpClient::unlockShare);
+        curl_share_setopt(share_, CURLSHOPT_USERDATA, this);
+        curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+        curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+        curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    }
+
+    ~BotApiHttpClient() override {
+        for (CURL* easy : idleHandles_) {
+            curl_easy_cleanup(easy);
+        }
+        curl_share_cleanup(share_);
+    }
+
+    BotApiHttpClient(const BotApiHttpClient&) = delete;
+    BotApiHttpClient& operator=(const BotApiHttpClient&) = delete;
+
+    // الرد يُعاد كما هو حتى مع رموز الخطأ؛ tgbot-cpp يقرأ ok و description من JSON
+    string makeRequest(const Url& url, const vector<HttpReqArg>& args) const override {
+        ConcurrencySlot slot(*this);
+        CURL* easy = acquireHandle();
+        string target = url.protocol + "://" + url.host + url.path;
+        if (args.empty() && !url.query.empty()) {
+            target += "?" + url.query;
+        }
+        
+        curl_mime* mime = nullptr;
+        if (!args.empty()) {
+            mime = curl_mime_init(easy);
+            for (const auto& arg : args) {
+                curl_mimepart* part = curl_mime_addpart(mime);
+                curl_mime_name(part, arg.name.c_str());
+                curl_mime_data(part, arg.value.data(), arg.value.size());
+                curl_mime_type(part, arg.mimeType.c_str());
+                if (arg.isFile) {
+                    curl_mime_filename(part, arg.fileName.c_str());
+                }
+            }
+            curl_easy_setopt(easy, CURLOPT_MIMEPOST, mime);
+        } else {
+            curl_easy_setopt(easy, CURLOPT_HTTPGET, 1L);
+        }
+        
+        string response;
+        curl_easy_setopt(easy, CURLOPT_URL, target.c_str());
+        curl_easy_setopt(easy, CURLOPT_WRITEDATA, &response);
+        
+        auto started = chrono::steady_clock::now();
+        CURLcode result = curl_easy_perform(easy);
+        latencies_.record(static_cast<uint64_t>(chrono::duration_cast<chrono::microseconds>(
+            chrono::steady_clock::now() - started).count()));
+        
+        // NUM_CONNECTS = 0: الطلب أُرسل على اتصال مفتوح من الذاكرة المشتركة
+        long newConnections = 0;
+        curl_easy_getinfo(easy, CURLINFO_NUM_CONNECTS, &newConnections);
+        curl_off_t handshake = 0;
+        curl_easy_getinfo(easy, CURLINFO_APPCONNECT_TIME_T, &handshake);
+        requests_.add();
+        if (newConnections > 0) {
+            connectionsOpened_.add(static_cast<size_t>(newConnections));
+        } else {
+            reusedConnections_.add();
+        }
+        if (handshake > 0) {
+            tlsHandshakes_.add();
+        }
+        
+        curl_easy_setopt(easy, CURLOPT_MIMEPOST, nullptr);
+        curl_mime_free(mime);
+        releaseHandle(easy);
+        
+        if (result != CURLE_OK) {
+            errors_.add();
+            throw runtime_error("خطأ في طلب Bot API: " + string(curl_easy_strerror(result)));
+        }
+        return response;
+    }
+
+    void configure(const map<string, string>& config) override {
+        if (config.count("max_concurrency")) {
+            lock_guard<mutex> lock(slotsMutex_);
+            maxConcurrency_ = max<size_t>(1, stoul(config.at("max_concurrency")));
+            slotsCV_.notify_all();
+        }
+    }
+
+    map<string, string> getConfiguration() const override {
+        return {{"max_concurrency", to_string(maxConcurrency_.load())}};
+    }
+
+    void collectMetrics(MetricSink& sink) const override {
+        sink.gauge("bot_api_requests", static_cast<double>(requests_.load()));
+        sink.gauge("bot_api_errors", static_cast<double>(errors_.load()));
+        sink.gauge("bot_api_connections_opened", static_cast<double>(connectionsOpened_.load()));
+        sink.gauge("bot_api_connections_reused", static_cast<double>(reusedConnections_.load()));
+        sink.gauge("bot_api_tls_handshakes", static_cast<double>(tlsHandshakes_.load()));
+        sink.gauge("bot_api_in_flight", static_cast<double>(inFlight_.load()));
+        sink.gauge("bot_api_max_concurrency", static_cast<double>(maxConcurrency_.load()));
+        sink.gauge("bot_api_concurrency_waits", static_cast<double>(concurrencyWaits_.load()));
+        
+        lock_guard<mutex> lock(scrapeMutex_);
+        scrapeLatencies_->clear();
+        latencies_.mergeInto(*scrapeLatencies_);
+        sink.gauge("bot_api_latency_ms_p50", scrapeLatencies_->percentile(50) / 1000.0);
+        sink.gauge("bot_api_latency_ms_p99", scrapeLatencies_->percentile(99) / 1000.0);
+    }
+
+    // أعطال تيليجرام تظهر في bot_api_errors ولا تجعل العملية غير صحية
+    bool isHealthy() const override {
+        return true;
+    }
+
+    string getStatus() const override {
+        return inFlight_ >= maxConcurrency_ ? "saturated" : "healthy";
+    }
+
+private:
+    // يحجز مكاناً ضمن maxConcurrency_ طوال الطلب
+    class ConcurrencySlot {
+    public:
+        explicit ConcurrencySlot(const BotApiHttpClient& client) : client_(client) {
+            unique_lock<mutex> lock(client_.slotsMutex_);
+            if (client_.inFlight_ >= client_.maxConcurrency_) {
+                client_.concurrencyWaits_++;
+                client_.slotsCV_.wait(lock, [this] { return client_.inFlight_ < client_.maxConcurrency_; });
+            }
+            client_.inFlight_++;
+        }
+
+        ~ConcurrencySlot() {
+            lock_guard<mutex> lock(client_.slotsMutex_);
+            client_.inFlight_--;
+            client_.slotsCV_.notify_one();
+        }
+
+    private:
+        const BotApiHttpClient& client_;
+    };
+
+    // المقابض تُعاد استخدامها؛ الخيارات الثابتة تُضبط مرة واحدة عند الإنشاء
+    CURL* acquireHandle() const {
+        {
+            lock_guard<mutex> lock(handlesMutex_);
+            if (!idleHandles_.empty()) {
+                CURL* easy = idleHandles_.back();
+                idleHandles_.pop_back();
+                return easy;
+            }
+        }
+        
+        CURL* easy = curl_easy_init();
+        if (!easy) {
+            throw runtime_error("فشل في تهيئة مقبض curl");
+        }
+        curl_easy_setopt(easy, CURLOPT_SHARE, share_);
+        curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, &BotApiHttpClient::appendResponse);
+        curl_easy_setopt(easy, CURLOPT_NOSIGNAL, 1L);
+        curl_easy_setopt(easy, CURLOPT_TCP_KEEPALIVE, 1L);
+        curl_easy_setopt(easy, CURLOPT_HTTP_VERSION, static_cast<long>(CURL_HTTP_VERSION_2TLS));
+        curl_easy_setopt(easy, CURLOPT_ACCEPT_ENCODING, "");
+        curl_easy_setopt(easy, CURLOPT_CONNECTTIMEOUT, 10L);
+        curl_easy_setopt(easy, CURLOPT_TIMEOUT, static_cast<long>(EnvironmentConfig::BOT_API_TIMEOUT_SECONDS));
+        return easy;
+    }
+
+    void releaseHandle(CURL* easy) const {
+        lock_guard<mutex> lock(handlesMutex_);
+        idleHandles_.push_back(easy);
+    }
+
+    static size_t appendResponse(char* data, size_t size, size_t count, void* userData) {
+        static_cast<string*>(userData)->append(data, size * count);
+        return size * count;
+    }
+
+    static void lockShare(CURL*, curl_lock_data data, curl_lock_access, void* userData) {
+        static_cast<BotApiHttpClient*>(userData)->shareLocks_[shareLockIndex(data)].lock();
+    }
+
+    static void unlockShare(CURL*, curl_lock_data data, void* userData) {
+        static_cast<BotApiHttpClient*>(userData)->shareLocks_[shareLockIndex(data)].unlock();
+    }
+
+    static size_t shareLockIndex(curl_lock_data data) {
+        return min<size_t>(static_cast<size_t>(data), SHARE_LOCKS - 1);
+    }
+
+    static constexpr size_t SHARE_LOCKS = CURL_LOCK_DATA_LAST;
+
+    CURLSH* share_{nullptr};
+    array<mutex, SHARE_LOCKS> shareLocks_;
+    
+    mutable mutex handlesMutex_;
+    mutable vector<CURL*> idleHandles_;
+    
+    mutable mutex slotsMutex_;
+    mutable condition_variable slotsCV_;
+    atomic<size_t> maxConcurrency_;
+    mutable atomic<size_t> inFlight_{0};
+    mutable atomic<size_t> concurrencyWaits_{0};
+    
+    // الإحصائيات
+    mutable StripedCounter requests_;
+    mutable StripedCounter errors_;
+    mutable StripedCounter connectionsOpened_;
+    mutable StripedCounter reusedConnections_;
+    mutable StripedCounter tlsHandshakes_;
+    mutable StripedHistogram latencies_;   // ميكروثانية لكل طلب
+    mutable mutex scrapeMutex_;
+    unique_ptr<Histogram> scrapeLatencies_{make_unique<Histogram>()};
+};
+
+// كل كائنات Bot في العملية تُنشأ هنا حتى يسري العنوان والعميل المشترك على التحقق والإذاعة وبوت المدير معاً
+inline unique_ptr<Bot> makeBot(const string& token) {
+    return make_unique<Bot>(token, BotApiHttpClient::shared(), telegramApiUrl());
+}
+
+// =============== الاستقبال بالسحب الطويل ===============
+
+// بديل Webhook للنشر خلف NAT: عدد صغير من العمال، يدير كل منهم طلبات getUpdates الطويلة
+// لعدة بوتات معاً عبر curl multi، فالبوت المنتظر لا يحجز خيطاً. الرد (حتى limit تحديث)
+// يُسلّم كاملاً للمعالج، والإزاحة التالية تُرسل مع الطلب التالي فيؤكد بها تيليجرام ما استُلم.
+// اتصالات curl multi تبقى مفتوحة بين الطلبات، فلا مصافحة TLS لكل دورة سحب.
+class LongPollIngestor : public IMonitorable, public IShutdownable {
+public:
+    struct BatchOutcome {
+        size_t updates{0};       // تحديثات قُبلت وتقدمت الإزاحة بعدها
+        bool complete{true};     // false: الطابور رفض تحديثاً، فيُعاد طلبه وما بعده لاحقاً
+        bool valid{true};        // false: الرد ليس JSON صالحاً من getUpdates
+    };
+    // يعالج رد getUpdates كاملاً ويقدّم offset إلى update_id + 1 لكل تحديث قُبل
+    using BatchHandler = function<BatchOutcome(string_view response, int64_t& offset)>;
+
+    LongPollIngestor(size_t workers = EnvironmentConfig::POLLING_WORKERS,
+                     int timeoutSeconds = EnvironmentConfig::POLLING_TIMEOUT_SECONDS,
+                     size_t limit = EnvironmentConfig::POLLING_LIMIT)
+        : timeoutSeconds_(max(0, timeoutSeconds)), limit_(clamp<size_t>(limit, 1, 100)) {
+        workers_.reserve(max<size_t>(1, workers));
+        for (size_t i = 0; i < max<size_t>(1, workers); ++i) {
+            auto worker = make_unique<Worker>();
+            worker->multi = curl_multi_init();
+            if (!worker->multi) {
+                throw runtime_error("فشل في تهيئة curl multi");
+            }
+            workers_.push_back(move(worker));
+        }
+        for (auto& worker : workers_) {
+            worker->thread = async(launch::async, [this, &worker = *worker]() { runWorker(worker); });
+        }
+    }
+
+    ~LongPollIngestor() override {
+        shutdown();
+        for (auto& worker : workers_) {
+            curl_multi_cleanup(worker->multi);
+        }
+    }
+
+    // messagesOnly يطلب من تيليجرام الرسائل فقط (allowed_updates)؛ بوت المدير يحتاج الاستعلامات أيضاً
+    void addBot(int64_t botKey, const string& token, int64_t offset, BatchHandler handler, bool messagesOnly = true) {
+        auto poll = make_shared<Poll>();
+        poll->key = botKey;
+        poll->url = telegramApiUrl() + "/bot" + token + "/getUpdates?limit=" + to_string(limit_) +
+                    "&timeout=" + to_string(timeoutSeconds_) +
+                    (messagesOnly ? "&allowed_updates=%5B%22message%22%5D" : "");
+        poll->offset = offset;
+        poll->handler = move(handler);
+        
+        Worker& worker = workerFor(botKey);
+        {
+            lock_guard<mutex> lock(worker.changesMutex);
+            worker.changes.emplace_back(botKey, move(poll));
+        }
+        curl_multi_wakeup(worker.multi);
+    }
+
+    // الطلب الجاري يُلغى؛ التحديثات التي لم تُؤكد يعيدها تيليجرام لمن يسحب بعدها
+    void removeBot(int64_t botKey) {
+        Worker& worker = workerFor(botKey);
+        {
+            lock_guard<mutex> lock(worker.changesMutex);
+            worker.changes.emplace_back(botKey, nullptr);
+        }
+        curl_multi_wakeup(worker.multi);
+    }
+
+    // الإزاحات التي تغيرت منذ آخر استدعاء، لحفظها في جدول Bots
+    vector<pair<int64_t, int64_t>> takeChangedOffsets() {
+        lock_guard<mutex> lock(offsetsMutex_);
+        vector<pair<int64_t, int64_t>> changed(changedOffsets_.begin(), changedOffsets_.end());
+        changedOffsets_.clear();
+        return changed;
+    }
+
+    // إزاحة فشل حفظها تعود لتُحفظ في المرة التالية، ما لم يسبقها عامل السحب بإزاحة أحدث
+    void restoreOffset(int64_t botKey, int64_t offset) {
+        lock_guard<mutex> lock(offsetsMutex_);
+        auto [it, inserted] = changedOffsets_.try_emplace(botKey, offset);
+        if (!inserted) {
+            it->second = max(it->second, offset);
+        }
+    }
+
+    void collectMetrics(MetricSink& sink) const override {
+        sink.gauge("polling_workers", static_cast<double>(workers_.size()));
+        sink.gauge("polling_bots", static_cast<double>(pollingBots_));
+        sink.gauge("polling_requests", static_cast<double>(requests_));
+        sink.gauge("polling_empty_responses", static_cast<double>(emptyResponses_));
+        sink.gauge("polling_updates", static_cast<double>(updates_));
+        sink.gauge("polling_errors", static_cast<double>(errors_));
+        sink.gauge("polling_backpressure", static_cast<double>(backpressure_));
+        double nonEmpty = static_cast<double>(requests_) - static_cast<double>(emptyResponses_) - static_cast<double>(errors_);
+        sink.gauge("polling_updates_per_response", nonEmpty > 0 ? static_cast<double>(updates_) / nonEmpty : 0.0);
+    }
+
+    bool isHealthy() const override {
+        return !shutdownFlag_;
+    }
+
+    string getStatus() const override {
+        return shutdownFlag_ ? "shutdown" : "running";
+    }
+
+    void shutdown() override {
+        if (shutdownFlag_.exchange(true)) return;
+        for (auto& worker : workers_) {
+            curl_multi_wakeup(worker->multi);
+        }
+        for (auto& worker : workers_) {
+            if (worker->thread.valid()) {
+                worker->thread.wait();
+            }
+        }
+    }
+
+    bool isShutdown() const override {
+        return shutdownFlag_;
+    }
+
+private:
+    // حالة بوت واحد؛ يلمسها خيط عامله فقط بعد إضافتها
+    struct Poll {
+        int64_t key{0};
+        string url;              // بدون offset
+        int64_t offset{0};
+        BatchHandler handler;
+        CURL* easy{nullptr};
+        bool inFlight{false};
+        string response;
+        int failures{0};
+        chrono::steady_clock::time_point notBefore;
+    };
+
+    struct Worker {
+        CURLM* multi{nullptr};
+        mutex changesMutex;
+        vector<pair<int64_t, shared_ptr<Poll>>> changes;   // nullptr = إزالة
+        map<int64_t, shared_ptr<Poll>> polls;
+        future<void> thread;
+    };
+
+    Worker& workerFor(int64_t botKey) {
+        return *workers_[static_cast<uint64_t>(botKey) % workers_.size()];
+    }
+
+    void runWorker(Worker& worker) {
+        while (!shutdownFlag_) {
+            applyChanges(worker);
+            
+            auto now = chrono::steady_clock::now();
+            auto wait = chrono::milliseconds(1000);
+            for (auto& [key, poll] : worker.polls) {
+                if (poll->inFlight) continue;
+                if (poll->notBefore > now) {
+                    wait = min(wait, chrono::duration_cast<chrono::milliseconds>(poll->notBefore - now) +
+                                     chrono::milliseconds(1));
+                    continue;
+                }
+                startRequest(worker, *poll);
+            }
+            
+            int running = 0;
+            curl_multi_perform(worker.multi, &running);
+            int pending = 0;
+            while (CURLMsg* message = curl_multi_info_read(worker.multi, &pending)) {
+                if (message->msg != CURLMSG_DONE) continue;
+                Poll* poll = nullptr;
+                curl_easy_getinfo(message->easy_handle, CURLINFO_PRIVATE, &poll);
+                finishRequest(worker, *poll, message->data.result);
+            }
+            
+            curl_multi_poll(worker.multi, nullptr, 0, static_cast<int>(wait.count()), nullptr);
+        }
+        
+        for (auto& [key, poll] : worker.polls) {
+            releaseHandle(worker, *poll);
+        }
+        worker.polls.clear();
+    }
+
+    void applyChanges(Worker& worker) {
+        vector<pair<int64_t, shared_ptr<Poll>>> changes;
+        {
+            lock_guard<mutex> lock(worker.changesMutex);
+            changes.swap(worker.changes);
+        }
+        
+        // بالترتيب: إيقاف ثم تشغيل سريع لنفس البوت ينتهي بالبوت مُضافاً
+        for (auto& [key, poll] : changes) {
+            auto it = worker.polls.find(key);
+            if (it != worker.polls.end()) {
+                releaseHandle(worker, *it->second);
+                worker.polls.erase(it);
+                pollingBots_--;
+            }
+            if (poll) {
+                worker.polls.emplace(key, move(poll));
+                pollingBots_++;
+            }
+        }
+    }
+
+    void startRequest(Worker& worker, Poll& poll) {
+        if (!poll.easy) {
+            poll.easy = curl_easy_init();
+            if (!poll.easy) {
+                poll.notBefore = chrono::steady_clock::now() + chrono::seconds(1);
+                return;
+            }
+            curl_easy_setopt(poll.easy, CURLOPT_WRITEFUNCTION, &LongPollIngestor::appendResponse);
+            curl_easy_setopt(poll.easy, CURLOPT_PRIVATE, &poll);
+            curl_easy_setopt(poll.easy, CURLOPT_NOSIGNAL, 1L);
+            curl_easy_setopt(poll.easy, CURLOPT_CONNECTTIMEOUT, 10L);
+            curl_easy_setopt(poll.easy, CURLOPT_TIMEOUT, static_cast<long>(timeoutSeconds_ + 15));
+            curl_easy_setopt(poll.easy, CURLOPT_TCP_KEEPALIVE, 1L);
+            curl_easy_setopt(poll.easy, CURLOPT_ACCEPT_ENCODING, "");   // ردود 100 تحديث تُضغط جيداً
+        }
+        
+        string url = poll.url + "&offset=" + to_string(poll.offset);
+        poll.response.clear();
+        curl_easy_setopt(poll.easy, CURLOPT_URL, url.c_str());   // curl ينسخ النص
+        curl_easy_setopt(poll.easy, CURLOPT_WRITEDATA, &poll.response);
+        if (curl_multi_add_handle(worker.multi, poll.easy) != CURLM_OK) {
+            poll.notBefore = chrono::steady_clock::now() + chrono::seconds(1);
+            return;
+        }
+        poll.inFlight = true;
+    }
+
+    void finishRequest(Worker& worker, Poll& poll, CURLcode result) {
+        curl_multi_remove_handle(worker.multi, poll.easy);
+        poll.inFlight = false;
+        requests_++;
+        
+        long status = 0;
+        curl_easy_getinfo(poll.easy, CURLINFO_RESPONSE_CODE, &status);
+        if (result != CURLE_OK || status != 200) {
+            errors_++;
+            // 409: Webhook ما زال مسجلاً أو نسخة أخرى تسحب التوكن نفسه
+            if (poll.failures == 0) {
+                cerr << "تحذير: فشل getUpdates للبوت " << poll.key << ": "
+                     << (result != CURLE_OK ? curl_easy_strerror(result) : "HTTP " + to_string(status)) << endl;
+            }
+            backOff(poll);
+            return;
+        }
+        
+        int64_t offset = poll.offset;
+        BatchOutcome outcome;
+        try {
+            outcome = poll.handler(poll.response, offset);
+        } catch (const exception& e) {
+            cerr << "خطأ في معالجة تحديثات البوت " << poll.key << ": " << e.what() << endl;
+            outcome.valid = false;
+        }
+        poll.response.clear();
+        
+        if (!outcome.valid) {
+            errors_++;
+            backOff(poll);
+            return;
+        }
+        poll.failures = 0;
+        updates_ += outcome.updates;
+        if (outcome.updates == 0 && outcome.complete) emptyResponses_++;
+        
+        if (offset != poll.offset) {
+            poll.offset = offset;
+            lock_guard<mutex> lock(offsetsMutex_);
+            changedOffsets_[poll.key] = offset;
+        }
+        if (!outcome.complete) {
+            // الطابور ممتلئ: ما لم يُقبل يبقى عند تيليجرام حتى تخف المعالجة
+            backpressure_++;
+            poll.notBefore = chrono::steady_clock::now() + chrono::seconds(1);
+        }
+    }
+
+    static void backOff(Poll& poll) {
+        poll.failures++;
+        auto delay = chrono::seconds(min(EnvironmentConfig::POLLING_MAX_BACKOFF_SECONDS, 1 << min(poll.failures, 6)));
+        poll.notBefore = chrono::steady_clock::now() + delay;
+    }
+
+    static void releaseHandle(Worker& worker, Poll& poll) {
+        if (!poll.easy) return;
+        if (poll.inFlight) {
+            curl_multi_remove_handle(worker.multi, poll.easy);
+            poll.inFlight = false;
+        }
+        curl_easy_cleanup(poll.easy);
+        poll.easy = nullptr;
+    }
+
+    static size_t appendResponse(char* data, size_t size, size_t count, void* userData) {
+        auto* response = static_cast<string*>(userData);
+        if (response->size() + size * count > EnvironmentConfig::POLLING_MAX_RESPONSE_BYTES) {
+            return 0;   // يوقف النقل؛ يُعامل كخطأ
+        }
+        response->append(data, size * count);
+        return size * count;
+    }
+
+    const int timeoutSeconds_;
+    const size_t limit_;
+    vector<unique_ptr<Worker>> workers_;
+    atomic<bool> shutdownFlag_{false};
+    
+    mutex offsetsMutex_;
+    map<int64_t, int64_t> changedOffsets_;
+    
+    // الإحصائيات
+    atomic<size_t> pollingBots_{0};
+    atomic<size_t> requests_{0};
+    atomic<size_t> emptyResponses_{0};
+    atomic<size_t> updates_{0};
+    atomic<size_t> errors_{0};
+    atomic<size_t> backpressure_{0};
+};
+
+// =============== خادم المقاييس ===============
+
+// يكتب المقاييس بصيغة Prometheus النصية. الصيغة تشترط أن تتجاور عينات المقياس الواحد تحت
+// سطري HELP و TYPE واحدين، والمكوّنات تكتب المقياس نفسه (up مثلاً)، فتُجمع العينات أولاً ثم
+// تُرتب بالاسم في finish. العينات والمخزن يُعاد استخدامهما بين الطلبات، فلا يُخصص شيء بعد أن
+// يبلغا حجم أكبر رد
+class PrometheusWriter : public MetricSink {
+public:
+    static constexpr string_view PREFIX = "storage_bot_";
+
+    struct Sample {
+        string name;
+        string labels;
+        double value{0.0};
+    };
+
+    struct Scratch {
+        vector<Sample> samples;
+        vector<uint32_t> order;
+    };
+
+    PrometheusWriter(string& buffer, Scratch& scratch) : buffer_(buffer), scratch_(scratch) {}
+
+    void setComponent(string_view component) {
+        component_ = component;
+    }
+
+    void gauge(string_view name, double value) override {
+        Sample& sample = nextSample(name, value);
+        sample.labels += "{component=\"";
+        sample.labels += component_;
+        sample.labels += "\"}";
+    }
+
+    void botGauge(string_view name, int64_t botId, string_view username, double value) override {
+        Sample& sample = nextSample(name, value);
+        sample.labels += "{bot_id=\"";
+        appendInteger(sample.labels, botId);
+        sample.labels += "\",username=\"";
+        for (char c : username) {
+            if (c == '"' || c == '\\') sample.labels += '\\';
+            sample.labels += c == '\n' ? ' ' : c;
+        }
+        sample.labels += "\"}";
+    }
+
+    // كل المقاييس gauge: تُقرأ من عدادات المكوّنات كما هي عند الطلب
+    void finish() {
+        auto& order = scratch_.order;
+        order.resize(count_);
+        for (uint32_t i = 0; i < count_; ++i) order[i] = i;
+        // الترتيب بالفهرس عند تساوي الاسم يحفظ ترتيب المكوّنات دون مخزن stable_sort
+        sort(order.begin(), order.end(), [this](uint32_t a, uint32_t b) {
+            int byName = scratch_.samples[a].name.compare(scratch_.samples[b].name);
+            return byName != 0 ? byName < 0 : a < b;
+        });
+        
+        string_view family;
+        for (uint32_t index : order) {
+            const Sample& sample = scratch_.samples[index];
+            if (sample.name != family) {
+                family = sample.name;
+                buffer_ += "# HELP ";
+                buffer_ += family;
+                buffer_ += ' ';
+                for (char c : family.substr(PREFIX.size())) {
+                    buffer_ += c == '_' ? ' ' : c;
+                }
+                buffer_ += "\n# TYPE ";
+                buffer_ += family;
+                buffer_ += " gauge\n";
+            }
+            buffer_ += sample.name;
+            buffer_ += sample.labels;
+            buffer_ += ' ';
+            appendValue(sample.value);
+        }
+        count_ = 0;
+    }
+
+private:
+    Sample& nextSample(string_view name, double value) {
+        if (count_ == scratch_.samples.size()) {
+            scratch_.samples.emplace_back();
+        }
+        Sample& sample = scratch_.samples[count_++];
+        sample.name.assign(PREFIX);
+        for (char c : name) {
+            sample.name += isalnum(static_cast<unsigned char>(c)) || c == '_' ? c : '_';
+        }
+        sample.labels.clear();
+        sample.value = value;
+        return sample;
+    }
+
+    static void appendInteger(string& out, int64_t value) {
+        char digits[24];
+        auto [end, ec] = to_chars(digits, digits + sizeof(digits), value);
+        out.append(digits, end);
+    }
+
+    void appendValue(double value) {
+        if (isnan(value)) {
+            buffer_ += "NaN";
+        } else if (isinf(value)) {
+            buffer_ += value > 0 ? "+Inf" : "-Inf";
+        } else {
+            char digits[32];
+            auto [end, ec] = to_chars(digits, digits + sizeof(digits), value);
+            buffer_.append(digits, end);
+        }
+        buffer_ += '\n';
+    }
+
+    string& buffer_;
+    Scratch& scratch_;
+    size_t count_{0};
+    string_view component_;
+};
+
+// خادم HTTP صغير على منفذ منفصل عن Webhook: طلبات المراقبة لا تنافس تحديثات تيليجرام على العمال.
+// /metrics بصيغة Prometheus، و/health و/status لـ nginx وفحوصات الحاويات.
+// بضعة عمال يقبلون من المقبس نفسه، ولكل عامل مخازنه؛ عميل بطيء يحجز عاملاً واحداً حتى مهلة IO
+// ولا يؤخر فحوصات الصحة.
+class MetricsServer : public IShutdownable {
+public:
+    struct Component {
+        string name;
+        const IMonitorable* monitor;   // يجب أن يعيش حتى shutdown()
+    };
+
+    MetricsServer(uint16_t port, vector<Component> components)
+        : port_(port), components_(move(components)) {
+        // غير حاجب: العمال يستيقظون معاً على اتصال واحد، ومن لم يقبله يعود إلى poll
+        listenFd_ = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+        if (listenFd_ < 0) {
+            throw runtime_error("فشل في إنشاء مقبس خادم المقاييس");
+        }
+        
+        int enable = 1;
+        setsockopt(listenFd_, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+        
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_ANY);
+        address.sin_port = htons(port_);
+        if (::bind(listenFd_, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0 ||
+            ::listen(listenFd_, 16) < 0) {
+            ::close(listenFd_);
+            throw runtime_error("فشل في الاستماع على منفذ المقاييس " + to_string(port_));
+        }
+        
+        for (size_t i = 0; i < WORKERS; ++i) {
+            auto worker = make_unique<Worker>();
+            worker->body.reserve(INITIAL_BODY_BYTES);
+            worker->thread = async(launch::async, [this, &state = *worker] { serveLoop(state); });
+            workers_.push_back(move(worker));
+        }
+    }
+
+    ~MetricsServer() override {
+        shutdown();
+    }
+
+    MetricsServer(const MetricsServer&) = delete;
+    MetricsServer& operator=(const MetricsServer&) = delete;
+
+    void shutdown() override {
+        if (shutdownFlag_.exchange(true)) return;
+        for (auto& worker : workers_) {
+            if (worker->thread.valid()) {
+                worker->thread.wait();
+            }
+        }
+        ::close(listenFd_);
+    }
+
+    bool isShutdown() const override {
+        return shutdownFlag_;
+    }
+
+private:
+    static constexpr size_t WORKERS = 4;
+    static constexpr size_t INITIAL_BODY_BYTES = 256 * 1024;
+    static constexpr int POLL_INTERVAL_MS = 500;
+    static constexpr int IO_TIMEOUT_SECONDS = 2;
+
+    struct Worker {
+        array<char, 4096> request{};
+        string body;
+        PrometheusWriter::Scratch scratch;
+        future<void> thread;
+    };
+
+    void serveLoop(Worker& worker) {
+        while (!shutdownFlag_) {
+            pollfd listener{listenFd_, POLLIN, 0};
+            if (::poll(&listener, 1, POLL_INTERVAL_MS) <= 0) continue;
+            
+            int fd = ::accept4(listenFd_, nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd < 0) continue;   // EAGAIN: قبله عامل آخر
+            
+            timeval timeout{IO_TIMEOUT_SECONDS, 0};
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+            try {
+                handleConnection(worker, fd);
+            } catch (const exception& e) {
+                cerr << "خطأ في خادم المقاييس: " << e.what() << endl;
+            }
+            ::close(fd);
+        }
+    }
+
+    void handleConnection(Worker& worker, int fd) {
+        size_t received = 0;
+        string_view request;
+        while (received < worker.request.size()) {
+            ssize_t n = ::recv(fd, worker.request.data() + received, worker.request.size() - received, 0);
+            if (n <= 0) return;
+            received += static_cast<size_t>(n);
+            request = string_view(worker.request.data(), received);
+            if (request.find("\r\n\r\n") != string_view::npos) break;
+        }
+        
+        // "GET /metrics HTTP/1.1"
+        size_t methodEnd = request.find(' ');
+        size_t pathEnd = methodEnd == string_view::npos ? methodEnd : request.find_first_of(" ?", methodEnd + 1);
+        if (pathEnd == string_view::npos) {
+            respond(fd, 400, "text/plain", "bad request\n");
+            return;
+        }
+        string_view method = request.substr(0, methodEnd);
+        string_view path = request.substr(methodEnd + 1, pathEnd - methodEnd - 1);
+        if (method != "GET" && method != "HEAD") {
+            respond(fd, 405, "text/plain", "method not allowed\n");
+            return;
+        }
+        
+        string& body = worker.body;
+        body.clear();
+        int status = 200;
+        if (path == "/metrics") {
+            renderMetrics(worker);
+        } else if (path == "/health") {
+            status = renderHealth(body) ? 200 : 503;
+        } else if (path == "/status") {
+            renderStatus(body);
+        } else {
+            respond(fd, 404, "text/plain", "not found\n");
+            return;
+        }
+        respond(fd, status, path == "/metrics" ? "text/plain; version=0.0.4" : "text/plain",
+                method == "HEAD" ? string_view() : string_view(body), body.size());
+    }
+
+    void renderMetrics(Worker& worker) {
+        PrometheusWriter writer(worker.body, worker.scratch);
+        for (const auto& component : components_) {
+            writer.setComponent(component.name);
+            writer.gauge("up", component.monitor->isHealthy() ? 1.0 : 0.0);
+            component.monitor->collectMetrics(writer);
+        }
+        writer.finish();
+    }
+
+    bool renderHealth(string& body) {
+        bool healthy = true;
+        for (const auto& component : components_) {
+            if (component.monitor->isHealthy()) continue;
+            healthy = false;
+            body += "unhealthy: ";
+            body += component.name;
+            body += '\n';
+        }
+        if (healthy) {
+            body += "healthy\n";
+        }
+        return healthy;
+    }
+
+    void renderStatus(string& body) {
+        for (const auto& component : components_) {
+            body += component.name;
+            body += ": ";
+            body += component.monitor->getStatus();
+            body += '\n';
+        }
+    }
+
+    // contentLength منفصل حتى يرد HEAD بطول GET نفسه دون جسم
+    void respond(int fd, int status, string_view contentType, string_view body,
+                 optional<size_t> contentLength = nullopt) {
+        const char* reason = status == 200 ? "OK" : status == 400 ? "Bad Request" : status == 404 ? "Not Found"
+                           : status == 405 ? "Method Not Allowed" : "Service Unavailable";
+        char header[256];
+        int headerLength = snprintf(header, sizeof(header),
+            "HTTP/1.1 %d %s\r\nContent-Type: %.*s\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n",
+            status, reason, static_cast<int>(contentType.size()), contentType.data(),
+            contentLength.value_or(body.size()));
+        if (sendAll(fd, header, static_cast<size_t>(headerLength))) {
+            sendAll(fd, body.data(), body.size());
+        }
+    }
+
+    static bool sendAll(int fd, const char* data, size_t size) {
+        while (size > 0) {
+            ssize_t sent = ::send(fd, data, size, MSG_NOSIGNAL);
+            if (sent < 0) {
+                if (errno == EINTR) continue;
+                return false;
+            }
+            data += sent;
+            size -= static_cast<size_t>(sent);
+        }
+        return true;
+    }
+
+    const uint16_t port_;
+    const vector<Component> components_;
+    int listenFd_{-1};
+    vector<unique_ptr<Worker>> workers_;
+    atomic<bool> shutdownFlag_{false};
+};
+
+// =============== التحليل السريع للتحديثات ===============
+
+// مرسل الرسالة كما ورد في جسم الطلب؛ username يشير إلى الجسم نفسه
+struct UpdateSender {
+    int64_t userId{0};
+    string_view username;
+};
+
+// يمسح JSON التحديث في مكانه ويستخرج message.from.id و message.from.username فقط،
+// دون بناء كائنات tgbot-cpp. أي بنية غير متوقعة تُعاد كـ Unsupported ليتولاها المحلل الكامل.
+class UpdateScanner {
+public:
+    enum class Result {
+        Sender,        // رسالة لها مرسل
+        NoSender,      // تحديث بلا رسالة (تعديل، استعلام...) أو رسالة بلا from
+        Unsupported    // JSON غير صالح أو اسم مستخدم بمحارف مهربة
+    };
+
+    static Result scanSender(string_view json, UpdateSender& sender) {
+        UpdateScanner scanner(json);
+        bool found = false;
+        bool ok = scanner.scanObject([&](string_view key) {
+            if (key != "message") return scanner.skipValue();
+            return scanner.scanObject([&](string_view messageKey) {
+                if (messageKey != "from") return scanner.skipValue();
+                found = true;
+                return scanner.scanUser(sender);
+            });
+        });
+        
+        if (!ok) return Result::Unsupported;
+        scanner.skipWhitespace();
+        if (scanner.pos_ != json.size()) return Result::Unsupported;
+        return found ? Result::Sender : Result::NoSender;
+    }
+
+    // رد getUpdates: {"ok":true,"result":[...]}. يستدعي onUpdate(جسم التحديث، update_id) لكل عنصر
+    // بالترتيب، والجسم شريحة من الرد نفسه دون نسخ. false إذا لم يكن الرد ناجحاً وصالحاً
+    template <typename OnUpdate>
+    static bool scanUpdates(string_view json, OnUpdate&& onUpdate) {
+        UpdateScanner scanner(json);
+        bool succeeded = false;
+        bool hasResult = false;
+        bool ok = scanner.scanObject([&](string_view key) {
+            if (key == "ok") {
+                succeeded = scanner.json_.substr(scanner.pos_, 4) == "true";
+                return scanner.skipValue();
+            }
+            if (key != "result") return scanner.skipValue();
+            hasResult = true;
+            return scanner.scanArray([&]() {
+                size_t start = scanner.pos_;
+                int64_t updateId = -1;
+                bool parsed = scanner.scanObject([&](string_view field) {
+                    if (field == "update_id") return scanner.readInteger(updateId);
+                    return scanner.skipValue();
+                });
+                if (!parsed || updateId < 0) return false;
+                onUpdate(json.substr(start, scanner.pos_ - start), updateId);
+                return true;
+            });
+        });
+        return ok && succeeded && hasResult;
+    }
+
+private:
+    explicit UpdateScanner(string_view json) : json_(json) {}
+
+    bool scanUser(UpdateSender& sender) {
+        bool hasId = false;
+        bool ok = scanObject([&](string_view key) {
+            if (key == "id") {
+                hasId = readInteger(sender.userId);
+                return hasId;
+            }
+            if (key == "username") {
+                // أسماء تيليجرام [A-Za-z0-9_] فلا تحتاج فك تهريب عملياً
+                bool escaped = false;
+                return readString(sender.username, escaped) && !escaped;
+            }
+            return skipValue();
+        });
+        return ok && hasId;
+    }
+
+    // يستدعي onMember لكل مفتاح بعد ':'؛ onMember يستهلك القيمة
+    template <typename OnMember>
+    bool scanObject(OnMember&& onMember) {
+        skipWhitespace();
+        if (!consume('{')) return false;
+        skipWhitespace();
+        if (consume('}')) return true;
+        
+        for (;;) {
+            string_view key;
+            bool escaped = false;
+            skipWhitespace();
+            if (!readString(key, escaped)) return false;
+            skipWhitespace();
+            if (!consume(':')) return false;
+            skipWhitespace();
+            if (!onMember(escaped ? string_view() : key)) return false;
+            skipWhitespace();
+            if (consume(',')) continue;
+            return consume('}');
+        }
+    }
+
+    template <typename OnElement>
+    bool scanArray(OnElement&& onElement) {
+        skipWhitespace();
+        if (!consume('[')) return false;
+        skipWhitespace();
+        if (consume(']')) return true;
+        
+        for (;;) {
+            skipWhitespace();
+            if (!onElement()) return false;
+            skipWhitespace();
+            if (consume(',')) continue;
+            return consume(']');
+        }
+    }
+
+    bool readString(string_view& out, bool& escaped) {
+        if (!consume('"')) return false;
+        size_t start = pos_;
+        escaped = false;
+        
+        for (;;) {
+            if (pos_ >= json_.size()) return false;
+            pos_ += findQuoteOrBackslash(json_.data() + pos_, json_.size() - pos_);
+            if (pos_ >= json_.size()) return false;
+            if (json_[pos_] == '"') break;
+            escaped = true;
+            pos_ += 2;   // المحرف المهرب لا ينهي النص
+        }
+        
+        out = json_.substr(start, pos_ - start);
+        ++pos_;
+        return true;
+    }
+
+    bool readInteger(int64_t& value) {
+        const char* begin = json_.data() + pos_;
+        auto [end, error] = from_chars(begin, json_.data() + json_.size(), value);
+        if (error != errc()) return false;
+        pos_ += static_cast<size_t>(end - begin);
+        return true;
+    }
+
+    bool skipValue() {
+        if (pos_ >= json_.size()) return false;
+        
+        char first = json_[pos_];
+        if (first == '"') {
+            string_view ignored;
+            bool escaped;
+            return readString(ignored, escaped);
+        }
+        if (first != '{' && first != '[') {
+            // رقم أو true/false/null
+            while (pos_ < json_.size() && !isDelimiter(json_[pos_])) ++pos_;
+            return true;
+        }
+        
+        // الكائنات والمصفوفات المتداخلة تُتخطى بعدّ الأقواس خارج النصوص
+        int depth = 0;
+        for (;;) {
+            pos_ += findStructural(json_.data() + pos_, json_.size() - pos_);
+            if (pos_ >= json_.size()) return false;
+            
+            char c = json_[pos_];
+            if (c == '"') {
+                string_view ignored;
+                bool escaped;
+                if (!readString(ignored, escaped)) return false;
+                continue;
+            }
+            ++pos_;
+            depth += (c == '{' || c == '[') ? 1 : -1;
+            if (depth == 0) return true;
+        }
+    }
+
+    void skipWhitespace() {
+        while (pos_ < json_.size() && (json_[pos_] == ' ' || json_[pos_] == '\n' ||
+                                       json_[pos_] == '\r' || json_[pos_] == '\t')) {
+            ++pos_;
+        }
+    }
+
+    bool consume(char c) {
+        if (pos_ < json_.size() && json_[pos_] == c) {
+            ++pos_;
+            return true;
+        }
+        return false;
+    }
+
+    static bool isDelimiter(char c) {
+        return c == ',' || c == '}' || c == ']' || c == ' ' || c == '\n' || c == '\r' || c == '\t';
+    }
+
+    // البحث عن '"' أو '\\': 16 بايت في كل مقارنة مع SSE2
+    static size_t findQuoteOrBackslash(const char* data, size_t size) {
+        size_t i = 0;
+#ifdef __SSE2__
+        const __m128i quote = _mm_set1_epi8('"');
+        const __m128i backslash = _mm_set1_epi8('\\');
+        for (; i + 16 <= size; i += 16) {
+            __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+            auto mask = static_cast<unsigned>(_mm_movemask_epi8(
+                _mm_or_si128(_mm_cmpeq_epi8(chunk, quote), _mm_cmpeq_epi8(chunk, backslash))));
+            if (mask) return i + countr_zero(mask);
+        }
+#endif
+        for (; i < size; ++i) {
+            if (data[i] == '"' || data[i] == '\\') return i;
+        }
+        return size;
+    }
+
+    // البحث عن بداية نص أو قوس فتح/إغلاق؛ كل ما بينها أرقام وفواصل ومسافات
+    static size_t findStructural(const char* data, size_t size) {
+        size_t i = 0;
+#ifdef __SSE2__
+        const __m128i quote = _mm_set1_epi8('"');
+        const __m128i openBrace = _mm_set1_epi8('{');
+        const __m128i closeBrace = _mm_set1_epi8('}');
+        const __m128i openBracket = _mm_set1_epi8('[');
+        const __m128i closeBracket = _mm_set1_epi8(']');
+        for (; i + 16 <= size; i += 16) {
+            __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+            __m128i hits = _mm_or_si128(
+                _mm_or_si128(_mm_cmpeq_epi8(chunk, quote), _mm_cmpeq_epi8(chunk, openBrace)),
+                _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, closeBrace), _mm_cmpeq_epi8(chunk, openBracket)),
+                             _mm_cmpeq_epi8(chunk, closeBracket)));
+            auto mask = static_cast<unsigned>(_mm_movemask_epi8(hits));
+            if (mask) return i + countr_zero(mask);
+        }
+#endif
+        for (; i < size; ++i) {
+            char c = data[i];
+            if (c == '"' || c == '{' || c == '}' || c == '[' || c == ']') return i;
+        }
+        return size;
+    }
+
+    string_view json_;
+    size_t pos_{0};
+};
+
+// =============== مدير البوتات المحسن ===============
+
+class BotManager : public IBotManager {
+public:
+    // batchWorkers = 0 يعني معالجاً لكل اتصال في الـ pool عدا DB_POOL_RESERVE؛ الإعداد الذي لا يترك
+    // هذا الاحتياطي يُرفض، فالمعالجات تحجز اتصالاتها مدة الدفعة وتجوّع بقية المستخدمين
+    // spillLog اختياري: بدونه لا تنجو الأحداث المعلقة من انقطاع قاعدة البيانات أو إعادة التشغيل
+    // poller يفعّل وضع السحب الطويل بدلاً من مسارات Webhook
+    // userStore يستبدل جدول Users (معيار الأداء)؛ الافتراضي SqlUserStore فوق db
+    BotManager(shared_ptr<IDatabaseManager> db, shared_ptr<IEncryptionService> encryptor,
+               shared_ptr<WebhookServer> webhookServer,
+               size_t batchWorkers = 0, shared_ptr<SpillLog> spillLog = nullptr,
+               shared_ptr<LongPollIngestor> poller = nullptr, shared_ptr<IUserStore> userStore = nullptr)
+        : dbManager_(db), userStore_(userStore ? userStore : make_shared<SqlUserStore>(db)),
+          encryptor_(encryptor), webhookServer_(webhookServer), spillLog_(spillLog), poller_(poller) {
+        size_t poolSize = dbManager_->getPoolSize();
+        size_t reserve = EnvironmentConfig::DB_POOL_RESERVE;
+        if (poolSize <= reserve || batchWorkers > poolSize - reserve) {
+            throw invalid_argument("حجم تجمع الاتصالات (" + to_string(poolSize) + ") لا يترك " +
+                                   to_string(reserve) + " اتصالات احتياطية بجانب معالجات الدفعات");
+        }
+        size_t workers = batchWorkers > 0 ? batchWorkers : poolSize - reserve;
+        shards_.reserve(workers);
+        for (size_t i = 0; i < workers; ++i) {
+            shards_.push_back(make_unique<BatchShard>(EnvironmentConfig::INGEST_QUEUE_CAPACITY));
+            shards_.back()->writer = userStore_->openWriter();
+        }
+        admission_.setSaturationHandler([this] {
+            for (auto& shard : shards_) {
+                shard->wakeup.notify();
+            }
+        });
+        
+        // تبدأ المعالجات بعد تهيئة جميع الأعضاء
+        for (auto& shard : shards_) {
+            shard->worker = async(launch::async, [this, &shard = *shard]() { batchProcessorLoop(shard); });
+        }
+        maintenance_ = async(launch::async, [this]() { maintenanceLoop(); });
+    }
+
+    ~BotManager() override {
+        shutdown();
+    }
+
+    bool startBot(const BotConfig& config) override {
+        return launchBot(config, true).started;
+    }
+
+    void startBotAsync(const BotConfig& config, function<void(const BotLaunchResult&)> onDone) override {
+        lock_guard<mutex> lock(lifecycleMutex_);
+        erase_if(lifecycleTasks_, [](const future<void>& task) {
+            return task.wait_for(chrono::seconds(0)) == future_status::ready;
+        });
+        lifecycleTasks_.push_back(async(launch::async, [this, config, onDone = move(onDone)]() {
+            BotLaunchResult outcome = launchBot(config, true);
+            if (!onDone) return;
+            try {
+                onDone(outcome);
+            } catch (const exception& e) {
+                cerr << "خطأ في معالج نتيجة تشغيل البوت: " << e.what() << endl;
+            }
+        }));
+    }
+
+    // يعيد تشغيل البوتات المسجلة في جدول Bots؛ التحقق من التوكن وتسجيل Webhook يجريان بالتوازي
+    size_t restoreBots(size_t parallelism = EnvironmentConfig::BOT_RESTORE_PARALLELISM) {
+        auto started = chrono::steady_clock::now();
+        
+        vector<BotConfig> bots;
+        try {
+            bots = loadRegisteredBots();
+        } catch (const exception& e) {
+            cerr << "❌ خطأ في تحميل جدول البوتات: " << e.what() << endl;
+            return 0;
+        }
+        
+        atomic<size_t> next{0};
+        atomic<size_t> restored{0};
+        vector<future<void>> workers;
+        size_t workerCount = min(max<size_t>(1, parallelism), bots.size());
+        workers.reserve(workerCount);
+        for (size_t i = 0; i < workerCount; ++i) {
+            workers.push_back(async(launch::async, [this, &bots, &next, &restored]() {
+                for (size_t index = next++; index < bots.size() && !shutdownFlag_; index = next++) {
+                    if (launchBot(bots[index], false).started) {
+                        restored++;
+                    }
+                }
+            }));
+        }
+        for (auto& worker : workers) {
+            worker.wait();
+        }
+        
+        auto elapsedMs = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - started).count();
+        restoredBots_ = restored.load();
+        restoreDurationMs_ = static_cast<double>(elapsedMs);
+        cout << "♻️ تمت استعادة " << restored << "/" << bots.size() << " بوت خلال " << elapsedMs << " ms" << endl;
+        return restored;
+    }
+
+    bool stopBot(const string& encryptedToken) override {
+        BotConfig config;
+        {
+            unique_lock<shared_mutex> lock(botsMutex_);
+            auto it = activeBots_.find(encryptedToken);
+            if (it == activeBots_.end() || !registry_.slot(it->second->botId).transition(BotState::Running, BotState::Stopping)) {
+                return false;
+            }
+            config = *it->second;
+            activeBots_.erase(it);
+            publishBotTable();
+        }
+
+        // الاستدعاءات الشبكية خارج القفل حتى لا تتوقف بقية عمليات الإدارة
+        BotSlot& slot = registry_.slot(config.botId);
+        detachIngestion(config);
+        
+        // بدون حذف الـ webhook يواصل تيليجرام إعادة إرسال التحديثات إلى مسار غير موجود
+        try {
+            makeBot(encryptor_->decrypt(encryptedToken))->getApi().deleteWebhook();
+        } catch (const exception& e) {
+            cerr << "تحذير: فشل في حذف Webhook للبوت: " << e.what() << endl;
+        }
+
+        try {
+            executeBotStatement("delete_bot", "DELETE FROM Bots WHERE BotID = ?", [&](statement& stmt) {
+                stmt.bind(0, &config.telegramId);
+            });
+        } catch (const exception& e) {
+            cerr << "تحذير: فشل في حذف البوت من جدول Bots: " << e.what() << endl;
+        }
+        
+        slot.state = BotState::Stopped;
+        return true;
+    }
+
+    bool pauseBot(const string& encryptedToken) override {
+        return setBotActive(encryptedToken, false);
+    }
+
+    bool resumeBot(const string& encryptedToken) override {
+        return setBotActive(encryptedToken, true);
+    }
+
+    shared_ptr<const BotTable> getActiveBots() const override {
+        return botTable_.load(memory_order_acquire);
+    }
+
+    void configure(const map<string, string>& config) override {
+        admission_.configure(config);
+        
+        if (config.count("batch_target_latency_ms")) {
+            batchTargetLatencyMs_ = stoi(config.at("batch_target_latency_ms"));
+        }
+        if (config.count("batch_max_delay_ms")) {
+            batchMaxDelayMs_ = stoi(config.at("batch_max_delay_ms"));
+        }
+        if (config.count("last_seen_granularity_s")) {
+            lastSeenGranularitySeconds_ = static_cast<uint32_t>(stoul(config.at("last_seen_granularity_s")));
+        }
+        if (config.count("batch_max_size")) {
+            batchMaxSize_ = clamp<size_t>(stoul(config.at("batch_max_size")),
+                EnvironmentConfig::MIN_BATCH_SIZE, EnvironmentConfig::MAX_BATCH_SIZE);
+        }
+        
+        lock_guard<mutex> lock(configMutex_);
+        configuration_ = config;
+    }
+
+    map<string, string> getConfiguration() const override {
+        auto result = admission_.getConfiguration();
+        result["batch_target_latency_ms"] = to_string(batchTargetLatencyMs_);
+        result["batch_max_delay_ms"] = to_string(batchMaxDelayMs_);
+        result["batch_max_size"] = to_string(batchMaxSize_);
+        result["last_seen_granularity_s"] = to_string(lastSeenGranularitySeconds_);
+        
+        lock_guard<mutex> lock(configMutex_);
+        for (const auto& [key, value] : configuration_) {
+            result.emplace(key, value);
+        }
+        return result;
+    }
+
+    // بدون أقفال مسار الرسائل: العدادات ذرية، والمدرجات تُدمج في نسخ مؤقتة محجوزة مسبقاً
+    void collectMetrics(MetricSink& sink) const override {
+        admission_.collectMetrics(sink);
+        if (spillLog_) {
+            spillLog_->collectMetrics(sink);
+        }
+        
+        size_t queueSize = 0;
+        size_t spillSize = 0;
+        size_t batchLimit = 0;
+        size_t coalesced = replayCounters_.coalescedEvents.load(memory_order_relaxed);
+        size_t skipped = replayCounters_.skippedUpserts.load(memory_order_relaxed);
+        size_t inserted = replayCounters_.insertedUsers.load(memory_order_relaxed);
+        size_t committed = replayCounters_.committedEvents.load(memory_order_relaxed);
+        for (const auto& shard : shards_) {
+            queueSize += shard->queue.sizeApprox();
+            committed += shard->counters.committedEvents.load(memory_order_relaxed);
+            batchLimit += shard->batchLimit;
+            spillSize += shard->spillBuffered.load(memory_order_relaxed);
+            coalesced += shard->counters.coalescedEvents.load(memory_order_relaxed);
+            skipped += shard->counters.skippedUpserts.load(memory_order_relaxed);
+            inserted += shard->counters.insertedUsers.load(memory_order_relaxed);
+        }
+        
+        size_t indexedUsers = 0;
+        size_t indexBytes = 0;
+        long storedUsers = 0;
+        size_t pendingBots = 0;
+        double maxBotRate = 0.0;
+        for (BotId botId = 0; botId < registry_.size(); ++botId) {
+            const BotSlot& slot = registry_.slot(botId);
+            BotState state = slot.state.load(memory_order_relaxed);
+            pendingBots += state != BotState::Stopped && state != BotState::Running;
+            maxBotRate = max(maxBotRate, slot.eventRate.load(memory_order_relaxed));
+            storedUsers += slot.storedUsers;
+            indexedUsers += slot.seenUsers->size();
+            indexBytes += slot.seenUsers->memoryBytes();
+        }
+        
+        sink.gauge("skipped_upserts", static_cast<double>(skipped));
+        sink.gauge("inserted_users", static_cast<double>(inserted));
+        sink.gauge("coalesced_events", static_cast<double>(coalesced));
+        sink.gauge("committed_events", static_cast<double>(committed));
+        sink.gauge("updates_fast_path", static_cast<double>(fastPathUpdates_.load()));
+        sink.gauge("updates_full_parse", static_cast<double>(fullParseUpdates_.load()));
+        sink.gauge("stored_users", static_cast<double>(storedUsers));
+        sink.gauge("seen_index_users", static_cast<double>(indexedUsers));
+        sink.gauge("seen_index_bytes", static_cast<double>(indexBytes));
+        sink.gauge("seen_index_budget_bytes", static_cast<double>(registry_.seenBudget().limitBytes()));
+        sink.gauge("seen_index_evictions", static_cast<double>(seenIndexEvictions_));
+        sink.gauge("bot_ids", static_cast<double>(registry_.size()));
+        sink.gauge("active_bots", static_cast<double>(getActiveBotsCount()));
+        sink.gauge("pending_bot_transitions", static_cast<double>(pendingBots));
+        sink.gauge("total_bots", static_cast<double>(totalBots_));
+        sink.gauge("restored_bots", static_cast<double>(restoredBots_));
+        sink.gauge("restore_duration_ms", restoreDurationMs_.load());
+        sink.gauge("batch_workers", static_cast<double>(shards_.size()));
+        sink.gauge("queue_size", static_cast<double>(queueSize));
+        sink.gauge("spill_buffer_size", static_cast<double>(spillSize));
+        sink.gauge("batch_limit_avg", static_cast<double>(batchLimit) / shards_.size());
+        sink.gauge("bot_event_rate_max", maxBotRate);
+        sink.gauge("processing_rate", processingRate_);
+        
+        {
+            lock_guard<mutex> lock(scrapeMutex_);
+            auto& scratch = *scrapeHistograms_;
+            for (auto* histogram : {&scratch.batchSizes, &scratch.queueTimes, &scratch.commitTimes,
+                                    &scratch.ingestLatencies, &scratch.enqueueWaits}) {
+                histogram->clear();
+            }
+            for (const auto& shard : shards_) {
+                scratch.batchSizes.merge(shard->batchSizes);
+                scratch.queueTimes.merge(shard->queueTimes);
+                scratch.commitTimes.merge(shard->commitTimes);
+                scratch.ingestLatencies.merge(shard->ingestLatencies);
+            }
+            enqueueWaitHistogram_.mergeInto(scratch.enqueueWaits);
+            
+            sink.gauge("batch_size_p50", static_cast<double>(scratch.batchSizes.percentile(50)));
+            sink.gauge("batch_size_p99", static_cast<double>(scratch.batchSizes.percentile(99)));
+            sink.gauge("batch_size_max", static_cast<double>(scratch.batchSizes.maxValue()));
+            // المدرجات بالميكروثانية وتُصدّر بالمللي ثانية
+            auto latency = [&sink](string_view p50, string_view p99, string_view maximum, const Histogram& histogram) {
+                sink.gauge(p50, histogram.percentile(50) / 1000.0);
+                sink.gauge(p99, histogram.percentile(99) / 1000.0);
+                sink.gauge(maximum, histogram.maxValue() / 1000.0);
+            };
+            latency("enqueue_wait_ms_p50", "enqueue_wait_ms_p99", "enqueue_wait_ms_max", scratch.enqueueWaits);
+            latency("queue_time_ms_p50", "queue_time_ms_p99", "queue_time_ms_max", scratch.queueTimes);
+            latency("commit_ms_p50", "commit_ms_p99", "commit_ms_max", scratch.commitTimes);
+            latency("ingest_latency_ms_p50", "ingest_latency_ms_p99", "ingest_latency_ms_max", scratch.ingestLatencies);
+        }
+        
+        // لقطة الجدول تُقرأ بمؤشر ذري؛ الخانات لا تنتقل فلا يلزم قفل
+        for (const auto& bot : *getActiveBots()) {
+            const BotSlot& slot = registry_.slot(bot->botId);
+            sink.botGauge("bot_stored_users", bot->telegramId, bot->username, static_cast<double>(slot.storedUsers));
+            sink.botGauge("bot_new_users", bot->telegramId, bot->username, static_cast<double>(slot.totalUsers));
+            sink.botGauge("bot_events", bot->telegramId, bot->username, static_cast<double>(slot.events));
+            sink.botGauge("bot_event_rate", bot->telegramId, bot->username, slot.eventRate.load(memory_order_relaxed));
+            sink.botGauge("bot_active", bot->telegramId, bot->username, slot.active ? 1.0 : 0.0);
+        }
+    }
+
+    bool isHealthy() const override {
+        return !shutdownFlag_ && getActiveBotsCount() <= EnvironmentConfig::MAX_ACTIVE_BOTS;
+    }
+
+    string getStatus() const override {
+        if (shutdownFlag_) return "shutdown";
+        if (getActiveBotsCount() >= EnvironmentConfig::MAX_ACTIVE_BOTS) return "at_capacity";
+        return "healthy";
+    }
+
+    void shutdown() override {
+        shutdownFlag_ = true;
+        
+        // عمليات التشغيل الجارية تنتهي أولاً حتى لا يُسجّل مسار بعد إزالة المسارات
+        {
+            lock_guard<mutex> lock(lifecycleMutex_);
+            for (auto& task : lifecycleTasks_) {
+                task.wait();
+            }
+            lifecycleTasks_.clear();
+        }
+        
+        // لا طلبات جديدة؛ تيليجرام يعيد إرسال ما لم يُقر بعد إعادة التشغيل
+        for (const auto& bot : *getActiveBots()) {
+            detachIngestion(*bot);
+        }
+        
+        for (auto& shard : shards_) {
+            shard->wakeup.notifyAll();
+        }
+        for (auto& shard : shards_) {
+            if (shard->worker.valid()) {
+                shard->worker.wait();
+            }
+        }
+        
+        // الأحداث التي لم تُثبّت تبقى في سجل الفائض وتُعاد عند التشغيل التالي
+        maintenanceWakeup_.notifyAll();
+        if (maintenance_.valid()) {
+            maintenance_.wait();
+        }
+        flushPollingOffsets();
+    }
+
+    bool isShutdown() const override {
+        return shutdownFlag_;
+    }
+
+    size_t getTotalBots() const override {
+        return totalBots_;
+    }
+
+    size_t getActiveBotsCount() const override {
+        return getActiveBots()->size();
+    }
+
+    vector<BotStats> getBotStats() const override {
+        auto bots = getActiveBots();
+        
+        vector<BotStats> stats;
+        stats.reserve(bots->size());
+        for (const auto& bot : *bots) {
+            const BotSlot& slot = registry_.slot(bot->botId);
+            stats.push_back({bot->name, bot->username, slot.storedUsers.load(), slot.totalUsers.load(),
+                             slot.eventRate.load(memory_order_relaxed), bot->isActive.load()});
+        }
+        return stats;
+    }
+
+private:
+    struct CoalesceKey {
+        BotId botId;
+        int64_t userId;
+        
+        bool operator==(const CoalesceKey& other) const = default;
+    };
+    
+    struct CoalesceKeyHash {
+        size_t operator()(const CoalesceKey& key) const {
+            return hash<int64_t>{}(key.userId) * 0x9e3779b97f4a7c15ULL ^ key.botId;
+        }
+    };
+
+    using CoalesceIndex = unordered_map<CoalesceKey, size_t, CoalesceKeyHash>;
+
+    // عدادات يكتبها خيط واحد (معالج الشريحة أو خيط الصيانة)؛ collectMetrics يجمعها دون أقفال
+    struct alignas(64) IngestCounters {
+        atomic<size_t> coalescedEvents{0};
+        atomic<size_t> skippedUpserts{0};
+        atomic<size_t> insertedUsers{0};
+        atomic<size_t> committedEvents{0};   // أحداث خام في دفعات ثُبّتت (أساس processing_rate)
+    };
+
+    // معالج دفعات يملك شريحة من البوتات: طابوره ومخزن فائضه واتصاله
+    struct BatchShard {
+        explicit BatchShard(size_t capacity) : queue(capacity) {}
+        
+        MpscRingBuffer<MessageData> queue;
+        WakeupSignal wakeup;
+        mutable mutex spillMutex;
+        deque<MessageData> spillBuffer;
+        atomic<size_t> spillBuffered{0};   // spillBuffer.size() يُقرأ دون spillMutex
+        CoalesceIndex coalesceIndex;
+        vector<pair<uint64_t, size_t>> spillTally;
+        vector<uint8_t> inserted;
+        IngestCounters counters;
+        // مدرجات يكتبها معالج الشريحة وحده؛ collectMetrics يدمجها
+        Histogram batchSizes;       // أحداث لكل دفعة قبل الدمج
+        Histogram queueTimes;       // ميكروثانية من الوصول حتى إغلاق الدفعة
+        Histogram commitTimes;      // ميكروثانية لكل معاملة
+        Histogram ingestLatencies;  // ميكروثانية من الوصول حتى تثبيت الصف
+        unique_ptr<IUserStore::Writer> writer;
+        atomic<size_t> batchLimit{EnvironmentConfig::BATCH_SIZE};
+        future<void> worker;
+    };
+
+    enum class UpdateKind { Message, Ignored, Invalid };
+
+    // مرسل الرسالة في التحديث؛ Ignored لتحديث بلا رسالة أو بلا from
+    UpdateKind extractSender(string_view body, int64_t& userId, string& username) {
+        // المسار السريع: قراءة المرسل من الجسم مباشرة دون بناء كائنات التحديث
+        UpdateSender sender;
+        switch (UpdateScanner::scanSender(body, sender)) {
+            case UpdateScanner::Result::Sender:
+                fastPathUpdates_.add();
+                userId = sender.userId;
+                username = sender.username.empty()
+                    ? "user_" + to_string(sender.userId)
+                    : string(sender.username);
+                return UpdateKind::Message;
+            case UpdateScanner::Result::NoSender:
+                fastPathUpdates_.add();
+                return UpdateKind::Ignored;
+            case UpdateScanner::Result::Unsupported:
+                break;
+        }
+        
+        fullParseUpdates_.add();
+        Update::Ptr update;
+        try {
+            TgTypeParser parser;
+            update = parser.parseJsonAndGetUpdate(parser.parseJson(string(body)));
+        } catch (const exception&) {
+            return UpdateKind::Invalid;
+        }
+        
+        if (!update || !update->message || !update->message->from) return UpdateKind::Ignored;
+        
+        const auto& from = update->message->from;
+        userId = from->id;
+        username = from->username.empty() ? "user_" + to_string(from->id) : from->username;
+        return UpdateKind::Message;
+    }
+
+    // تحديث واحد من تيليجرام؛ 503 يجعل تيليجرام يعيد إرساله إذا لم يُحفظ الحدث
+    int handleWebhookUpdate(BotId botId, string_view body) {
+        if (!registry_.slot(botId).active.load(memory_order_relaxed)) return 200;
+        
+        int64_t userId = 0;
+        string username;
+        switch (extractSender(body, userId, username)) {
+            case UpdateKind::Invalid:
+                return 400;
+            case UpdateKind::Ignored:
+                return 200;
+            case UpdateKind::Message:
+                break;
+        }
+        
+        return addMessageToQueue(botId, userId, move(username)) ? 200 : 503;
+    }
+
+    // رد getUpdates كاملاً يدخل مسار الدفعات معاً: التصاريح تُحجز للمصفوفة مرة واحدة، والأحداث
+    // تُكتب في السجل وتُدفع إلى الطابور، ثم يُنتظر حفظ آخرها فقط؛ فلا يتعطل عامل السحب وبقية بوتاته
+    // بانتظار لكل تحديث. ما زاد عن التصاريح يُعاد طلبه من الإزاحة، والتحديثات غير الصالحة تُتخطى
+    LongPollIngestor::BatchOutcome handlePolledUpdates(BotId botId, string_view response, int64_t& offset) {
+        struct PolledUpdate {
+            int64_t updateId;
+            int64_t userId;
+            string username;
+            bool message;
+        };
+        
+        LongPollIngestor::BatchOutcome outcome;
+        bool active = registry_.slot(botId).active.load(memory_order_relaxed);
+        vector<PolledUpdate> updates;
+        size_t messages = 0;
+        outcome.valid = UpdateScanner::scanUpdates(response, [&](string_view update, int64_t updateId) {
+            PolledUpdate polled{updateId, 0, {}, false};
+            polled.message = active && extractSender(update, polled.userId, polled.username) == UpdateKind::Message;
+            messages += polled.message;
+            updates.push_back(move(polled));
+        });
+        if (!outcome.valid || updates.empty()) return outcome;
+        
+        auto arrived = chrono::steady_clock::now();
+        BatchShard& shard = shardFor(botId);
+        size_t permits = admission_.admitMany(messages);
+        SpillTicket first;
+        SpillTicket last;
+        int64_t nextOffset = offset;
+        for (auto& polled : updates) {
+            if (polled.message) {
+                if (permits == 0) {
+                    outcome.complete = false;
+                    break;
+                }
+                permits--;
+                last = pushAdmitted(shard, MessageData{botId, polled.userId, move(polled.username), 1, arrived});
+                if (first.sequence == 0) first = last;
+            }
+            nextOffset = polled.updateId + 1;
+            outcome.updates++;
+        }
+        enqueueWaitHistogram_.record(microsSince(arrived));
+        
+        // انتظار واحد للمدى كله. عند الفشل لا تتقدم الإزاحة فيعيد تيليجرام الإرسال؛ الأحداث
+        // في الطابور تُكتب على أي حال وMERGE يزيل التكرار
+        if (spillLog_ && last.sequence != 0 && !spillLog_->waitDurable(first, last)) {
+            outcome.updates = 0;
+            outcome.complete = false;
+            return outcome;
+        }
+        offset = nextOffset;
+        return outcome;
+    }
+
+    // الإزاحة تُحفظ بعد قبول التحديثات (في السجل أو الطابور)؛ بعد الإقلاع يُستأنف منها
+    void flushPollingOffsets() {
+        if (!poller_) return;
+        for (auto [telegramId, offset] : poller_->takeChangedOffsets()) {
+            try {
+                executeBotStatement("save_update_offset",
+                    "UPDATE Bots SET UpdateOffset = ? WHERE BotID = ?", [&](statement& stmt) {
+                        stmt.bind(0, &offset);
+                        stmt.bind(1, &telegramId);
+                    });
+            } catch (const exception& e) {
+                cerr << "تحذير: فشل في حفظ إزاحة getUpdates للبوت " << telegramId << ": " << e.what() << endl;
+                poller_->restoreOffset(telegramId, offset);
+            }
+        }
+    }
+
+    // getUpdates يرفض العمل (409) ما دام Webhook مسجلاً، فيُحذف قبل بدء السحب
+    void attachIngestion(const BotConfig& config, const string& token) {
+        BotId botId = config.botId;
+        if (poller_) {
+            makeBot(token)->getApi().deleteWebhook();
+            poller_->addBot(config.telegramId, token, config.updateOffset,
+                [this, botId](string_view response, int64_t& offset) {
+                    return handlePolledUpdates(botId, response, offset);
+                });
+            return;
+        }
+        
+        // المسار يُسجّل قبل إبلاغ تيليجرام حتى لا يضيع أول تحديث
+        webhookServer_->registerRoute(config.webhookPath, [this, botId](const string& body) {
+            return handleWebhookUpdate(botId, body);
+        });
+        makeBot(token)->getApi().setWebhook(webhookBaseUrl() + "/" + webhookKey(token));
+    }
+
+    void detachIngestion(const BotConfig& config) {
+        if (poller_) {
+            poller_->removeBot(config.telegramId);
+        } else {
+            webhookServer_->unregisterRoute(config.webhookPath);
+        }
+    }
+
+    // مسار ثابت عبر إعادات التشغيل لا يكشف التوكن: أول 128 بت من SHA-256 للتوكن
+    static string webhookKey(const string& token) {
+        string digest;
+        SHA256 hash;
+        StringSource(token, true, new HashFilter(hash, new HexEncoder(new StringSink(digest), false)));
+        return digest.substr(0, 32);
+    }
+
+    static string webhookBaseUrl() {
+        string url = getenv("WEBHOOK_URL") ?: "https://your-domain.com/webhook";
+        while (!url.empty() && url.back() == '/') url.pop_back();
+        return url;
+    }
+
+    // nginx يمرر المسار كما هو، فمسار الخادم هو مسار WEBHOOK_URL
+    static string webhookPathPrefix() {
+        string path = WebhookServer::urlPath(webhookBaseUrl());
+        return path == "/" ? "" : path;
+    }
+
+    // Stopped -> Validating -> Starting -> Running. الاستدعاءات الشبكية تجري في الحالات الوسيطة
+    // دون botsMutex_؛ القفل يُؤخذ فقط لنشر البوت في activeBots_ وجدول القراءة
+    BotLaunchResult launchBot(const BotConfig& config, bool persist) {
+        BotLaunchResult outcome;
+        auto fail = [&outcome](string error) {
+            cerr << error << endl;
+            outcome.error = move(error);
+            return outcome;
+        };
+        
+        if (shutdownFlag_) {
+            return fail("النظام قيد الإيقاف");
+        }
+        if (getActiveBotsCount() >= EnvironmentConfig::MAX_ACTIVE_BOTS) {
+            return fail("تم الوصول للحد الأقصى من البوتات النشطة");
+        }
+
+        // معرّف البوت يُقرأ من التوكن نفسه فيُكشف التكرار قبل أي استدعاء شبكي
+        string token;
+        int64_t telegramId = 0;
+        try {
+            token = encryptor_->decrypt(config.encryptedToken);
+            telegramId = telegramBotIdFromToken(token);
+        } catch (const exception& e) {
+            return fail("خطأ في قراءة التوكن: " + string(e.what()));
+        }
+
+        BotId botId = registry_.intern(telegramId);
+        if (botId == INVALID_BOT_ID) {
+            return fail("جدول البوتات ممتلئ");
+        }
+        
+        // نفس البوت قد يصل بتشفير مختلف للتوكن، أو يُضاف أثناء استعادته أو إيقافه
+        BotSlot& slot = registry_.slot(botId);
+        if (!slot.transition(BotState::Stopped, BotState::Validating)) {
+            return fail("البوت قيد التشغيل بالفعل");
+        }
+
+        User::Ptr me;
+        try {
+            me = makeBot(token)->getApi().getMe();
+        } catch (const exception& e) {
+            slot.state = BotState::Stopped;
+            return fail("خطأ في التحقق من التوكن: " + string(e.what()));
+        }
+        if (!me || me->id != telegramId) {
+            slot.state = BotState::Stopped;
+            return fail("توكن البوت غير صالح");
+        }
+        slot.state = BotState::Starting;
+
+        BotConfig botConfig = config;
+        botConfig.telegramId = telegramId;
+        botConfig.botId = botId;
+        botConfig.name = me->firstName;
+        botConfig.username = me->username;
+        botConfig.webhookPath = webhookPathPrefix() + "/" + webhookKey(token);
+        
+        slot.active = config.isActive.load();
+        try {
+            attachIngestion(botConfig, token);
+        } catch (const exception& e) {
+            detachIngestion(botConfig);
+            slot.state = BotState::Stopped;
+            return fail("خطأ في تسجيل استقبال التحديثات للبوت: " + string(e.what()));
+        }
+        
+        botConfig.isRunning = true;
+        botConfig.isInitialized = true;
+        bool published = false;
+        {
+            unique_lock<shared_mutex> lock(botsMutex_);
+            // الحد يُفحص ثانية: عمليات تشغيل متزامنة قد تجاوزت الفحص الأول معاً
+            if (activeBots_.size() < EnvironmentConfig::MAX_ACTIVE_BOTS) {
+                activeBots_[config.encryptedToken] = make_shared<BotConfig>(botConfig);
+                publishBotTable();
+                slot.state = BotState::Running;
+                published = true;
+            }
+        }
+        if (!published) {
+            detachIngestion(botConfig);
+            slot.state = BotState::Stopped;
+            return fail("تم الوصول للحد الأقصى من البوتات النشطة");
+        }
+        
+        totalBots_++;
+        scheduleSeenUsersLoad(botId);
+        
+        if (persist) {
+            try {
+                persistBot(botConfig);
+            } catch (const exception& e) {
+                cerr << "تحذير: البوت يعمل لكن لن يُستعاد بعد إعادة التشغيل: " << e.what() << endl;
+            }
+        }
+        
+        outcome.started = true;
+        outcome.name = botConfig.name;
+        return outcome;
+    }
+
+    bool setBotActive(const string& encryptedToken, bool active) {
+        int64_t telegramId = 0;
+        {
+            shared_lock<shared_mutex> lock(botsMutex_);
+            auto it = activeBots_.find(encryptedToken);
+            if (it == activeBots_.end()) {
+                return false;
+            }
+            it->second->isActive = active;
+            registry_.slot(it->second->botId).active = active;
+            telegramId = it->second->telegramId;
+        }
+        
+        try {
+            int isActive = active ? 1 : 0;
+            executeBotStatement("set_bot_active",
+                "UPDATE Bots SET IsActive = ?, UpdatedAt = GETDATE() WHERE BotID = ?", [&](statement& stmt) {
+                    stmt.bind(0, &isActive);
+                    stmt.bind(1, &telegramId);
+                });
+        } catch (const exception& e) {
+            cerr << "تحذير: فشل في حفظ حالة البوت: " << e.what() << endl;
+        }
+        return true;
+    }
+
+    // يُستدعى تحت botsMutex_ الحصري. النسخ O(n) مؤشرات، وتغيير البوتات نادر مقارنة بالقراءة
+    void publishBotTable() {
+        auto table = make_shared<BotTable>();
+        table->reserve(activeBots_.size());
+        for (const auto& [token, bot] : activeBots_) {
+            table->push_back(bot);
+        }
+        botTable_.store(move(table), memory_order_release);
+    }
+
+    // صف واحد لكل بوت في تيليجرام؛ إعادة إضافة البوت تستبدل توكنه المشفر
+    void persistBot(const BotConfig& config) {
+        int isActive = config.isActive ? 1 : 0;
+        executeBotStatement("persist_bot",
+            "MERGE INTO Bots AS target "
+            "USING (SELECT ? AS BotID, ? AS EncryptedToken, ? AS Name, ? AS Username, ? AS IsActive) AS source "
+            "ON target.BotID = source.BotID "
+            "WHEN MATCHED THEN "
+            "  UPDATE SET EncryptedToken = source.EncryptedToken, Name = source.Name, "
+            "  Username = source.Username, IsActive = source.IsActive, UpdatedAt = GETDATE() "
+            "WHEN NOT MATCHED THEN "
+            "  INSERT (BotID, EncryptedToken, Name, Username, IsActive, CreatedAt, UpdatedAt) "
+            "  VALUES (source.BotID, source.EncryptedToken, source.Name, source.Username, source.IsActive, "
+            "          GETDATE(), GETDATE());",
+            [&](statement& stmt) {
+                stmt.bind(0, &config.telegramId);
+                stmt.bind(1, config.encryptedToken.c_str());
+                stmt.bind(2, config.name.c_str());
+                stmt.bind(3, config.username.c_str());
+                stmt.bind(4, &isActive);
+            });
+    }
+
+    vector<BotConfig> loadRegisteredBots() {
+        vector<BotConfig> bots;
+        auto conn = dbManager_->getConnection();
+        try {
+            result rows = execute(*conn, "SELECT EncryptedToken, Name, Username, IsActive, UpdateOffset FROM Bots");
+            while (rows.next()) {
+                BotConfig config;
+                config.encryptedToken = rows.get<string>(0);
+                config.name = rows.get<string>(1, "");
+                config.username = rows.get<string>(2, "");
+                config.isActive = rows.get<int>(3, 1) != 0;
+                config.updateOffset = rows.get<int64_t>(4, 0);
+                bots.push_back(config);
+            }
+        } catch (...) {
+            dbManager_->releaseConnection(move(conn));
+            throw;
+        }
+        dbManager_->releaseConnection(move(conn));
+        return bots;
+    }
+
+    void executeBotStatement(const string& queryId, const string& query,
+                             const function<void(statement&)>& bind) {
+        auto conn = dbManager_->getConnection();
+        try {
+            statement& stmt = dbManager_->getPreparedStatement(*conn, queryId, query);
+            bind(stmt);
+            stmt.execute();
+        } catch (...) {
+            dbManager_->releaseConnection(move(conn));
+            throw;
+        }
+        dbManager_->releaseConnection(move(conn));
+    }
+
+    // المعرّفات متتالية فتتوزع البوتات على الشرائح بالتساوي
+    BatchShard& shardFor(BotId botId) {
+        return *shards_[botId % shards_.size()];
+    }
+
+    // الانتظار هنا (القبول، الكتابة في السجل وحفظه) يُحتسب من زمن رد الـ webhook
+    bool addMessageToQueue(BotId botId, int64_t userId, string username) {
+        auto arrived = chrono::steady_clock::now();
+        bool accepted = enqueueMessage(botId, userId, move(username), arrived);
+        enqueueWaitHistogram_.record(microsSince(arrived));
+        return accepted;
+    }
+
+    static uint64_t microsSince(chrono::steady_clock::time_point from,
+                                chrono::steady_clock::time_point now = chrono::steady_clock::now()) {
+        return static_cast<uint64_t>(max<int64_t>(0, chrono::duration_cast<chrono::microseconds>(now - from).count()));
+    }
+
+    bool enqueueMessage(BotId botId, int64_t userId, string username, chrono::steady_clock::time_point arrived) {
+        BatchShard& shard = shardFor(botId);
+        MessageData message{botId, userId, move(username), 1, arrived};
+        
+        switch (admission_.admit()) {
+            case AdmissionResult::Rejected:
+                return false;
+            case AdmissionResult::Spilled:
+                return spillMessage(shard, move(message));
+            case AdmissionResult::Admitted:
+                break;
+        }
+        
+        SpillTicket ticket = pushAdmitted(shard, move(message));
+        
+        // لا نُقرّ الحدث لتيليجرام قبل حفظه على القرص
+        return !spillLog_ || spillLog_->waitDurable(ticket);
+    }
+
+    // الحدث يحمل تصريحاً محجوزاً: يُكتب في السجل ثم يدخل طابور شريحته دون انتظار حفظه
+    SpillTicket pushAdmitted(BatchShard& shard, MessageData message) {
+        SpillTicket ticket;
+        if (spillLog_) {
+            ticket = spillLog_->append(message, registry_.slot(message.botId).telegramId, false);
+            message.spillSegment = ticket.segmentId;
+        }
+        
+        // التصاريح لا تتجاوز سعة الطابور، فالانتظار هنا قصير ونادر
+        while (!shard.queue.tryPush(move(message))) {
+            shard.wakeup.notify();
+            this_thread::yield();
+        }
+        
+        shard.wakeup.notify();
+        return ticket;
+    }
+
+    // أحداث الفائض لا تحمل تصاريح: تُكتب في السجل فقط وتُعاد لاحقاً،
+    // أو تنتظر في ذاكرة الشريحة حتى يفرغ طابورها إذا كان السجل معطلاً
+    bool spillMessage(BatchShard& shard, MessageData message) {
+        if (spillLog_) {
+            return spillLog_->waitDurable(
+                spillLog_->append(message, registry_.slot(message.botId).telegramId, true));
+        }
+        
+        {
+            lock_guard<mutex> lock(shard.spillMutex);
+            if (shard.spillBuffer.size() >= EnvironmentConfig::SPILL_BUFFER_CAPACITY / shards_.size()) {
+                return false;
+            }
+            shard.spillBuffer.push_back(move(message));
+            shard.spillBuffered.store(shard.spillBuffer.size(), memory_order_relaxed);
+        }
+        
+        shard.wakeup.notify();
+        return true;
+    }
+
+    void drainSpillBuffer(BatchShard& shard, vector<MessageData>& batch, size_t maxItems) {
+        lock_guard<mutex> lock(shard.spillMutex);
+        while (!shard.spillBuffer.empty() && batch.size() < maxItems) {
+            batch.push_back(move(shard.spillBuffer.front()));
+            shard.spillBuffer.pop_front();
+        }
+        shard.spillBuffered.store(shard.spillBuffer.size(), memory_order_relaxed);
+    }
+
+    bool hasSpilledMessages(const BatchShard& shard) const {
+        return shard.spillBuffered.load(memory_order_relaxed) > 0;
+    }
+
+    void batchProcessorLoop(BatchShard& shard) {
+        vector<MessageData> batch;
+        batch.reserve(EnvironmentConfig::MAX_BATCH_SIZE);
+        
+        while (!shutdownFlag_) {
+            if (shard.queue.empty() && !hasSpilledMessages(shard)) {
+                // الاتصال يبقى مع المعالج ما دام لديه عمل، ويعود للـ pool عند الخمول
+                shard.writer->release();
+                shard.wakeup.waitFor(chrono::seconds(5), 
+                    [this, &shard] { return !shard.queue.empty() || hasSpilledMessages(shard) || shutdownFlag_; });
+            }
+            
+            size_t permits = collectBatch(shard, batch);
+            
+            if (!batch.empty()) {
+                recordBatchIntake(shard, batch);
+                tallySpillSegments(batch, shard.spillTally);
+                size_t rawEvents = batch.size();
+                addSingleWriter(shard.counters.coalescedEvents, coalesceBatch(shard.coalesceIndex, batch));
+                filterKnownUsers(batch, shard.counters);
+                
+                auto started = chrono::steady_clock::now();
+                bool committed = processBatch(shard, batch);
+                auto commitTime = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - started);
+                
+                shard.batchSizes.recordLocal(rawEvents);
+                if (committed) {
+                    shard.commitTimes.recordLocal(commitTime.count());
+                    recordIngestLatencies(shard, batch);
+                    addSingleWriter(shard.counters.committedEvents, rawEvents);
+                    adaptBatchLimit(shard, rawEvents, commitTime);
+                }
+                settleSpillSegments(shard.spillTally, committed);
+                batch.clear();
+            }
+            
+            // تُعاد التصاريح بعد تثبيت الدفعة أو فشلها حتى لا تتوقف خيوط الاستقبال
+            admission_.release(permits);
+        }
+        
+        shard.writer->release();
+    }
+
+    // يجمع الدفعة حتى الحد التكيفي للشريحة أو حتى تنتهي مهلة أقدم حدث فيها.
+    // الدفعات المفتوحة تحجز تصاريحها، فتُغلق فوراً إذا انتظر منتج تصريحاً
+    size_t collectBatch(BatchShard& shard, vector<MessageData>& batch) {
+        size_t limit = min<size_t>(shard.batchLimit, shardBatchCap());
+        size_t permits = shard.queue.drain(batch, limit);
+        
+        if (permits == 0) {
+            // أحداث الفائض متراكمة أصلاً فلا داعي لانتظارها
+            drainSpillBuffer(shard, batch, limit);
+            return 0;
+        }
+        
+        auto deadline = batch.front().enqueuedAt + chrono::milliseconds(batchMaxDelayMs_.load());
+        while (batch.size() < limit && !shutdownFlag_ && !admission_.saturated()) {
+            auto now = chrono::steady_clock::now();
+            if (now >= deadline) break;
+            
+            if (shard.queue.empty()) {
+                shard.wakeup.waitFor(deadline - now, [this, &shard] {
+                    return !shard.queue.empty() || shutdownFlag_ || admission_.saturated();
+                });
+            }
+            permits += shard.queue.drain(batch, limit - batch.size());
+        }
+        
+        return permits;
+    }
+
+    // زيادة جمعية ما دام التثبيت ضمن الهدف، وتنصيف عند تجاوزه
+    void adaptBatchLimit(BatchShard& shard, size_t batchSize, chrono::microseconds commitTime) {
+        size_t limit = shard.batchLimit;
+        
+        if (commitTime > chrono::milliseconds(batchTargetLatencyMs_.load())) {
+            limit = max(EnvironmentConfig::MIN_BATCH_SIZE, limit / 2);
+        } else if (batchSize >= limit) {
+            limit = min(shardBatchCap(), limit + EnvironmentConfig::MIN_BATCH_SIZE);
+        }
+        
+        shard.batchLimit = limit;
+    }
+
+    // مجموع حدود الشرائح لا يتجاوز تصاريح القبول، وإلا حجزت الدفعات المفتوحة كل التصاريح
+    size_t shardBatchCap() const {
+        return max(EnvironmentConfig::MIN_BATCH_SIZE,
+                   min(batchMaxSize_.load(), admission_.capacity() / shards_.size()));
+    }
+
+    // البوت مملوك لشريحة واحدة، فعدّاد أحداثه يُكتب هنا دون تنازع
+    void recordBatchIntake(BatchShard& shard, const vector<MessageData>& batch) {
+        auto now = chrono::steady_clock::now();
+        for (const auto& msg : batch) {
+            shard.queueTimes.recordLocal(microsSince(msg.enqueuedAt, now), msg.hitCount);
+            addSingleWriter(registry_.slot(msg.botId).events, msg.hitCount);
+        }
+    }
+
+    // الصفوف المكتوبة فقط؛ أحداث المستخدمين المعروفين لا تصل إلى قاعدة البيانات
+    static void recordIngestLatencies(BatchShard& shard, const vector<MessageData>& batch) {
+        auto now = chrono::steady_clock::now();
+        for (const auto& msg : batch) {
+            shard.ingestLatencies.recordLocal(microsSince(msg.enqueuedAt, now), msg.hitCount);
+        }
+    }
+
+    // عدد أحداث كل مقطع في الدفعة؛ يُحسب قبل الدمج لأن الدمج يخلط المقاطع
+    static void tallySpillSegments(const vector<MessageData>& batch, vector<pair<uint64_t, size_t>>& tally) {
+        tally.clear();
+        for (const auto& msg : batch) {
+            if (msg.spillSegment == 0) continue;
+            if (!tally.empty() && tally.back().first == msg.spillSegment) {
+                tally.back().second++;
+                continue;
+            }
+            auto it = find_if(tally.begin(), tally.end(),
+                [&msg](const auto& entry) { return entry.first == msg.spillSegment; });
+            if (it != tally.end()) {
+                it->second++;
+            } else {
+                tally.emplace_back(msg.spillSegment, 1);
+            }
+        }
+    }
+
+    // بعد التثبيت تُقرّ الأحداث فيُحذف المقطع المكتمل؛ بعد الفشل يُعاد المقطع لاحقاً
+    void settleSpillSegments(const vector<pair<uint64_t, size_t>>& tally, bool committed) {
+        if (!spillLog_) return;
+        for (const auto& [segmentId, count] : tally) {
+            if (committed) {
+                spillLog_->acknowledge(segmentId, count);
+            } else {
+                spillLog_->markNeedsReplay(segmentId);
+            }
+        }
+    }
+
+    void maintenanceLoop() {
+        auto nextReplay = chrono::steady_clock::now();
+        // البوتات الجديدة تبدأ عدادها من تحميل فهرسها، فلا حاجة لمطابقة فورية
+        auto nextReconcile = nextReplay + chrono::seconds(EnvironmentConfig::STATS_RECONCILE_INTERVAL_SECONDS);
+        auto nextOffsetFlush = nextReplay + chrono::seconds(EnvironmentConfig::POLLING_OFFSET_FLUSH_SECONDS);
+        
+        while (!shutdownFlag_) {
+            loadPendingSeenUsers();
+            
+            auto now = chrono::steady_clock::now();
+            updateRates(now);
+            enforceSeenIndexBudget();
+            if (now >= nextOffsetFlush) {
+                flushPollingOffsets();
+                nextOffsetFlush = now + chrono::seconds(EnvironmentConfig::POLLING_OFFSET_FLUSH_SECONDS);
+            }
+            if (spillLog_ && now >= nextReplay) {
+                replaySpillLog();
+                nextReplay = now + chrono::seconds(EnvironmentConfig::SPILL_REPLAY_INTERVAL_SECONDS);
+            }
+            
+            if (now >= nextReconcile) {
+                try {
+                    reconcileStoredUsers();
+                } catch (const exception& e) {
+                    cerr << "خطأ في مطابقة عدادات المستخدمين: " << e.what() << endl;
+                }
+                nextReconcile = now + chrono::seconds(EnvironmentConfig::STATS_RECONCILE_INTERVAL_SECONDS);
+            }
+            
+            maintenanceWakeup_.waitFor(chrono::seconds(1), [this] { return shutdownFlag_ || hasPendingSeenUsersLoads(); });
+        }
+    }
+
+    // processing_rate ومعدل أحداث كل بوت من فروق العدادات بين دورتين
+    void updateRates(chrono::steady_clock::time_point now) {
+        double seconds = chrono::duration<double>(now - lastRateUpdate_).count();
+        if (seconds < 1.0) return;
+        lastRateUpdate_ = now;
+        
+        size_t committed = replayCounters_.committedEvents.load(memory_order_relaxed);
+        for (const auto& shard : shards_) {
+            committed += shard->counters.committedEvents.load(memory_order_relaxed);
+        }
+        processingRate_ = (committed - lastCommittedEvents_) / seconds;
+        lastCommittedEvents_ = committed;
+        
+        for (BotId botId = 0; botId < registry_.size(); ++botId) {
+            BotSlot& slot = registry_.slot(botId);
+            size_t events = slot.events.load(memory_order_relaxed);
+            slot.eventRate.store((events - slot.lastEvents) / seconds, memory_order_relaxed);
+            slot.lastEvents = events;
+        }
+    }
+
+    // عند رفض نمو فهرس تُفرغ فهارس البوتات الأبرد التي تتجاوز حصتها المتساوية من الميزانية،
+    // حتى يعود ربع الحد متاحاً؛ البوت الذي لم يتجاوز حصته يحتفظ بفهرسه دائماً
+    void enforceSeenIndexBudget() {
+        SeenIndexBudget& budget = registry_.seenBudget();
+        if (!budget.takeExhausted()) return;
+        
+        size_t bots = registry_.size();
+        if (bots == 0) return;
+        size_t share = budget.limitBytes() / bots;
+        vector<BotId> candidates;
+        for (BotId botId = 0; botId < bots; ++botId) {
+            if (registry_.slot(botId).seenUsers->memoryBytes() > share) {
+                candidates.push_back(botId);
+            }
+        }
+        sort(candidates.begin(), candidates.end(), [this](BotId a, BotId b) {
+            return registry_.slot(a).eventRate.load(memory_order_relaxed) <
+                   registry_.slot(b).eventRate.load(memory_order_relaxed);
+        });
+        
+        size_t target = budget.limitBytes() - budget.limitBytes() / 4;
+        for (BotId botId : candidates) {
+            if (budget.usedBytes() <= target) break;
+            registry_.slot(botId).seenUsers->clear();
+            seenIndexEvictions_++;
+        }
+    }
+
+    // إعادة أحداث المقاطع الفاشلة أو الفائضة أو المتبقية من تشغيل سابق دفعة واحدة
+    void replaySpillLog() {
+        vector<MessageData> batch;
+        batch.reserve(EnvironmentConfig::MAX_BATCH_SIZE);
+        CoalesceIndex index;
+        
+        for (const auto& segment : spillLog_->takeReplayableSegments()) {
+            if (shutdownFlag_) return;
+            
+            // كاتب واحد (اتصال واحد من الـ pool) لكل دفعات المقطع، فلا تنافس الإعادة المعالجات
+            // على الاستعارة عند كل دفعة
+            auto writer = userStore_->openWriter();
+            bool ok = true;
+            size_t replayed = 0;
+            auto flush = [&]() {
+                size_t events = batch.size();
+                replayed += events;
+                addSingleWriter(replayCounters_.coalescedEvents, coalesceBatch(index, batch));
+                ok = writeReplayBatch(*writer, batch);
+                if (ok) addSingleWriter(replayCounters_.committedEvents, events);
+                batch.clear();
+            };
+            
+            auto read = spillLog_->readSegment(*segment, [&](int64_t telegramBotId, MessageData&& message) {
+                if (!ok) return;
+                // أحداث بوت لم يبدأ بعد في هذه العملية تحصل على معرّف لتُكتب وتُحسب كالمعتاد
+                message.botId = registry_.intern(telegramBotId);
+                if (message.botId == INVALID_BOT_ID) {
+                    cerr << "جدول البوتات ممتلئ: المقطع يبقى في سجل الفائض" << endl;
+                    ok = false;
+                    return;
+                }
+                batch.push_back(move(message));
+                if (batch.size() >= EnvironmentConfig::MAX_BATCH_SIZE) flush();
+            });
+            if (ok && !batch.empty()) flush();
+            batch.clear();
+            writer->release();
+            
+            // قاعدة البيانات ما زالت غير متاحة: المقطع يبقى ونعيد المحاولة في الدورة التالية
+            if (!ok) return;
+            
+            // ما قبل موضع التلف أُعيد؛ الملف نفسه يُعزل بدلاً من حذفه مع ما بعد التلف
+            if (read.intact) {
+                spillLog_->removeSegment(segment->id);
+            } else {
+                spillLog_->quarantineSegment(segment->id);
+            }
+            spillLog_->recordReplayed(replayed);
+        }
+    }
+
+    // بعد الفشل يُعاد اتصال الكاتب؛ الدورة التالية تفتح كاتباً جديداً
+    bool writeReplayBatch(IUserStore::Writer& writer, const vector<MessageData>& batch) {
+        try {
+            vector<uint8_t> inserted;
+            writer.upsert(batch, registry_, inserted);
+            updateBotStats(batch, inserted, replayCounters_);
+            return true;
+        } catch (const exception& e) {
+            writer.release();
+            cerr << "خطأ في إعادة أحداث سجل الفائض: " << e.what() << endl;
+            return false;
+        }
+    }
+
+    // دمج أحداث نفس (البوت، المستخدم) داخل نافذة الدفعة: آخر اسم مستخدم ومجموع الأحداث
+    static size_t coalesceBatch(CoalesceIndex& index, vector<MessageData>& batch) {
+        if (batch.size() < 2) return 0;
+        
+        index.clear();
+        size_t unique = 0;
+        
+        for (size_t i = 0; i < batch.size(); ++i) {
+            auto it = index.find(CoalesceKey{batch[i].botId, batch[i].userId});
+            if (it != index.end()) {
+                auto& kept = batch[it->second];
+                kept.username = move(batch[i].username);
+                kept.hitCount += batch[i].hitCount;
+                kept.enqueuedAt = min(kept.enqueuedAt, batch[i].enqueuedAt);
+                continue;
+            }
+            
+            if (unique != i) {
+                batch[unique] = move(batch[i]);
+            }
+            index.emplace(CoalesceKey{batch[unique].botId, batch[unique].userId}, unique);
+            ++unique;
+        }
+        
+        size_t coalesced = batch.size() - unique;
+        batch.erase(batch.begin() + unique, batch.end());
+        return coalesced;
+    }
+
+    bool processBatch(BatchShard& shard, const vector<MessageData>& batch) {
+        // كل الأحداث لمستخدمين معروفين: لا حاجة لمعاملة
+        if (batch.empty()) return true;
+        
+        try {
+            shard.writer->upsert(batch, registry_, shard.inserted);
+            updateBotStats(batch, shard.inserted, shard.counters);
+            rememberFlushedUsers(batch);
+            return true;
+            
+        } catch (const exception& e) {
+            cerr << "خطأ في معالجة الدفعة: " << e.what() << endl;
+            shard.writer->release();
+            return false;
+        }
+    }
+
+    // فهرس المستخدمين المعروفين يُحمّل في الخلفية؛ حتى يجهز تُكتب كل الأحداث
+    void scheduleSeenUsersLoad(BotId botId) {
+        {
+            lock_guard<mutex> lock(seenUsersLoadMutex_);
+            pendingSeenUsersLoads_.push_back(botId);
+        }
+        maintenanceWakeup_.notify();
+    }
+
+    bool hasPendingSeenUsersLoads() const {
+        lock_guard<mutex> lock(seenUsersLoadMutex_);
+        return !pendingSeenUsersLoads_.empty();
+    }
+
+    // التحميل بالتتابع في خيط الصيانة حتى لا تزدحم قاعدة البيانات عند بدء بوتات كثيرة
+    void loadPendingSeenUsers() {
+        for (;;) {
+            BotId botId;
+            {
+                lock_guard<mutex> lock(seenUsersLoadMutex_);
+                if (pendingSeenUsersLoads_.empty() || shutdownFlag_) return;
+                botId = pendingSeenUsersLoads_.front();
+                pendingSeenUsersLoads_.pop_front();
+            }
+            
+            BotSlot& slot = registry_.slot(botId);
+            try {
+                size_t stored = loadSeenUsers(slot.telegramId, *slot.seenUsers);
+                slot.seenUsers->markReady();
+                slot.storedUsers = static_cast<long>(stored);
+            } catch (const exception& e) {
+                // الفهرس يبقى غير جاهز فتُكتب أحداث هذا البوت كالمعتاد
+                cerr << "خطأ في تحميل فهرس المستخدمين: " << e.what() << endl;
+            }
+        }
+    }
+
+    // يعيد عدد صفوف البوت في Users، فيبدأ عداده من القيمة الفعلية دون استعلام COUNT منفصل
+    size_t loadSeenUsers(int64_t telegramId, SeenUserIndex& index) {
+        uint32_t now = SeenUserIndex::nowSeconds();
+        return userStore_->forEachUser(telegramId, [&](int64_t userId, const string& username, uint32_t age) {
+            index.markFlushed(userId, SeenUserIndex::hashUsername(username), now - min(age, now));
+        });
+    }
+
+    // العدادات التزايدية قد تنحرف (إدراج من عملية أخرى أو حذف يدوي)؛ تُصحح في خيط الصيانة فقط
+    void reconcileStoredUsers() {
+        auto counts = userStore_->countUsersByBot();
+        
+        // بوت بلا صفوف لا يظهر في GROUP BY
+        vector<long> stored(registry_.size(), 0);
+        for (const auto& [telegramId, count] : counts) {
+            BotId botId = registry_.find(telegramId);
+            if (botId < stored.size()) {
+                stored[botId] = static_cast<long>(count);
+            }
+        }
+        for (BotId botId = 0; botId < stored.size(); ++botId) {
+            registry_.slot(botId).storedUsers = stored[botId];
+        }
+    }
+
+    // إزالة أحداث المستخدمين المعروفين بنفس الاسم الذين حُدّث LastSeen لهم ضمن الدقة المحددة
+    void filterKnownUsers(vector<MessageData>& batch, IngestCounters& counters) {
+        uint32_t now = SeenUserIndex::nowSeconds();
+        uint32_t granularity = lastSeenGranularitySeconds_;
+        size_t before = batch.size();
+        
+        auto kept = remove_if(batch.begin(), batch.end(), [&](const MessageData& msg) {
+            return !registry_.slot(msg.botId).seenUsers->needsWrite(msg.userId,
+                SeenUserIndex::hashUsername(msg.username), now, granularity);
+        });
+        batch.erase(kept, batch.end());
+        
+        addSingleWriter(counters.skippedUpserts, before - batch.size());
+    }
+
+    void rememberFlushedUsers(const vector<MessageData>& batch) {
+        uint32_t now = SeenUserIndex::nowSeconds();
+        
+        for (const auto& msg : batch) {
+            registry_.slot(msg.botId).seenUsers->markFlushed(msg.userId,
+                SeenUserIndex::hashUsername(msg.username), now);
+        }
+    }
+
+    // العدادات تتغير فقط بالإدراجات الفعلية التي أبلغ عنها MERGE بعد تثبيت المعاملة
+    void updateBotStats(const vector<MessageData>& batch, const vector<uint8_t>& inserted, IngestCounters& counters) {
+        size_t total = 0;
+        for (size_t i = 0; i < batch.size(); ++i) {
+            if (!inserted[i]) continue;
+            ++total;
+            BotSlot& slot = registry_.slot(batch[i].botId);
+            slot.storedUsers.fetch_add(1, memory_order_relaxed);
+            slot.totalUsers.fetch_add(1, memory_order_relaxed);
+        }
+        
+        addSingleWriter(counters.insertedUsers, total);
+    }
+
+    shared_ptr<IDatabaseManager> dbManager_;
+    shared_ptr<IUserStore> userStore_;
+    shared_ptr<IEncryptionService> encryptor_;
+    shared_ptr<WebhookServer> webhookServer_;
+    shared_ptr<SpillLog> spillLog_;
+    shared_ptr<LongPollIngestor> poller_;
+    mutable shared_mutex botsMutex_;
+    map<string, shared_ptr<BotConfig>> activeBots_;   // يُعدّل تحت botsMutex_؛ القراء يستخدمون botTable_
+    atomic<shared_ptr<const BotTable>> botTable_{make_shared<const BotTable>()};
+    BotRegistry registry_;
+    
+    // إدارة الرسائل
+    vector<unique_ptr<BatchShard>> shards_;
+    future<void> maintenance_;
+    WakeupSignal maintenanceWakeup_;
+    
+    // إدارة المهام
+    AdmissionController admission_;
+    atomic<bool> shutdownFlag_{false};
+    
+    // الإحصائيات
+    atomic<size_t> totalBots_{0};
+    atomic<size_t> restoredBots_{0};
+    atomic<double> restoreDurationMs_{0.0};
+    atomic<double> processingRate_{0.0};
+    IngestCounters replayCounters_;    // يكتبه خيط الصيانة عند إعادة سجل الفائض
+    StripedCounter fastPathUpdates_;   // يكتبه عمال Webhook
+    StripedCounter fullParseUpdates_;
+    StripedHistogram enqueueWaitHistogram_;   // ميكروثانية داخل addMessageToQueue (يكتبه عمال Webhook)
+    struct ScrapeHistograms {
+        Histogram batchSizes, queueTimes, commitTimes, ingestLatencies, enqueueWaits;
+    };
+    mutable mutex scrapeMutex_;   // يسلسل القراء فقط؛ لا يلمسه مسار الرسائل
+    unique_ptr<ScrapeHistograms> scrapeHistograms_{make_unique<ScrapeHistograms>()};
+    chrono::steady_clock::time_point lastRateUpdate_{chrono::steady_clock::now()};   // لخيط الصيانة فقط
+    size_t lastCommittedEvents_{0};
+    
+    // الدفعات التكيفية
+    atomic<int> batchTargetLatencyMs_{EnvironmentConfig::BATCH_TARGET_LATENCY_MS};
+    atomic<int> batchMaxDelayMs_{EnvironmentConfig::BATCH_MAX_DELAY_MS};
+    atomic<size_t> batchMaxSize_{EnvironmentConfig::MAX_BATCH_SIZE};
+    atomic<uint32_t> lastSeenGranularitySeconds_{EnvironmentConfig::LAST_SEEN_GRANULARITY_SECONDS};
+    
+    // عمليات التشغيل غير المتزامنة (startBotAsync)
+    mutex lifecycleMutex_;
+    vector<future<void>> lifecycleTasks_;
+    
+    // تحميل فهارس المستخدمين المعروفين
+    mutable mutex seenUsersLoadMutex_;
+    deque<BotId> pendingSeenUsersLoads_;
+    atomic<size_t> seenIndexEvictions_{0};
+    map<string, string> configuration_;
+    mutable mutex configMutex_;
+};
+
+// =============== محرك الإذاعة ===============
+
+// جدولة بأسلوب GCRA: rate رسالة/ثانية مع سماح burst. reserve يحجز موعد الرسالة التالية
+// ويعيده، فينام كل مرسل خارج القفل حتى موعده ولا يتسابق المرسلون على رمز واحد
+class TokenBucket {
+public:
+    TokenBucket(double rate, size_t burst)
+        : interval_(chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(1.0 / max(rate, 0.001)))),
+          burstWindow_(interval_ * static_cast<long>(max<size_t>(1, burst) - 1)),
+          theoreticalArrival_(chrono::steady_clock::now()) {}
+
+    chrono::steady_clock::time_point reserve() {
+        lock_guard<mutex> lock(mutex_);
+        auto now = chrono::steady_clock::now();
+        auto due = max(now, theoreticalArrival_ - burstWindow_);
+        theoreticalArrival_ = max(theoreticalArrival_, now) + interval_;
+        return due;
+    }
+
+    // رد 429 من تيليجرام: لا رسائل قبل until مهما تراكم من سماح
+    void pauseUntil(chrono::steady_clock::time_point until) {
+        lock_guard<mutex> lock(mutex_);
+        theoreticalArrival_ = max(theoreticalArrival_, until + burstWindow_);
+    }
+
+private:
+    const chrono::steady_clock::duration interval_;
+    const chrono::steady_clock::duration burstWindow_;
+    mutex mutex_;
+    chrono::steady_clock::time_point theoreticalArrival_;
+};
+
+struct BroadcastProgress {
+    int64_t broadcastId{0};
+    int64_t botTelegramId{0};
+    string botUsername;
+    size_t sent{0};
+    size_t failed{0};        // حظر البوت، محادثة غير موجودة، أو استنفاد المحاولات
+    bool completed{false};   // false عند الإلغاء أو الإيقاف (يُستأنف من آخر نقطة حفظ)
+    string error;
+};
+
+// يرسل رسالة إلى كل مستخدمي بوت في جدول Users. المستلمون يُقرأون صفحة بعد صفحة بمؤشر
+// (BotID, UserID) على القيد الفريد، فلا تُحمّل القائمة كاملة مهما كبرت؛ الصفحة التالية تُجلب
+// أثناء إرسال الحالية. بعد كل صفحة يُحفظ آخر UserID في Broadcasts، فتُستأنف الإذاعة بعد
+// إعادة التشغيل مع تكرار ما أُرسل من صفحة واحدة على الأكثر
+class BroadcastEngine : public IMonitorable, public IShutdownable {
+public:
+    using CompletionHandler = function<void(const BroadcastProgress&)>;
+
+    BroadcastEngine(shared_ptr<IDatabaseManager> db, shared_ptr<IEncryptionService> encryptor,
+                    shared_ptr<IBotManager> botManager,
+                    double ratePerSecond = EnvironmentConfig::BROADCAST_RATE_PER_SECOND,
+                    size_t senders = EnvironmentConfig::BROADCAST_SENDERS,
+                    size_t pageSize = EnvironmentConfig::BROADCAST_PAGE_SIZE)
+        : dbManager_(db), encryptor_(encryptor), botManager_(botManager),
+          ratePerSecond_(max(ratePerSecond, 1.0)), senders_(max<size_t>(1, senders)),
+          pageSize_(max<size_t>(1, pageSize)) {}
+
+    ~BroadcastEngine() override {
+        shutdown();
+    }
+
+    // يعيد معرّف الإذاعة؛ يرمي إذا لم يكن البوت يعمل أو لديه إذاعة جارية
+    int64_t start(int64_t botTelegramId, const string& text, CompletionHandler onDone = nullptr) {
+        if (shutdownFlag_) {
+            throw runtime_error("النظام قيد الإيقاف");
+        }
+        if (text.empty() || utf8Length(text) > MAX_MESSAGE_CHARS) {
+            throw invalid_argument("نص الرسالة فارغ أو أطول من 4096 حرفاً");
+        }
+        auto bot = findBot(botTelegramId);
+        if (!bot) {
+            throw runtime_error("البوت غير نشط");
+        }
+        
+        auto job = make_shared<Job>();
+        job->progress.botTelegramId = botTelegramId;
+        job->progress.botUsername = bot->username;
+        job->text = text;
+        if (!claimBot(botTelegramId, job)) {
+            throw runtime_error("توجد إذاعة جارية لهذا البوت");
+        }
+        
+        try {
+            job->progress.broadcastId = insertBroadcast(botTelegramId, text);
+        } catch (...) {
+            releaseBot(botTelegramId);
+            throw;
+        }
+        launch(job, bot->encryptedToken, move(onDone));
+        return job->progress.broadcastId;
+    }
+
+    // الإذاعات غير المكتملة في الجدول تُستأنف لبوتاتها النشطة بعد استعادة البوتات
+    size_t resumePending() {
+        vector<shared_ptr<Job>> pending;
+        try {
+            pending = loadPendingBroadcasts();
+        } catch (const exception& e) {
+            cerr << "❌ خطأ في تحميل الإذاعات المعلقة: " << e.what() << endl;
+            return 0;
+        }
+        
+        size_t resumed = 0;
+        for (auto& job : pending) {
+            auto bot = findBot(job->progress.botTelegramId);
+            if (!bot || !claimBot(job->progress.botTelegramId, job)) continue;
+            job->progress.botUsername = bot->username;
+            launch(job, bot->encryptedToken, nullptr);
+            resumed++;
+        }
+        if (resumed > 0) {
+            cout << "📢 استئناف " << resumed << " إذاعة معلقة" << endl;
+        }
+        return resumed;
+    }
+
+    bool cancel(int64_t botTelegramId) {
+        lock_guard<mutex> lock(jobsMutex_);
+        auto it = activeJobs_.find(botTelegramId);
+        if (it == activeJobs_.end()) return false;
+        it->second->cancelled = true;
+        return true;
+    }
+
+    void collectMetrics(MetricSink& sink) const override {
+        {
+            lock_guard<mutex> lock(jobsMutex_);
+            sink.gauge("active_broadcasts", static_cast<double>(activeJobs_.size()));
+        }
+        sink.gauge("broadcast_rate_limit", ratePerSecond_);
+        sink.gauge("broadcast_messages_sent", static_cast<double>(messagesSent_.load()));
+        sink.gauge("broadcast_messages_failed", static_cast<double>(messagesFailed_.load()));
+        sink.gauge("broadcast_retries", static_cast<double>(retries_.load()));
+        sink.gauge("broadcast_rate_limited", static_cast<double>(rateLimited_.load()));
+        sink.gauge("broadcasts_completed", static_cast<double>(broadcastsCompleted_));
+        
+        lock_guard<mutex> lock(scrapeMutex_);
+        scrapeSendTimes_->clear();
+        sendTimes_.mergeInto(*scrapeSendTimes_);
+        sink.gauge("broadcast_send_ms_p50", scrapeSendTimes_->percentile(50) / 1000.0);
+        sink.gauge("broadcast_send_ms_p99", scrapeSendTimes_->percentile(99) / 1000.0);
+    }
+
+    bool isHealthy() const override {
+        return !shutdownFlag_;
+    }
+
+    string getStatus() const override {
+        return shutdownFlag_ ? "shutdown" : "running";
+    }
+
+    // الإذاعات الجارية تتوقف عند أول صفحة وتبقى 'running' في الجدول لتُستأنف بعد الإقلاع
+    void shutdown() override {
+        if (shutdownFlag_.exchange(true)) return;
+        
+        vector<future<void>> tasks;
+        {
+            lock_guard<mutex> lock(jobsMutex_);
+            tasks.swap(tasks_);
+        }
+        for (auto& task : tasks) {
+            task.wait();
+        }
+    }
+
+    bool isShutdown() const override {
+        return shutdownFlag_;
+    }
+
+private:
+    struct Job {
+        BroadcastProgress progress;
+        string text;
+        int64_t cursor{0};   // آخر UserID أُرسل إليه بالكامل (نقطة الحفظ)
+        atomic<bool> cancelled{false};
+    };
+
+    enum class SendOutcome { Sent, Failed, Stopped };
+
+    static constexpr size_t MAX_MESSAGE_CHARS = 4096;
+
+    static size_t utf8Length(const string& text) {
+        return count_if(text.begin(), text.end(), [](unsigned char c) { return (c & 0xC0) != 0x80; });
+    }
+
+    shared_ptr<BotConfig> findBot(int64_t botTelegramId) const {
+        auto table = botManager_->getActiveBots();
+        for (const auto& bot : *table) {
+            if (bot->telegramId == botTelegramId) return bot;
+        }
+        return nullptr;
+    }
+
+    // إذاعة واحدة لكل بوت: حد تيليجرام العام لكل توكن، فإذاعتان متوازيتان تتقاسمانه
+    bool claimBot(int64_t botTelegramId, const shared_ptr<Job>& job) {
+        lock_guard<mutex> lock(jobsMutex_);
+        return activeJobs_.emplace(botTelegramId, job).second;
+    }
+
+    void releaseBot(int64_t botTelegramId) {
+        lock_guard<mutex> lock(jobsMutex_);
+        activeJobs_.erase(botTelegramId);
+    }
+
+    void launch(shared_ptr<Job> job, const string& encryptedToken, CompletionHandler onDone) {
+        lock_guard<mutex> lock(jobsMutex_);
+        erase_if(tasks_, [](const future<void>& task) {
+            return task.wait_for(chrono::seconds(0)) == future_status::ready;
+        });
+        tasks_.push_back(async(launch::async, [this, job, encryptedToken, onDone = move(onDone)]() {
+            runBroadcast(*job, encryptedToken);
+            releaseBot(job->progress.botTelegramId);
+            if (!onDone) return;
+            try {
+                onDone(job->progress);
+            } catch (const exception& e) {
+                cerr << "خطأ في معالج نتيجة الإذاعة: " << e.what() << endl;
+            }
+        }));
+    }
+
+    void runBroadcast(Job& job, const string& encryptedToken) {
+        auto& progress = job.progress;
+        try {
+            auto bot = makeBot(encryptor_->decrypt(encryptedToken));
+            TokenBucket bucket(ratePerSecond_, EnvironmentConfig::BROADCAST_BURST);
+            
+            vector<int64_t> page = fetchRecipients(progress.botTelegramId, job.cursor);
+            while (!page.empty() && !stopped(job)) {
+                // الصفحة الأخيرة أقصر من pageSize_ فلا حاجة لجلب ما بعدها
+                future<vector<int64_t>> nextPage;
+                if (page.size() == pageSize_) {
+                    nextPage = async(launch::async, [this, &progress, after = page.back()]() {
+                        return fetchRecipients(progress.botTelegramId, after);
+                    });
+                }
+                
+                // الصفحة الموقوفة تتقدم حتى آخر مستلم اكتمل ما قبله، فلا يُعاد عدّه عند الاستئناف
+                size_t done = sendPage(job, bot->getApi(), bucket, page);
+                if (done > 0) {
+                    job.cursor = page[done - 1];
+                    checkpoint(job, "running");
+                }
+                bool pageCompleted = done == page.size();
+                
+                page = nextPage.valid() ? nextPage.get() : vector<int64_t>{};
+                if (!pageCompleted) break;
+            }
+            
+            if (job.cancelled) {
+                checkpoint(job, "cancelled");
+            } else if (!shutdownFlag_) {
+                progress.completed = true;
+                checkpoint(job, "done");
+                broadcastsCompleted_++;
+            }
+        } catch (const exception& e) {
+            progress.error = e.what();
+            cerr << "❌ خطأ في الإذاعة #" << progress.broadcastId << ": " << e.what() << endl;
+        }
+    }
+
+    bool stopped(const Job& job) const {
+        return shutdownFlag_ || job.cancelled;
+    }
+
+    // المرسلون يتقاسمون الصفحة بفهرس ذري؛ عددهم يغطي زمن رحلة sendMessage عند المعدل المطلوب.
+    // يعيد طول البادئة المكتملة من الصفحة، ولا يُحتسب في التقدم إلا ما فيها: ما بعدها يُعاد
+    // إرساله بعد الاستئناف من المؤشر
+    size_t sendPage(Job& job, const Api& api, TokenBucket& bucket, const vector<int64_t>& page) {
+        atomic<size_t> next{0};
+        vector<SendOutcome> outcomes(page.size(), SendOutcome::Stopped);
+        vector<future<void>> workers;
+        size_t workerCount = min(senders_, page.size());
+        workers.reserve(workerCount);
+        for (size_t i = 0; i < workerCount; ++i) {
+            workers.push_back(async(launch::async, [&]() {
+                for (size_t index = next++; index < page.size(); index = next++) {
+                    outcomes[index] = sendOne(job, api, bucket, page[index]);
+                    if (outcomes[index] == SendOutcome::Stopped) return;
+                }
+            }));
+        }
+        for (auto& worker : workers) {
+            worker.wait();
+        }
+        
+        size_t done = 0;
+        for (; done < outcomes.size() && outcomes[done] != SendOutcome::Stopped; ++done) {
+            (outcomes[done] == SendOutcome::Sent ? job.progress.sent : job.progress.failed)++;
+        }
+        return done;
+    }
+
+    SendOutcome sendOne(const Job& job, const Api& api, TokenBucket& bucket, int64_t chatId) {
+        for (int attempt = 0; attempt < EnvironmentConfig::BROADCAST_MAX_ATTEMPTS; ++attempt) {
+            auto due = bucket.reserve();
+            if (!sleepUntil(job, due)) return SendOutcome::Stopped;
+            
+            auto started = chrono::steady_clock::now();
+            try {
+                api.sendMessage(chatId, job.text, true);
+                sendTimes_.record(static_cast<uint64_t>(chrono::duration_cast<chrono::microseconds>(
+                    chrono::steady_clock::now() - started).count()));
+                messagesSent_.add();
+                return SendOutcome::Sent;
+            } catch (const TgException& e) {
+                int code = static_cast<int>(e.errorCode);
+                if (code == 429) {
+                    // الحد العام تجاوزناه: كل المرسلين يتوقفون حتى retry_after
+                    rateLimited_.add();
+                    bucket.pauseUntil(chrono::steady_clock::now() + retryAfter(e.what()));
+                } else if (code == 400 || code == 403) {
+                    // المستخدم حظر البوت أو حذف حسابه؛ إعادة المحاولة لا تفيد
+                    messagesFailed_.add();
+                    return SendOutcome::Failed;
+                }
+            } catch (const exception&) {
+                // خطأ شبكي: يُعاد بعد مهلة المحادثة
+            }
+            
+            retries_.add();
+            // تيليجرام يسمح برسالة واحدة في الثانية لكل محادثة
+            if (!sleepUntil(job, chrono::steady_clock::now() +
+                            chrono::milliseconds(EnvironmentConfig::BROADCAST_CHAT_INTERVAL_MS))) {
+                return SendOutcome::Stopped;
+            }
+        }
+        messagesFailed_.add();
+        return SendOutcome::Failed;
+    }
+
+    // نوم قابل للمقاطعة بالإلغاء أو الإيقاف؛ retry_after قد يبلغ دقائق
+    bool sleepUntil(const Job& job, chrono::steady_clock::time_point due) const {
+        while (!stopped(job)) {
+            auto now = chrono::steady_clock::now();
+            if (now >= due) return true;
+            this_thread::sleep_for(min<chrono::steady_clock::duration>(due - now, chrono::milliseconds(200)));
+        }
+        return false;
+    }
+
+    // "Too Many Requests: retry after 35"
+    static chrono::seconds retryAfter(const string& description) {
+        static const string marker = "retry after ";
+        size_t pos = description.find(marker);
+        long seconds = 1;
+        if (pos != string::npos) {
+            const char* begin = description.data() + pos + marker.size();
+            from_chars(begin, description.data() + description.size(), seconds);
+        }
+        return chrono::seconds(clamp(seconds, 1L, 3600L));
+    }
+
+    vector<int64_t> fetchRecipients(int64_t botTelegramId, int64_t afterUserId) {
+        vector<int64_t> recipients;
+        recipients.reserve(pageSize_);
+        int pageSize = static_cast<int>(pageSize_);
+        
+        auto conn = dbManager_->getConnection();
+        try {
+            statement& stmt = dbManager_->getPreparedStatement(*conn, "broadcast_recipients",
+                "SELECT TOP (?) UserID FROM Users WHERE BotID = ? AND UserID > ? ORDER BY UserID");
+            stmt.bind(0, &pageSize);
+            stmt.bind(1, &botTelegramId);
+            stmt.bind(2, &afterUserId);
+            result rows = stmt.execute();
+            while (rows.next()) {
+                recipients.push_back(rows.get<int64_t>(0));
+            }
+        } catch (...) {
+            dbManager_->releaseConnection(move(conn));
+            throw;
+        }
+        dbManager_->releaseConnection(move(conn));
+        return recipients;
+    }
+
+    int64_t insertBroadcast(int64_t botTelegramId, const string& text) {
+        int64_t broadcastId = 0;
+        auto conn = dbManager_->getConnection();
+        try {
+            statement& stmt = dbManager_->getPreparedStatement(*conn, "insert_broadcast",
+                "INSERT INTO Broadcasts (BotID, Text, LastUserID, Sent, Failed, Status, CreatedAt, UpdatedAt) "
+                "OUTPUT INSERTED.BroadcastID "
+                "VALUES (?, ?, 0, 0, 0, 'running', GETDATE(), GETDATE())");
+            stmt.bind(0, &botTelegramId);
+            stmt.bind(1, text.c_str());
+            result rows = stmt.execute();
+            if (rows.next()) {
+                broadcastId = rows.get<int64_t>(0);
+            }
+        } catch (...) {
+            dbManager_->releaseConnection(move(conn));
+            throw;
+        }
+        dbManager_->releaseConnection(move(conn));
+        return broadcastId;
+    }
+
+    vector<shared_ptr<Job>> loadPendingBroadcasts() {
+        vector<shared_ptr<Job>> jobs;
+        auto conn = dbManager_->getConnection();
+        try {
+            result rows = execute(*conn,
+                "SELECT BroadcastID, BotID, Text, LastUserID, Sent, Failed FROM Broadcasts WHERE Status = 'running'");
+            while (rows.next()) {
+                auto job = make_shared<Job>();
+                job->progress.broadcastId = rows.get<int64_t>(0);
+                job->progress.botTelegramId = rows.get<int64_t>(1);
+                job->text = rows.get<string>(2);
+                job->cursor = rows.get<int64_t>(3);
+                job->progress.sent = static_cast<size_t>(rows.get<int>(4));
+                job->progress.failed = static_cast<size_t>(rows.get<int>(5));
+                jobs.push_back(move(job));
+            }
+        } catch (...) {
+            dbManager_->releaseConnection(move(conn));
+            throw;
+        }
+        dbManager_->releaseConnection(move(conn));
+        return jobs;
+    }
+
+    // فشل الحفظ لا يوقف الإذاعة؛ أسوأ الحالات إعادة إرسال صفحات أكثر بعد الاستئناف
+    void checkpoint(const Job& job, const string& status) {
+        int sent = static_cast<int>(job.progress.sent);
+        int failed = static_cast<int>(job.progress.failed);
+        try {
+            auto conn = dbManager_->getConnection();
+            try {
+                statement& stmt = dbManager_->getPreparedStatement(*conn, "checkpoint_broadcast",
+                    "UPDATE Broadcasts SET LastUserID = ?, Sent = ?, Failed = ?, Status = ?, UpdatedAt = GETDATE() "
+                    "WHERE BroadcastID = ?");
+                stmt.bind(0, &job.cursor);
+                stmt.bind(1, &sent);
+                stmt.bind(2, &failed);
+                stmt.bind(3, status.c_str());
+                stmt.bind(4, &job.progress.broadcastId);
+                stmt.execute();
+            } catch (...) {
+                dbManager_->releaseConnection(move(conn));
+                throw;
+            }
+            dbManager_->releaseConnection(move(conn));
+        } catch (const exception& e) {
+            cerr << "تحذير: فشل في حفظ تقدم الإذاعة #" << job.progress.broadcastId << ": " << e.what() << endl;
+        }
+    }
+
+    shared_ptr<IDatabaseManager> dbManager_;
+    shared_ptr<IEncryptionService> encryptor_;
+    shared_ptr<IBotManager> botManager_;
+    const double ratePerSecond_;
+    const size_t senders_;
+    const size_t pageSize_;
+    atomic<bool> shutdownFlag_{false};
+    
+    mutable mutex jobsMutex_;
+    map<int64_t, shared_ptr<Job>> activeJobs_;   // BotID في تيليجرام -> الإذاعة الجارية
+    vector<future<void>> tasks_;
+    
+    // الإحصائيات
+    StripedCounter messagesSent_;
+    StripedCounter messagesFailed_;
+    StripedCounter retries_;
+    StripedCounter rateLimited_;
+    atomic<size_t> broadcastsCompleted_{0};
+    StripedHistogram sendTimes_;   // ميكروثانية لكل sendMessage ناجح
+    mutable mutex scrapeMutex_;
+    unique_ptr<Histogram> scrapeSendTimes_{make_unique<Histogram>()};
+};
+
+// =============== تصدير المستخدمين ===============
+
+// نتيجة تصدير (أو تقدمه)؛ rowsPerSecond محسوبة من بدء التصدير
+struct ExportResult {
+    string path;
+    size_t rows{0};
+    uint64_t bytes{0};
+    double seconds{0.0};
+    double rowsPerSecond{0.0};
+};
+
+// يصدّر صفوف بوت من Users إلى ملف عمودي مضغوط. القراءة والترميز خيطان بينهما طابور محدود
+// بـ EXPORT_QUEUE_PAGES صفحة، فالذاكرة ثابتة مهما بلغ عدد الصفوف.
+//
+// الصيغة (كل الأعداد varint بدون إشارة، و zz = zigzag):
+//   "SBEX" | version | BotID
+//   كتلة: rows | UserID: الأول مطلق ثم الفروق | FirstSeen: zz(فرق عن السطر السابق)
+//         | LastSeen: zz(فرق عن FirstSeen) | أطوال Username | بايتات Username | CRC32 للكتلة
+//   النهاية: rows = 0 ثم عدد الصفوف الكلي
+// الأوقات ثوانٍ منذ 1970. UserID مرتب تصاعدياً فالفروق صغيرة، والكتل مستقلة عن بعضها.
+class UserExporter : public IMonitorable, public IShutdownable {
+public:
+    using CompletionHandler = function<void(const ExportResult&, const string& error)>;
+
+    static constexpr char MAGIC[4] = {'S', 'B', 'E', 'X'};
+    static constexpr uint8_t FORMAT_VERSION = 1;
+    static constexpr size_t MAX_CHUNK_ROWS = 1 << 20;       // حماية فك الترميز من ملف تالف
+    static constexpr size_t MAX_USERNAME_BYTES = 1024;
+
+    explicit UserExporter(shared_ptr<IDatabaseManager> db, size_t pageRows = EnvironmentConfig::EXPORT_PAGE_ROWS)
+        : dbManager_(db), pageRows_(max<size_t>(1, pageRows)) {}
+
+    ~UserExporter() override {
+        shutdown();
+    }
+
+    // يكتب إلى path.part ثم يعيد تسميته، فلا يبقى ملف ناقص باسم نهائي؛ عند الإلغاء يُحذف path.part
+    ExportResult exportUsers(int64_t botTelegramId, const filesystem::path& path,
+                             const function<void(const ExportResult&)>& onProgress = nullptr) {
+        auto started = chrono::steady_clock::now();
+        ExportResult progress;
+        progress.path = path.string();
+        filesystem::path partial = path;
+        partial += ".part";
+        
+        ofstream out(partial, ios::binary | ios::trunc);
+        if (!out) {
+            throw runtime_error("لا يمكن إنشاء ملف التصدير: " + partial.string());
+        }
+        
+        PageQueue queue(EnvironmentConfig::EXPORT_QUEUE_PAGES);
+        auto reader = async(launch::async, [this, &queue, botTelegramId]() {
+            readPages(botTelegramId, queue);
+        });
+        
+        try {
+            string buffer;
+            buffer.append(MAGIC, sizeof(MAGIC));
+            buffer.push_back(static_cast<char>(FORMAT_VERSION));
+            putVarint(buffer, static_cast<uint64_t>(botTelegramId));
+            
+            // القارئ يتوقف أيضاً عند الإلغاء، فنهاية الطابور وحدها لا تعني اكتمال الصفوف
+            auto throwIfCancelled = [this]() {
+                if (cancelled_) {
+                    throw runtime_error("أُلغي التصدير لإيقاف النظام");
+                }
+            };
+            vector<ExportRow> page;
+            while (queue.pop(page)) {
+                throwIfCancelled();
+                encodeChunk(page, buffer);
+                out.write(buffer.data(), static_cast<streamsize>(buffer.size()));
+                progress.bytes += buffer.size();
+                progress.rows += page.size();
+                buffer.clear();
+                
+                progress.seconds = secondsSince(started);
+                progress.rowsPerSecond = progress.seconds > 0 ? progress.rows / progress.seconds : 0.0;
+                if (onProgress) onProgress(progress);
+            }
+            
+            throwIfCancelled();
+            
+            putVarint(buffer, 0);
+            putVarint(buffer, progress.rows);
+            out.write(buffer.data(), static_cast<streamsize>(buffer.size()));
+            progress.bytes += buffer.size();
+            out.close();
+            if (!out) {
+                throw runtime_error("فشل في الكتابة إلى ملف التصدير");
+            }
+        } catch (...) {
+            queue.close();
+            reader.wait();
+            filesystem::remove(partial);
+            throw;
+        }
+        
+        try {
+            reader.get();   // يعيد رمي خطأ قاعدة البيانات إن توقفت القراءة قبل النهاية
+        } catch (...) {
+            filesystem::remove(partial);
+            throw;
+        }
+        filesystem::rename(partial, path);
+        
+        progress.seconds = secondsSince(started);
+        progress.rowsPerSecond = progress.seconds > 0 ? progress.rows / progress.seconds : 0.0;
+        exportsCompleted_++;
+        rowsExported_ += progress.rows;
+        bytesWritten_ += progress.bytes;
+        lastRowsPerSecond_ = progress.rowsPerSecond;
+        return progress;
+    }
+
+    // للوحة التحكم: التصدير قد يستغرق دقائق لبوت بملايين المستخدمين
+    void exportAsync(int64_t botTelegramId, const filesystem::path& path, CompletionHandler onDone) {
+        lock_guard<mutex> lock(tasksMutex_);
+        if (shutdownFlag_) {
+            throw runtime_error("النظام قيد الإيقاف");
+        }
+        erase_if(tasks_, [](const future<void>& task) {
+            return task.wait_for(chrono::seconds(0)) == future_status::ready;
+        });
+        tasks_.push_back(async(launch::async, [this, botTelegramId, path, onDone = move(onDone)]() {
+            ExportResult outcome;
+            string error;
+            activeExports_++;
+            try {
+                outcome = exportUsers(botTelegramId, path);
+            } catch (const exception& e) {
+                error = e.what();
+                exportFailures_++;
+                cerr << "❌ خطأ في تصدير مستخدمي البوت " << botTelegramId << ": " << error << endl;
+            }
+            activeExports_--;
+            if (!onDone) return;
+            try {
+                onDone(outcome, error);
+            } catch (const exception& e) {
+                cerr << "خطأ في معالج نتيجة التصدير: " << e.what() << endl;
+            }
+        }));
+    }
+
+    // يحوّل ملف تصدير إلى CSV كتلة بعد كتلة؛ يعيد عدد الصفوف ويرمي عند تلف الملف
+    static size_t decodeToCsv(istream& in, ostream& out) {
+        char header[sizeof(MAGIC) + 1];
+        if (!in.read(header, sizeof(header)) || memcmp(header, MAGIC, sizeof(MAGIC)) != 0 ||
+            static_cast<uint8_t>(header[sizeof(MAGIC)]) != FORMAT_VERSION) {
+            throw runtime_error("ليس ملف تصدير صالحاً");
+        }
+        uint64_t botId = readVarint(in);
+        
+        out << "bot_id,user_id,username,first_seen,last_seen\n";
+        size_t total = 0;
+        vector<ExportRow> rows;
+        while (size_t count = readVarint(in)) {
+            if (count > MAX_CHUNK_ROWS) {
+                throw runtime_error("ملف التصدير تالف");
+            }
+            decodeChunk(in, count, rows);
+            for (const auto& row : rows) {
+                out << botId << ',' << row.userId << ',' << csvField(row.username) << ','
+                    << row.firstSeen << ',' << row.lastSeen << '\n';
+            }
+            total += count;
+        }
+        if (readVarint(in) != total) {
+            throw runtime_error("ملف التصدير ناقص");
+        }
+        return total;
+    }
+
+    void collectMetrics(MetricSink& sink) const override {
+        sink.gauge("active_exports", static_cast<double>(activeExports_));
+        sink.gauge("exports_completed", static_cast<double>(exportsCompleted_));
+        sink.gauge("export_failures", static_cast<double>(exportFailures_));
+        sink.gauge("export_rows", static_cast<double>(rowsExported_));
+        sink.gauge("export_bytes", static_cast<double>(bytesWritten_));
+        sink.gauge("export_rows_per_second_last", lastRowsPerSecond_.load());
+    }
+
+    bool isHealthy() const override {
+        return !shutdownFlag_;
+    }
+
+    string getStatus() const override {
+        return shutdownFlag_ ? "shutdown" : "running";
+    }
+
+    // التصديرات الجارية تتوقف عند الصفحة التالية؛ الانتظار لا يتجاوز استعلام صفحة واحدة
+    void shutdown() override {
+        vector<future<void>> tasks;
+        {
+            lock_guard<mutex> lock(tasksMutex_);
+            if (shutdownFlag_) return;
+            shutdownFlag_ = true;
+            cancelled_ = true;
+            tasks.swap(tasks_);
+        }
+        for (auto& task : tasks) {
+            task.wait();
+        }
+    }
+
+    bool isShutdown() const override {
+        return shutdownFlag_;
+    }
+
+private:
+    struct ExportRow {
+        int64_t userId{0};
+        int64_t firstSeen{0};
+        int64_t lastSeen{0};
+        string username;
+    };
+
+    // طابور صفحات محدود بين القارئ والكاتب؛ close يوقف الطرفين
+    class PageQueue {
+    public:
+        explicit PageQueue(size_t capacity) : capacity_(max<size_t>(1, capacity)) {}
+
+        bool push(vector<ExportRow> page) {
+            unique_lock<mutex> lock(mutex_);
+            notFull_.wait(lock, [this] { return pages_.size() < capacity_ || closed_; });
+            if (closed_) return false;
+            pages_.push_back(move(page));
+            notEmpty_.notify_one();
+            return true;
+        }
+
+        bool pop(vector<ExportRow>& page) {
+            unique_lock<mutex> lock(mutex_);
+            notEmpty_.wait(lock, [this] { return !pages_.empty() || closed_; });
+            if (pages_.empty()) return false;
+            page = move(pages_.front());
+            pages_.pop_front();
+            notFull_.notify_one();
+            return true;
+        }
+
+        void close() {
+            lock_guard<mutex> lock(mutex_);
+            closed_ = true;
+            notEmpty_.notify_all();
+            notFull_.notify_all();
+        }
 
-    size_t getActiveBotsCount() const override {
-        shared_lock<shared_mutex> lock(botsMutex_);
-        return activeBots_.size();
-    }
+    private:
+        const size_t capacity_;
+        mutex mutex_;
+        condition_variable notEmpty_;
+        condition_variable notFull_;
+        deque<vector<ExportRow>> pages_;
+        bool closed_{false};
+    };
 
-private:
-    void runBotInstance(const BotConfig& config) {
+    // نفس مؤشر (BotID, UserID) المستخدم في الإذاعة؛ كل صفحة اتصال مستعار لمدة استعلام واحد
+    void readPages(int64_t botTelegramId, PageQueue& queue) {
         try {
-            string token = encryptor_->decrypt(config.encryptedToken);
-            Bot bot(token);
-            
-            setupBotHandlers(bot, config);
-            
-            string webhookUrl = getenv("WEBHOOK_URL") ?: "https://your-domain.com/webhook";
-            string webhookPath = "/" + config.encryptedToken;
-            
-            TgWebhook webhook(bot, webhookUrl + webhookPath);
-            
-            config.initBarrier->arrive_and_wait();
-            webhook.start();
-            
-        } catch (const exception& e) {
-            cerr << "خطأ في تشغيل البوت: " << e.what() << endl;
-            config.initBarrier->arrive_and_wait();
+            int64_t cursor = 0;
+            while (!cancelled_) {
+                vector<ExportRow> page = fetchPage(botTelegramId, cursor);
+                if (page.empty()) break;
+                bool last = page.size() < pageRows_;
+                cursor = page.back().userId;
+                if (!queue.push(move(page)) || last) break;
+            }
+        } catch (...) {
+            queue.close();
+            throw;
         }
+        queue.close();
     }
 
-    void setupBotHandlers(Bot& bot, const BotConfig& config) {
-        bot.getEvents().onAnyMessage([this, &config](Message::Ptr message) {
-            if (!config.isActive) return;
-            
-            string username = message->from->username;
-            if (username.empty()) {
-                username = "user_" + to_string(message->from->id);
-            }
-            
-            addMessageToQueue(config.encryptedToken, message->from->id, username);
-        });
-
-        bot.getEvents().onCommand("start", [this, &config](Message::Ptr message) {
-            if (!config.isActive) return;
-            
-            string username = message->from->username;
-            if (username.empty()) {
-                username = "user_" + to_string(message->from->id);
+    vector<ExportRow> fetchPage(int64_t botTelegramId, int64_t afterUserId) {
+        vector<ExportRow> page;
+        page.reserve(pageRows_);
+        int pageRows = static_cast<int>(pageRows_);
+        
+        auto conn = dbManager_->getConnection();
+        try {
+            statement& stmt = dbManager_->getPreparedStatement(*conn, "export_users",
+                "SELECT TOP (?) UserID, Username, "
+                "DATEDIFF_BIG(SECOND, '19700101', FirstSeen), DATEDIFF_BIG(SECOND, '19700101', LastSeen) "
+                "FROM Users WHERE BotID = ? AND UserID > ? ORDER BY UserID");
+            stmt.bind(0, &pageRows);
+            stmt.bind(1, &botTelegramId);
+            stmt.bind(2, &afterUserId);
+            result rows = stmt.execute();
+            while (rows.next()) {
+                ExportRow& row = page.emplace_back();
+                row.userId = rows.get<int64_t>(0);
+                row.username = rows.get<string>(1, "");
+                row.firstSeen = rows.get<int64_t>(2);
+                row.lastSeen = rows.get<int64_t>(3);
             }
-            
-            addMessageToQueue(config.encryptedToken, message->from->id, username);
-        });
+        } catch (...) {
+            dbManager_->releaseConnection(move(conn));
+            throw;
+        }
+        dbManager_->releaseConnection(move(conn));
+        return page;
     }
 
-    void addMessageToQueue(const string& encryptedToken, int64_t userId, const string& username) {
-        taskSemaphore_.acquire();
+    static void encodeChunk(const vector<ExportRow>& rows, string& out) {
+        size_t start = out.size();
+        putVarint(out, rows.size());
         
-        {
-            lock_guard<mutex> lock(messageQueueMutex_);
-            messageQueue_.push({encryptedToken, userId, username});
+        int64_t previousUser = 0;
+        for (const auto& row : rows) {
+            putVarint(out, static_cast<uint64_t>(row.userId - previousUser));
+            previousUser = row.userId;
+        }
+        int64_t previousFirstSeen = 0;
+        for (const auto& row : rows) {
+            putVarint(out, zigzag(row.firstSeen - previousFirstSeen));
+            previousFirstSeen = row.firstSeen;
+        }
+        for (const auto& row : rows) {
+            putVarint(out, zigzag(row.lastSeen - row.firstSeen));
+        }
+        for (const auto& row : rows) {
+            putVarint(out, row.username.size());
+        }
+        for (const auto& row : rows) {
+            out += row.username;
         }
         
-        messageQueueCV_.notify_one();
+        uint32_t crc = checksum(out.data() + start, out.size() - start);
+        out.append(reinterpret_cast<const char*>(&crc), sizeof(crc));
     }
 
-    void batchProcessorLoop() {
-        vector<MessageData> batch;
-        batch.reserve(EnvironmentConfig::BATCH_SIZE);
+    // count قُرئ بالفعل؛ يُعاد ترميزه لحساب CRC على بايتات الكتلة كما كُتبت
+    static void decodeChunk(istream& in, size_t count, vector<ExportRow>& rows) {
+        string raw;
+        putVarint(raw, count);
+        auto next = [&in, &raw]() {
+            uint64_t value = readVarint(in);
+            putVarint(raw, value);
+            return value;
+        };
         
-        while (!shutdownFlag_) {
-            {
-                unique_lock<mutex> lock(messageQueueMutex_);
-                messageQueueCV_.wait_for(lock, chrono::seconds(5), 
-                    [this] { return !messageQueue_.empty() || shutdownFlag_; });
-                
-                while (!messageQueue_.empty() && batch.size() < EnvironmentConfig::BATCH_SIZE) {
-                    batch.push_back(messageQueue_.front());
-                    messageQueue_.pop();
-                }
+        rows.assign(count, ExportRow{});
+        int64_t previousUser = 0;
+        for (auto& row : rows) {
+            row.userId = previousUser + static_cast<int64_t>(next());
+            previousUser = row.userId;
+        }
+        int64_t previousFirstSeen = 0;
+        for (auto& row : rows) {
+            row.firstSeen = previousFirstSeen + unzigzag(next());
+            previousFirstSeen = row.firstSeen;
+        }
+        for (auto& row : rows) {
+            row.lastSeen = row.firstSeen + unzigzag(next());
+        }
+        for (auto& row : rows) {
+            uint64_t length = next();
+            if (length > MAX_USERNAME_BYTES) {
+                throw runtime_error("ملف التصدير تالف");
             }
-            
-            if (!batch.empty()) {
-                processBatch(batch);
-                batch.clear();
+            row.username.resize(length);
+        }
+        for (auto& row : rows) {
+            if (!in.read(row.username.data(), static_cast<streamsize>(row.username.size()))) {
+                throw runtime_error("ملف التصدير ناقص");
             }
+            raw += row.username;
+        }
+        
+        uint32_t crc = 0;
+        if (!in.read(reinterpret_cast<char*>(&crc), sizeof(crc)) || crc != checksum(raw.data(), raw.size())) {
+            throw runtime_error("فشل التحقق من CRC لكتلة في ملف التصدير");
         }
     }
 
-    void processBatch(const vector<MessageData>& batch) {
-        try {
-            dbManager_->executeTransaction([this, &batch](connection& conn) {
-                processBatchInTransaction(conn, batch);
-            });
-            
-            updateBotStats(batch);
-            
-        } catch (const exception& e) {
-            cerr << "خطأ في معالجة الدفعة: " << e.what() << endl;
+    static void putVarint(string& out, uint64_t value) {
+        while (value >= 0x80) {
+            out.push_back(static_cast<char>(value | 0x80));
+            value >>= 7;
         }
+        out.push_back(static_cast<char>(value));
     }
 
-    void processBatchInTransaction(connection& conn, const vector<MessageData>& batch) {
-        for (const auto& msg : batch) {
-            updateUserRecords(conn, msg.encryptedToken, msg.userId, msg.username);
+    static uint64_t readVarint(istream& in) {
+        uint64_t value = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            int byte = in.get();
+            if (byte == EOF) {
+                throw runtime_error("ملف التصدير ناقص");
+            }
+            value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+            if (!(byte & 0x80)) return value;
         }
+        throw runtime_error("ملف التصدير تالف");
     }
 
-    void updateUserRecords(connection& conn, const string& botToken, 
-                          int64_t userId, const string& username) {
-        try {
-            statement stmt(conn);
-            stmt.prepare("MERGE INTO Users AS target "
-                        "USING (SELECT ? as BotToken, ? as UserID, ? as Username) AS source "
-                        "ON target.BotToken = source.BotToken AND target.UserID = source.UserID "
-                        "WHEN MATCHED THEN "
-                        "  UPDATE SET Username = source.Username, LastSeen = GETDATE() "
-                        "WHEN NOT MATCHED THEN "
-                        "  INSERT (BotToken, UserID, Username, FirstSeen, LastSeen) "
-                        "  VALUES (source.BotToken, source.UserID, source.Username, GETDATE(), GETDATE())");
-            
-            stmt.bind(0, botToken.c_str());
-            stmt.bind(1, userId);
-            stmt.bind(2, username.c_str());
-            stmt.execute();
-            
-        } catch (const exception& e) {
-            cerr << "خطأ في تحديث سجل المستخدم: " << e.what() << endl;
-        }
+    static uint64_t zigzag(int64_t value) {
+        return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
     }
 
-    void updateBotStats(const vector<MessageData>& batch) {
-        shared_lock<shared_mutex> lock(botsMutex_);
-        
-        for (const auto& msg : batch) {
-            auto it = activeBots_.find(msg.encryptedToken);
-            if (it != activeBots_.end()) {
-                it->second.totalUsers++;
-            }
+    static int64_t unzigzag(uint64_t value) {
+        return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+    }
+
+    static string csvField(const string& value) {
+        if (value.find_first_of(",\"\n\r") == string::npos) return value;
+        string quoted = "\"";
+        for (char c : value) {
+            if (c == '"') quoted += '"';
+            quoted += c;
         }
+        return quoted + "\"";
     }
 
-    struct MessageData {
-        string encryptedToken;
-        int64_t userId;
-        string username;
-    };
+    static uint32_t checksum(const char* data, size_t size) {
+        boost::crc_32_type crc;
+        crc.process_bytes(data, size);
+        return crc.checksum();
+    }
+
+    static double secondsSince(chrono::steady_clock::time_point started) {
+        return chrono::duration<double>(chrono::steady_clock::now() - started).count();
+    }
 
     shared_ptr<IDatabaseManager> dbManager_;
-    shared_ptr<IEncryptionService> encryptor_;
-    mutable shared_mutex botsMutex_;
-    map<string, BotConfig> activeBots_;
-    
-    // إدارة الرسائل
-    mutex messageQueueMutex_;
-    condition_variable messageQueueCV_;
-    queue<MessageData> messageQueue_;
-    future<void> batchProcessor_;
-    
-    // إدارة المهام
-    counting_semaphore<EnvironmentConfig::MAX_CONCURRENT_TASKS> taskSemaphore_;
+    const size_t pageRows_;
     atomic<bool> shutdownFlag_{false};
+    atomic<bool> cancelled_{false};   // يُفحص بين الصفحات في القارئ والكاتب
+    mutex tasksMutex_;
+    vector<future<void>> tasks_;
     
     // الإحصائيات
-    atomic<size_t> totalBots_{0};
-    atomic<double> processingRate_{0.0};
-    map<string, string> configuration_;
-    mutable mutex configMutex_;
+    atomic<size_t> activeExports_{0};
+    atomic<size_t> exportsCompleted_{0};
+    atomic<size_t> exportFailures_{0};
+    atomic<size_t> rowsExported_{0};
+    atomic<uint64_t> bytesWritten_{0};
+    atomic<double> lastRowsPerSecond_{0.0};
 };
 
 // =============== واجهة التحكم المحسنة ===============
@@ -819,18 +6495,42 @@ class ControlPanel : public IConfigurable, public IMonitorable, public IShutdown
 public:
     ControlPanel(shared_ptr<IBotManager> botManager, 
                 shared_ptr<IEncryptionService> encryptor,
+                shared_ptr<WebhookServer> webhookServer,
+                shared_ptr<BroadcastEngine> broadcasts,
+                shared_ptr<UserExporter> exporter,
+                shared_ptr<LongPollIngestor> poller,
                 const string& managerToken)
-        : botManager_(botManager), encryptor_(encryptor),
-          managerBot_(make_unique<Bot>(managerToken)) {}
+        : botManager_(botManager), encryptor_(encryptor), webhookServer_(webhookServer),
+          broadcasts_(broadcasts), exporter_(exporter), poller_(poller), managerBot_(makeBot(managerToken)) {}
+
+    ~ControlPanel() {
+        shutdown();
+    }
 
     void start() {
         setupHandlers();
+        updateWorker_ = thread(&ControlPanel::updateWorkerLoop, this);
         runEventLoop();
     }
 
+    // admin_chat_ids: معرّفات محادثات مفصولة بفواصل؛ بدونها تُرفض الإذاعة والتصدير للجميع
     void configure(const map<string, string>& config) override {
+        set<int64_t> admins;
+        if (auto it = config.find("admin_chat_ids"); it != config.end()) {
+            stringstream ids(it->second);
+            string id;
+            while (getline(ids, id, ',')) {
+                try {
+                    if (id.find_first_not_of(" \t") != string::npos) admins.insert(stoll(id));
+                } catch (const exception&) {
+                    cerr << "تحذير: معرّف محادثة مسؤول غير صالح: " << id << endl;
+                }
+            }
+        }
+        
         lock_guard<mutex> lock(configMutex_);
         configuration_ = config;
+        adminChatIds_ = move(admins);
     }
 
     map<string, string> getConfiguration() const override {
@@ -838,11 +6538,10 @@ public:
         return configuration_;
     }
 
-    map<string, double> getMetrics() const override {
-        return {
-            {"manager_bot_status", managerBot_ ? 1.0 : 0.0},
-            {"total_commands_processed", static_cast<double>(commandsProcessed_)}
-        };
+    void collectMetrics(MetricSink& sink) const override {
+        sink.gauge("manager_bot_status", managerBot_ ? 1.0 : 0.0);
+        sink.gauge("denied_admin_commands", static_cast<double>(deniedCommands_));
+        sink.gauge("total_commands_processed", static_cast<double>(commandsProcessed_));
     }
 
     bool isHealthy() const override {
@@ -855,7 +6554,18 @@ public:
     }
 
     void shutdown() override {
-        shutdownFlag_ = true;
+        {
+            lock_guard<mutex> lock(updatesMutex_);
+            shutdownFlag_ = true;
+        }
+        updatesCV_.notify_all();
+        if (updateWorker_.joinable()) {
+            updateWorker_.join();
+        }
+        
+        // ينتظر معالج نتيجة جارياً، وما يصل بعده من الإذاعة أو التصدير أو إضافة بوت يُتجاهل
+        lock_guard<mutex> lock(lifetime_->handlerMutex);
+        lifetime_->alive = false;
     }
 
     bool isShutdown() const override {
@@ -863,6 +6573,17 @@ public:
     }
 
 private:
+    // المحركات تعيش أطول من اللوحة وتستدعي معالجات النتيجة من خيوطها
+    struct Lifetime {
+        mutex handlerMutex;
+        bool alive{true};
+    };
+
+    static void ifAlive(const shared_ptr<Lifetime>& lifetime, const function<void()>& handler) {
+        lock_guard<mutex> lock(lifetime->handlerMutex);
+        if (lifetime->alive) handler();
+    }
+
     void setupHandlers() {
         managerBot_->getEvents().onCommand("start", [this](Message::Ptr message) {
             sendMainMenu(message->chat->id);
@@ -877,16 +6598,77 @@ private:
         });
     }
 
+    // بوت المدير مسار آخر في خادم Webhook المشترك، أو بوت آخر لدى عمال السحب؛ ينتظر هنا حتى إغلاق الخادم
     void runEventLoop() {
         try {
+            if (poller_) {
+                const string& token = managerBot_->getToken();
+                managerBot_->getApi().deleteWebhook();
+                poller_->addBot(telegramBotIdFromToken(token), token, 0,
+                    [this](string_view response, int64_t& offset) { return handlePolledUpdates(response, offset); },
+                    false);
+                webhookServer_->wait();
+                return;
+            }
+            
             string webhookUrl = getenv("MANAGER_WEBHOOK_URL") ?: "https://your-domain.com/manager";
-            TgWebhook webhook(*managerBot_, webhookUrl);
-            webhook.start();
+            webhookServer_->registerRoute(WebhookServer::urlPath(webhookUrl), [this](const string& body) {
+                return queueUpdate(body) ? 200 : 503;
+            });
+            managerBot_->getApi().setWebhook(webhookUrl);
+            webhookServer_->wait();
         } catch (const exception& e) {
             cerr << "خطأ في بوت المدير: " << e.what() << endl;
         }
     }
 
+    // عامل السحب يمرر الأوامر فقط؛ المعالجات ترسل رسائل حاجبة فتُنفذ على عامل اللوحة.
+    // عند امتلاء الطابور تتوقف الإزاحة ويُعاد سحب الباقي لاحقاً
+    LongPollIngestor::BatchOutcome handlePolledUpdates(string_view response, int64_t& offset) {
+        LongPollIngestor::BatchOutcome outcome;
+        outcome.valid = UpdateScanner::scanUpdates(response, [&](string_view body, int64_t updateId) {
+            if (!outcome.complete) return;
+            if (!queueUpdate(string(body))) {
+                outcome.complete = false;
+                return;
+            }
+            offset = updateId + 1;
+            outcome.updates++;
+        });
+        return outcome;
+    }
+
+    bool queueUpdate(string body) {
+        {
+            lock_guard<mutex> lock(updatesMutex_);
+            if (shutdownFlag_ || pendingUpdates_.size() >= MAX_PENDING_UPDATES) return false;
+            pendingUpdates_.push_back(move(body));
+        }
+        updatesCV_.notify_one();
+        return true;
+    }
+
+    // الأوامر تُنفذ بترتيب وصولها؛ خطأ في أمر واحد لا يوقف بقية الأوامر
+    void updateWorkerLoop() {
+        while (true) {
+            string body;
+            {
+                unique_lock<mutex> lock(updatesMutex_);
+                updatesCV_.wait(lock, [this] { return shutdownFlag_ || !pendingUpdates_.empty(); });
+                if (pendingUpdates_.empty()) return;
+                body = move(pendingUpdates_.front());
+                pendingUpdates_.pop_front();
+            }
+            
+            try {
+                TgTypeParser parser;
+                managerBot_->getEventHandler().handleUpdate(parser.parseJsonAndGetUpdate(parser.parseJson(body)));
+            } catch (const exception& e) {
+                cerr << "خطأ في بوت المدير: " << e.what() << endl;
+            }
+        }
+    }
+
     void sendMainMenu(int64_t chatId) {
         auto keyboard = make_shared<InlineKeyboardMarkup>();
         
@@ -908,7 +6690,17 @@ private:
         statsBtn->callbackData = "stats";
         row2.push_back(statsBtn);
 
-        keyboard->inlineKeyboard = {row0, row1, row2};
+        vector<InlineKeyboardButton::Ptr> row3;
+        auto broadcastBtn = make_shared<InlineKeyboardButton>();
+        broadcastBtn->text = "📢 إذاعة";
+        broadcastBtn->callbackData = "broadcast";
+        row3.push_back(broadcastBtn);
+        auto exportBtn = make_shared<InlineKeyboardButton>();
+        exportBtn->text = "📤 تصدير المستخدمين";
+        exportBtn->callbackData = "export";
+        row3.push_back(exportBtn);
+
+        keyboard->inlineKeyboard = {row0, row1, row2, row3};
         
         managerBot_->getApi().sendMessage(chatId, 
             "مرحبًا بك في نظام إدارة بوتات التخزين\n\n"
@@ -916,45 +6708,169 @@ private:
             false, 0, keyboard);
     }
 
+    bool isAdmin(int64_t chatId) const {
+        lock_guard<mutex> lock(configMutex_);
+        return adminChatIds_.contains(chatId);
+    }
+
+    // الإذاعة والتصدير يصلان إلى كل مستخدمي البوت، فلا تُنفذ إلا من محادثات ADMIN_CHAT_IDS
+    bool requireAdmin(int64_t chatId) {
+        if (isAdmin(chatId)) return true;
+        deniedCommands_++;
+        managerBot_->getApi().sendMessage(chatId, "⛔ هذا الإجراء متاح للمسؤولين فقط");
+        return false;
+    }
+
+    static bool isAdminAction(const string& data) {
+        return data == "broadcast" || data.starts_with("broadcast:") || data.starts_with("broadcast_cancel:") ||
+               data == "export" || data.starts_with("export:");
+    }
+
     void handleCallback(CallbackQuery::Ptr query) {
         const string& data = query->data;
         commandsProcessed_++;
         
+        if (isAdminAction(data) && !requireAdmin(query->message->chat->id)) return;
+        
         if (data == "add_bot") {
             managerBot_->getApi().sendMessage(query->message->chat->id, 
                 "أرسل توكن البوت الجديد:");
         } else if (data == "stats") {
             showStats(query);
+        } else if (data == "broadcast") {
+            showBotPicker(query->message->chat->id, "broadcast", "اختر البوت الذي تُرسل الإذاعة إلى مستخدميه:");
+        } else if (data.starts_with("broadcast:")) {
+            int64_t chatId = query->message->chat->id;
+            {
+                lock_guard<mutex> lock(pendingBroadcastsMutex_);
+                pendingBroadcasts_[chatId] = stoll(data.substr(data.find(':') + 1));
+            }
+            managerBot_->getApi().sendMessage(chatId, "أرسل نص رسالة الإذاعة:");
+        } else if (data.starts_with("broadcast_cancel:")) {
+            bool cancelled = broadcasts_->cancel(stoll(data.substr(data.find(':') + 1)));
+            managerBot_->getApi().sendMessage(query->message->chat->id,
+                cancelled ? "⏹ جارٍ إيقاف الإذاعة..." : "لا توجد إذاعة جارية لهذا البوت");
+        } else if (data == "export") {
+            showBotPicker(query->message->chat->id, "export", "اختر البوت الذي تُصدَّر قائمة مستخدميه:");
+        } else if (data.starts_with("export:")) {
+            startExport(query->message->chat->id, stoll(data.substr(data.find(':') + 1)));
+        }
+    }
+
+    // زر لكل بوت نشط؛ callbackData = action:BotID
+    void showBotPicker(int64_t chatId, const string& action, const string& prompt) {
+        auto keyboard = make_shared<InlineKeyboardMarkup>();
+        auto bots = botManager_->getActiveBots();
+        for (size_t i = 0; i < min(bots->size(), MAX_STATS_BOTS); ++i) {
+            const auto& bot = (*bots)[i];
+            auto button = make_shared<InlineKeyboardButton>();
+            button->text = "@" + bot->username;
+            button->callbackData = action + ":" + to_string(bot->telegramId);
+            keyboard->inlineKeyboard.push_back({button});
+        }
+        
+        managerBot_->getApi().sendMessage(chatId, bots->empty() ? "لا توجد بوتات نشطة" : prompt,
+            false, 0, keyboard);
+    }
+
+    // الملف يُرسل كمستند إن لم يتجاوز حد الرفع، وإلا يبقى في EXPORT_DIR
+    void startExport(int64_t chatId, int64_t botTelegramId) {
+        const char* dir = getenv("EXPORT_DIR");
+        filesystem::path directory = dir && *dir ? dir : "exports";
+        string fileName = "users_" + to_string(botTelegramId) + "_" +
+            to_string(chrono::duration_cast<chrono::seconds>(chrono::system_clock::now().time_since_epoch()).count()) +
+            ".sbex";
+        
+        try {
+            filesystem::create_directories(directory);
+            exporter_->exportAsync(botTelegramId, directory / fileName,
+                [this, lifetime = lifetime_, chatId](const ExportResult& outcome, const string& error) {
+                    ifAlive(lifetime, [&] {
+                        if (!error.empty()) {
+                            managerBot_->getApi().sendMessage(chatId, "❌ فشل التصدير: " + error);
+                            return;
+                        }
+                        string summary = "✅ تم تصدير " + to_string(outcome.rows) + " مستخدم (" +
+                            to_string(outcome.bytes / 1024) + " KB، " +
+                            to_string(static_cast<long>(outcome.rowsPerSecond)) + " صف/ث)";
+                        if (outcome.bytes > EnvironmentConfig::EXPORT_MAX_UPLOAD_BYTES) {
+                            managerBot_->getApi().sendMessage(chatId, summary + "\n📁 الملف أكبر من حد الرفع: " + outcome.path);
+                            return;
+                        }
+                        managerBot_->getApi().sendMessage(chatId, summary);
+                        managerBot_->getApi().sendDocument(chatId,
+                            InputFile::fromFile(outcome.path, "application/octet-stream"));
+                    });
+                });
+            managerBot_->getApi().sendMessage(chatId, "⏳ جارٍ التصدير...");
+        } catch (const exception& e) {
+            managerBot_->getApi().sendMessage(chatId, "❌ فشل في بدء التصدير: " + string(e.what()));
+        }
+    }
+
+    // الرسالة التالية بعد اختيار البوت هي نص الإذاعة
+    bool handleBroadcastText(Message::Ptr message) {
+        int64_t chatId = message->chat->id;
+        int64_t botTelegramId = 0;
+        {
+            lock_guard<mutex> lock(pendingBroadcastsMutex_);
+            auto it = pendingBroadcasts_.find(chatId);
+            if (it == pendingBroadcasts_.end()) return false;
+            botTelegramId = it->second;
+            pendingBroadcasts_.erase(it);
+        }
+        // قد تُزال المحادثة من القائمة بين اختيار البوت وإرسال النص
+        if (!requireAdmin(chatId)) return true;
+        
+        try {
+            int64_t broadcastId = broadcasts_->start(botTelegramId, message->text,
+                [this, lifetime = lifetime_, chatId](const BroadcastProgress& progress) {
+                    ifAlive(lifetime, [&] {
+                        string summary = progress.completed ? "✅ اكتملت الإذاعة #" : "⏹ توقفت الإذاعة #";
+                        summary += to_string(progress.broadcastId) + " عبر @" + progress.botUsername + "\n";
+                        summary += "📨 أُرسلت: " + to_string(progress.sent) + "\n";
+                        summary += "🚫 فشلت: " + to_string(progress.failed);
+                        if (!progress.error.empty()) summary += "\n❌ " + progress.error;
+                        managerBot_->getApi().sendMessage(chatId, summary);
+                    });
+                });
+            
+            auto keyboard = make_shared<InlineKeyboardMarkup>();
+            auto cancelBtn = make_shared<InlineKeyboardButton>();
+            cancelBtn->text = "⏹ إيقاف";
+            cancelBtn->callbackData = "broadcast_cancel:" + to_string(botTelegramId);
+            keyboard->inlineKeyboard = {{cancelBtn}};
+            managerBot_->getApi().sendMessage(chatId, "📢 بدأت الإذاعة #" + to_string(broadcastId),
+                false, 0, keyboard);
+        } catch (const exception& e) {
+            managerBot_->getApi().sendMessage(chatId, "❌ فشل في بدء الإذاعة: " + string(e.what()));
         }
+        return true;
     }
 
     void handleTextMessage(Message::Ptr message) {
         commandsProcessed_++;
         
+        if (handleBroadcastText(message)) return;
+        
         if (message->text.find("bot") != string::npos) {
             string token = message->text;
             
             try {
-                Bot testBot(token);
-                auto me = testBot.getApi().getMe();
-                if (!me) {
-                    managerBot_->getApi().sendMessage(message->chat->id, "❌ توكن البوت غير صالح");
-                    return;
-                }
-                
                 BotConfig config;
                 config.token = token;
-                config.name = me->firstName;
-                config.username = me->username;
                 config.encryptedToken = encryptor_->encrypt(token);
                 
-                if (botManager_->startBot(config)) {
-                    managerBot_->getApi().sendMessage(message->chat->id, 
-                        "✅ تم إضافة البوت بنجاح: " + config.name);
-                } else {
-                    managerBot_->getApi().sendMessage(message->chat->id, 
-                        "❌ فشل في إضافة البوت");
-                }
+                // التحقق وتسجيل Webhook يستغرقان ثوانٍ؛ لا يُحجز عامل الخادم حتى تنتهي
+                int64_t chatId = message->chat->id;
+                managerBot_->getApi().sendMessage(chatId, "⏳ جارٍ التحقق من البوت...");
+                botManager_->startBotAsync(config, [this, lifetime = lifetime_, chatId](const BotLaunchResult& outcome) {
+                    ifAlive(lifetime, [&] {
+                        managerBot_->getApi().sendMessage(chatId, outcome.started
+                            ? "✅ تم إضافة البوت بنجاح: " + outcome.name
+                            : "❌ فشل في إضافة البوت: " + outcome.error);
+                    });
+                });
                 
             } catch (const exception& e) {
                 managerBot_->getApi().sendMessage(message->chat->id, 
@@ -969,16 +6885,50 @@ private:
         stats += "🔢 البوتات النشطة: " + to_string(static_cast<int>(metrics["active_bots"])) + "\n";
         stats += "📈 معدل المعالجة: " + to_string(metrics["processing_rate"]) + "\n";
         stats += "📋 حجم الطابور: " + to_string(static_cast<int>(metrics["queue_size"])) + "\n";
+        stats += "⏱ زمن التثبيت p99: " + to_string(metrics["ingest_latency_ms_p99"]) + " ms\n";
+        stats += "👥 المستخدمون المخزنون: " + to_string(static_cast<long>(metrics["stored_users"])) + "\n";
+        
+        // العدادات من الذاكرة فلا يُفحص جدول Users عند كل طلب
+        auto bots = botManager_->getBotStats();
+        sort(bots.begin(), bots.end(), [](const BotStats& a, const BotStats& b) {
+            return a.storedUsers > b.storedUsers;
+        });
+        if (!bots.empty()) stats += "\n";
+        for (size_t i = 0; i < min(bots.size(), MAX_STATS_BOTS); ++i) {
+            const auto& bot = bots[i];
+            stats += (bot.isActive ? "🟢 @" : "⏸ @") + bot.username + ": " +
+                     to_string(bot.storedUsers) + " مستخدم (+" + to_string(bot.newUsers) + " جديد، " +
+                     to_string(static_cast<long>(bot.eventRate)) + " حدث/ث)\n";
+        }
+        if (bots.size() > MAX_STATS_BOTS) {
+            stats += "… و" + to_string(bots.size() - MAX_STATS_BOTS) + " بوتات أخرى\n";
+        }
         
         managerBot_->getApi().sendMessage(query->message->chat->id, stats);
     }
 
+    static constexpr size_t MAX_STATS_BOTS = 20;   // رسالة تيليجرام محدودة بـ 4096 حرفاً
+    static constexpr size_t MAX_PENDING_UPDATES = 256;
+
     shared_ptr<IBotManager> botManager_;
     shared_ptr<IEncryptionService> encryptor_;
+    shared_ptr<WebhookServer> webhookServer_;
+    shared_ptr<BroadcastEngine> broadcasts_;
+    shared_ptr<UserExporter> exporter_;
+    shared_ptr<LongPollIngestor> poller_;   // nullptr في وضع Webhook
     unique_ptr<Bot> managerBot_;
+    mutex pendingBroadcastsMutex_;
+    map<int64_t, int64_t> pendingBroadcasts_;   // محادثة المدير -> البوت المختار للإذاعة
     atomic<size_t> commandsProcessed_{0};
     map<string, string> configuration_;
+    set<int64_t> adminChatIds_;   // فارغة = لا مسؤولين
+    atomic<size_t> deniedCommands_{0};
     mutable mutex configMutex_;
+    mutex updatesMutex_;
+    condition_variable updatesCV_;
+    deque<string> pendingUpdates_;   // تحديثات بوت المدير بانتظار عامل اللوحة
+    thread updateWorker_;
+    shared_ptr<Lifetime> lifetime_{make_shared<Lifetime>()};
     atomic<bool> shutdownFlag_{false};
 };
 
@@ -991,27 +6941,55 @@ public:
             db.executeTransaction([](connection& conn) {
                 statement stmt(conn);
                 
-                // إنشاء جدول المستخدمين
+                // إنشاء جدول المستخدمين (BotID = معرّف البوت في تيليجرام)
                 stmt.prepare("IF NOT EXISTS (SELECT * FROM sysobjects WHERE name='Users' AND xtype='U') "
                            "CREATE TABLE Users ("
                            "ID INT IDENTITY(1,1) PRIMARY KEY, "
-                           "BotToken NVARCHAR(255) NOT NULL, "
+                           "BotID BIGINT NOT NULL, "
                            "UserID BIGINT NOT NULL, "
                            "Username NVARCHAR(100) NOT NULL, "
                            "FirstSeen DATETIME NOT NULL, "
                            "LastSeen DATETIME NOT NULL, "
-                           "UNIQUE(BotToken, UserID))");
-                stmt.execute();
-                
-                // إنشاء فهارس لتحسين الأداء
-                stmt.prepare("IF NOT EXISTS (SELECT * FROM sys.indexes WHERE name='IX_Users_BotToken') "
-                           "CREATE INDEX IX_Users_BotToken ON Users(BotToken)");
+                           "CONSTRAINT UQ_Users_BotID_UserID UNIQUE(BotID, UserID))");
                 stmt.execute();
                 
+                // إنشاء فهارس لتحسين الأداء (القيد الفريد يغطي البحث حسب البوت)
                 stmt.prepare("IF NOT EXISTS (SELECT * FROM sys.indexes WHERE name='IX_Users_UserID') "
                            "CREATE INDEX IX_Users_UserID ON Users(UserID)");
                 stmt.execute();
                 
+                // البوتات المضافة تُستعاد منه عند الإقلاع (BotID = معرّف البوت في تيليجرام)
+                stmt.prepare("IF NOT EXISTS (SELECT * FROM sysobjects WHERE name='Bots' AND xtype='U') "
+                           "CREATE TABLE Bots ("
+                           "BotID BIGINT PRIMARY KEY, "
+                           "EncryptedToken NVARCHAR(512) NOT NULL, "
+                           "Name NVARCHAR(100) NOT NULL, "
+                           "Username NVARCHAR(100) NOT NULL, "
+                           "IsActive BIT NOT NULL, "
+                           "CreatedAt DATETIME NOT NULL, "
+                           "UpdatedAt DATETIME NOT NULL, "
+                           "UpdateOffset BIGINT NOT NULL DEFAULT 0)");
+                stmt.execute();
+                
+                // جداول Bots الأقدم من وضع السحب
+                stmt.prepare("IF COL_LENGTH('Bots', 'UpdateOffset') IS NULL "
+                           "ALTER TABLE Bots ADD UpdateOffset BIGINT NOT NULL DEFAULT 0");
+                stmt.execute();
+                
+                // الإذاعات ونقاط حفظها: LastUserID آخر مستلم في آخر صفحة اكتملت
+                stmt.prepare("IF NOT EXISTS (SELECT * FROM sysobjects WHERE name='Broadcasts' AND xtype='U') "
+                           "CREATE TABLE Broadcasts ("
+                           "BroadcastID BIGINT IDENTITY(1,1) PRIMARY KEY, "
+                           "BotID BIGINT NOT NULL, "
+                           "Text NVARCHAR(MAX) NOT NULL, "
+                           "LastUserID BIGINT NOT NULL, "
+                           "Sent INT NOT NULL, "
+                           "Failed INT NOT NULL, "
+                           "Status NVARCHAR(16) NOT NULL, "
+                           "CreatedAt DATETIME NOT NULL, "
+                           "UpdatedAt DATETIME NOT NULL)");
+                stmt.execute();
+                
             });
             
             cout << "✅ تم تهيئة قاعدة البيانات بنجاح" << endl;
@@ -1022,6 +7000,180 @@ public:
         }
     }
 
+    // الجداول القديمة مفتاحها BotToken المشفر (NVARCHAR(255)، ويختلف مع كل تشفير لنفس البوت).
+    // يُستبدل بـ BotID المستخرج من التوكن بعد فك تشفيره، ثم يُحذف العمود القديم.
+    static void migrateUsersToBotId(IDatabaseManager& db, IEncryptionService& encryptor) {
+        try {
+            db.executeTransaction([&encryptor](connection& conn) {
+                // النتائج تُقرأ في نطاق منفصل حتى تُغلق قبل العبارة التالية على نفس الاتصال
+                {
+                    result legacy = execute(conn, "SELECT COL_LENGTH('Users', 'BotToken')");
+                    if (!legacy.next() || legacy.is_null(0)) return;
+                }
+                
+                cout << "🔄 ترحيل جدول Users إلى BotID..." << endl;
+                execute(conn, "IF COL_LENGTH('Users', 'BotID') IS NULL ALTER TABLE Users ADD BotID BIGINT NULL");
+                
+                vector<string> tokens;
+                {
+                    result rows = execute(conn, "SELECT DISTINCT BotToken FROM Users WHERE BotID IS NULL");
+                    while (rows.next()) {
+                        tokens.push_back(rows.get<string>(0));
+                    }
+                }
+                
+                statement update(conn);
+                update.prepare("UPDATE Users SET BotID = ? WHERE BotToken = ? AND BotID IS NULL");
+                for (const auto& encryptedToken : tokens) {
+                    int64_t botId;
+                    try {
+                        botId = telegramBotIdFromToken(encryptor.decrypt(encryptedToken));
+                    } catch (const exception& e) {
+                        cerr << "تحذير: تعذر ترحيل صفوف توكن: " << e.what() << endl;
+                        continue;
+                    }
+                    update.bind(0, &botId);
+                    update.bind(1, encryptedToken.c_str());
+                    update.execute();
+                }
+                
+                // نفس البوت أُضيف أكثر من مرة بتشفير مختلف: صف واحد لكل مستخدم بأقدم FirstSeen وأحدث LastSeen
+                execute(conn,
+                    "UPDATE u SET FirstSeen = m.FirstSeen FROM Users u "
+                    "JOIN (SELECT BotID, UserID, MIN(FirstSeen) AS FirstSeen FROM Users "
+                    "      WHERE BotID IS NOT NULL GROUP BY BotID, UserID HAVING COUNT(*) > 1) m "
+                    "ON u.BotID = m.BotID AND u.UserID = m.UserID");
+                execute(conn,
+                    "WITH ranked AS (SELECT ROW_NUMBER() OVER (PARTITION BY BotID, UserID "
+                    "  ORDER BY LastSeen DESC, ID DESC) AS Rank FROM Users WHERE BotID IS NOT NULL) "
+                    "DELETE FROM ranked WHERE Rank > 1");
+                
+                // صفوف لم يُفك توكنها تأخذ معرّفاً سالباً فريداً: لا تطابق أي بوت ولا تكسر القيد الفريد
+                execute(conn, "UPDATE Users SET BotID = -ID WHERE BotID IS NULL");
+                
+                execute(conn,
+                    "DECLARE @name sysname = (SELECT TOP 1 kc.name FROM sys.key_constraints kc "
+                    "  JOIN sys.index_columns ic ON ic.object_id = kc.parent_object_id AND ic.index_id = kc.unique_index_id "
+                    "  JOIN sys.columns c ON c.object_id = ic.object_id AND c.column_id = ic.column_id "
+                    "  WHERE kc.parent_object_id = OBJECT_ID('Users') AND kc.type = 'UQ' AND c.name = 'BotToken'); "
+                    "IF @name IS NOT NULL EXEC('ALTER TABLE Users DROP CONSTRAINT ' + QUOTENAME(@name))");
+                execute(conn, "IF EXISTS (SELECT * FROM sys.indexes WHERE name='IX_Users_BotToken') "
+                              "DROP INDEX IX_Users_BotToken ON Users");
+                execute(conn, "ALTER TABLE Users DROP COLUMN BotToken");
+                execute(conn, "ALTER TABLE Users ALTER COLUMN BotID BIGINT NOT NULL");
+                execute(conn, "ALTER TABLE Users ADD CONSTRAINT UQ_Users_BotID_UserID UNIQUE(BotID, UserID)");
+                
+                cout << "✅ تم ترحيل " << tokens.size() << " توكن إلى BotID" << endl;
+            });
+        } catch (const exception& e) {
+            cerr << "❌ خطأ في ترحيل جدول Users: " << e.what() << endl;
+            throw;
+        }
+    }
+
+    static size_t getEnvSize(const char* name, size_t fallback) {
+        const char* value = getenv(name);
+        if (!value || !*value) return fallback;
+        try {
+            return stoul(value);
+        } catch (...) {
+            cerr << "تحذير: قيمة غير صالحة لمتغير البيئة " << name << endl;
+            return fallback;
+        }
+    }
+
+    // إعدادات مدير البوتات من متغيرات البيئة (المفاتيح غير المحددة تبقى على قيمها الافتراضية)
+    static map<string, string> loadBotManagerConfig() {
+        static const pair<const char*, const char*> envKeys[] = {
+            {"OVERLOAD_POLICY", "overload_policy"},
+            {"ADMISSION_TIMEOUT_MS", "admission_timeout_ms"},
+            {"BATCH_SIZE", "batch_max_size"},
+            {"BATCH_TARGET_LATENCY_MS", "batch_target_latency_ms"},
+            {"BATCH_MAX_DELAY_MS", "batch_max_delay_ms"},
+            {"LAST_SEEN_GRANULARITY_SECONDS", "last_seen_granularity_s"}
+        };
+        
+        map<string, string> config;
+        for (const auto& [envName, key] : envKeys) {
+            if (const char* value = getenv(envName)) {
+                config[key] = value;
+            }
+        }
+        return config;
+    }
+
+    static map<string, string> loadControlPanelConfig() {
+        map<string, string> config;
+        if (const char* value = getenv("ADMIN_CHAT_IDS")) {
+            config["admin_chat_ids"] = value;
+        } else {
+            cerr << "تحذير: ADMIN_CHAT_IDS غير محدد؛ الإذاعة والتصدير معطلان من بوت المدير" << endl;
+        }
+        return config;
+    }
+
+    // SPILL_DIR فارغ يعطل السجل
+    static shared_ptr<SpillLog> createSpillLog() {
+        const char* dir = getenv("SPILL_DIR");
+        string directory = dir ? dir : "spill";
+        if (directory.empty()) {
+            cerr << "تحذير: سجل الفائض معطل؛ الأحداث المعلقة لن تنجو من إعادة التشغيل" << endl;
+            return nullptr;
+        }
+        return make_shared<SpillLog>(directory);
+    }
+
+    static string databaseConnectionString() {
+        const char* dbServer = getenv("DB_SERVER") ?: "localhost";
+        const char* dbName = getenv("DB_NAME") ?: "TelegramBots";
+        const char* dbUser = getenv("DB_USER") ?: "sa";
+        const char* dbPass = getenv("DB_PASS") ?: "password";
+        
+        return "Driver={ODBC Driver 17 for SQL Server};"
+               "Server=" + string(dbServer) + ";"
+               "Database=" + string(dbName) + ";"
+               "UID=" + string(dbUser) + ";"
+               "PWD=" + string(dbPass) + ";"
+               "TrustServerCertificate=yes;";
+    }
+
+    // أوامر سطر الأوامر: تعمل دون بوت المدير أو Webhook، وتعيد nullopt لغير المعروف منها
+    static optional<int> runCommand(int argc, char* argv[]) {
+        string command = argv[1];
+        try {
+            if (command == "--export" && argc == 4) {
+                auto db = make_shared<DatabaseManager>(databaseConnectionString(), 2, 1);
+                UserExporter exporter(db, getEnvSize("EXPORT_PAGE_ROWS", EnvironmentConfig::EXPORT_PAGE_ROWS));
+                auto outcome = exporter.exportUsers(stoll(argv[2]), argv[3], [](const ExportResult& progress) {
+                    cerr << "\r📤 " << progress.rows << " صف، " << static_cast<long>(progress.rowsPerSecond)
+                         << " صف/ث" << flush;
+                });
+                cerr << endl;
+                cout << "✅ " << outcome.rows << " صف، " << outcome.bytes << " بايت خلال "
+                     << outcome.seconds << " ث (" << static_cast<long>(outcome.rowsPerSecond) << " صف/ث) -> "
+                     << outcome.path << endl;
+                return 0;
+            }
+            if (command == "--decode" && argc == 3) {
+                ifstream in(argv[2], ios::binary);
+                if (!in) {
+                    throw runtime_error("لا يمكن فتح " + string(argv[2]));
+                }
+                UserExporter::decodeToCsv(in, cout);
+                return 0;
+            }
+        } catch (const exception& e) {
+            cerr << "❌ " << e.what() << endl;
+            return 1;
+        }
+        
+        if (command == "--export" || command == "--decode") {
+            cerr << "الاستخدام: " << argv[0] << " --export <bot_id> <file> | --decode <file>" << endl;
+            return 1;
+        }
+        return nullopt;
+    }
+
     static shared_ptr<IEncryptionService> createEncryptionService() {
         return make_shared<EncryptionService>();
     }
@@ -1054,13 +7206,28 @@ public:
 
 // =============== الدالة الرئيسية المحسنة ===============
 
-int main() {
+// benchmark/ingest_benchmark.cpp يضم هذا الملف ويعرّف main الخاصة به
+#ifndef STORAGE_BOT_NO_MAIN
+int main(int argc, char* argv[]) {
+    if (argc > 1) {
+        if (auto status = SystemInitializer::runCommand(argc, argv)) {
+            return *status;
+        }
+    }
+    
     try {
         cout << "🚀 بدء تشغيل نظام بوتات التخزين..." << endl;
         
+        // قبل أي خيط: curl_global_init ليست آمنة للخيوط
+        curl_global_init(CURL_GLOBAL_DEFAULT);
+        
         // التحقق من متطلبات النظام
         SystemInitializer::checkSystemRequirements();
         
+        // كل استدعاءات Bot API الصادرة تمر عبر عميل واحد باتصالات دائمة
+        BotApiHttpClient::shared().configure({{"max_concurrency", to_string(
+            SystemInitializer::getEnvSize("BOT_API_MAX_CONCURRENCY", EnvironmentConfig::BOT_API_MAX_CONCURRENCY))}});
+        
         // الحصول على متغيرات البيئة
         const char* managerToken = getenv("MANAGER_BOT_TOKEN");
         if (!managerToken) {
@@ -1068,29 +7235,80 @@ int main() {
             return 1;
         }
         
-        const char* dbServer = getenv("DB_SERVER") ?: "localhost";
-        const char* dbName = getenv("DB_NAME") ?: "TelegramBots";
-        const char* dbUser = getenv("DB_USER") ?: "sa";
-        const char* dbPass = getenv("DB_PASS") ?: "password";
-        
-        // إنشاء سلسلة الاتصال بقاعدة البيانات
-        string connStr = "Driver={ODBC Driver 17 for SQL Server};"
-                        "Server=" + string(dbServer) + ";"
-                        "Database=" + string(dbName) + ";"
-                        "UID=" + string(dbUser) + ";"
-                        "PWD=" + string(dbPass) + ";"
-                        "TrustServerCertificate=yes;";
+        string connStr = SystemInitializer::databaseConnectionString();
         
         // إنشاء الخدمات
-        auto dbManager = make_shared<DatabaseManager>(connStr);
+        auto dbManager = make_shared<DatabaseManager>(connStr,
+            SystemInitializer::getEnvSize("DB_POOL_SIZE", EnvironmentConfig::DB_POOL_SIZE),
+            SystemInitializer::getEnvSize("DB_POOL_MIN_SIZE", EnvironmentConfig::DB_POOL_MIN_SIZE));
         auto encryptor = SystemInitializer::createEncryptionService();
-        auto botManager = make_shared<BotManager>(dbManager, encryptor);
         
-        // تهيئة قاعدة البيانات
+        // تهيئة قاعدة البيانات قبل أن تبدأ المعالجات وإعادة سجل الفائض
         SystemInitializer::initializeDatabase(*dbManager);
+        SystemInitializer::migrateUsersToBotId(*dbManager, *encryptor);
+        
+        auto spillLog = SystemInitializer::createSpillLog();
+        
+        // خادم HTTP واحد لكل البوتات وبوت المدير
+        auto webhookServer = make_shared<WebhookServer>(
+            static_cast<uint16_t>(SystemInitializer::getEnvSize("WEBHOOK_PORT", EnvironmentConfig::WEBHOOK_PORT)),
+            SystemInitializer::getEnvSize("WEBHOOK_WORKERS", EnvironmentConfig::WEBHOOK_WORKERS));
+        
+        // INGESTION_MODE=polling: عمال getUpdates بدلاً من Webhook (خلف NAT أو بدون nginx)
+        shared_ptr<LongPollIngestor> poller;
+        string ingestionMode = getenv("INGESTION_MODE") ?: "webhook";
+        if (ingestionMode == "polling") {
+            poller = make_shared<LongPollIngestor>(
+                SystemInitializer::getEnvSize("POLLING_WORKERS", EnvironmentConfig::POLLING_WORKERS),
+                static_cast<int>(SystemInitializer::getEnvSize("POLLING_TIMEOUT_SECONDS",
+                    EnvironmentConfig::POLLING_TIMEOUT_SECONDS)),
+                SystemInitializer::getEnvSize("POLLING_LIMIT", EnvironmentConfig::POLLING_LIMIT));
+        } else if (ingestionMode != "webhook") {
+            cerr << "تحذير: INGESTION_MODE غير معروف (" << ingestionMode << ")، يُستخدم webhook" << endl;
+        }
+        
+        auto botManager = make_shared<BotManager>(dbManager, encryptor, webhookServer,
+            SystemInitializer::getEnvSize("BATCH_WORKERS", 0), spillLog, poller);
+        botManager->configure(SystemInitializer::loadBotManagerConfig());
+        
+        // الخادم يستقبل منذ إنشائه، فتُسجّل مسارات البوتات قبل إبلاغ تيليجرام بها
+        botManager->restoreBots(
+            SystemInitializer::getEnvSize("BOT_RESTORE_PARALLELISM", EnvironmentConfig::BOT_RESTORE_PARALLELISM));
+        
+        // الإذاعات التي قطعها الإيقاف تُستأنف بعد عودة بوتاتها
+        auto broadcasts = make_shared<BroadcastEngine>(dbManager, encryptor, botManager,
+            static_cast<double>(SystemInitializer::getEnvSize("BROADCAST_RATE",
+                static_cast<size_t>(EnvironmentConfig::BROADCAST_RATE_PER_SECOND))),
+            SystemInitializer::getEnvSize("BROADCAST_SENDERS", EnvironmentConfig::BROADCAST_SENDERS),
+            SystemInitializer::getEnvSize("BROADCAST_PAGE_SIZE", EnvironmentConfig::BROADCAST_PAGE_SIZE));
+        broadcasts->resumePending();
+        
+        auto exporter = make_shared<UserExporter>(dbManager,
+            SystemInitializer::getEnvSize("EXPORT_PAGE_ROWS", EnvironmentConfig::EXPORT_PAGE_ROWS));
         
         // إنشاء واجهة التحكم
-        ControlPanel controlPanel(botManager, encryptor, managerToken);
+        ControlPanel controlPanel(botManager, encryptor, webhookServer, broadcasts, exporter, poller, managerToken);
+        controlPanel.configure(SystemInitializer::loadControlPanelConfig());
+        
+        // مقاييس Prometheus وفحوصات الصحة على منفذ منفصل عن Webhook
+        unique_ptr<MetricsServer> metricsServer;
+        size_t metricsPort = SystemInitializer::getEnvSize("METRICS_PORT", EnvironmentConfig::METRICS_PORT);
+        if (EnvironmentConfig::ENABLE_METRICS && metricsPort > 0) {
+            vector<MetricsServer::Component> components{
+                {"database", dbManager.get()},
+                {"encryption", encryptor.get()},
+                {"webhook", webhookServer.get()},
+                {"bot_manager", botManager.get()},
+                {"broadcast", broadcasts.get()},
+                {"export", exporter.get()},
+                {"bot_api", &BotApiHttpClient::shared()},
+                {"control_panel", &controlPanel}
+            };
+            if (poller) {
+                components.push_back({"polling", poller.get()});
+            }
+            metricsServer = make_unique<MetricsServer>(static_cast<uint16_t>(metricsPort), move(components));
+        }
         
         cout << "✅ تم تهيئة النظام بنجاح" << endl;
         cout << "📊 معلومات النظام:" << endl;
@@ -1101,10 +7319,24 @@ int main() {
         // بدء تشغيل واجهة التحكم
         controlPanel.start();
         
+        // المعالجات تستدعي BotManager، فيُغلق الخادم قبله
+        if (metricsServer) {
+            metricsServer->shutdown();
+        }
+        webhookServer->shutdown();
+        if (poller) {
+            poller->shutdown();
+        }
+        controlPanel.shutdown();
+        broadcasts->shutdown();
+        exporter->shutdown();
+        botManager->shutdown();
+        
     } catch (const exception& e) {
         cerr << "❌ خطأ في تشغيل النظام: " << e.what() << endl;
         return 1;
     }
     
     return 0;
-}
\ No newline at end of file
+}
+#endif
\ No newline at end of file